@@ -0,0 +1,54 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_APP_AIRTIME_H
+#define H_APP_AIRTIME_H
+
+#include <inttypes.h>
+#include "app_msg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// LoRaWAN framing overhead on the app payload : MHDR(1) + FHDR(7, no FOpts) + FPort(1) + MIC(4)
+#define LORAWAN_FRAME_OVERHEAD (13)
+
+// LoRa modulation parameters for the time on air calculation
+typedef struct {
+    uint8_t sf;             // spreading factor 7-12
+    uint16_t bwkHz;         // bandwidth 125, 250 or 500
+    uint8_t cr;             // coding rate is 4/(4+cr) ie 1-4 (LoRaWAN uses 1)
+    uint8_t preambleSyms;   // LoRaWAN uses 8
+    bool explicitHeader;    // LoRaWAN always uses explicit header
+    bool crc;               // LoRaWAN has payload crc on UL, not on DL
+} APP_CORE_LORA_MOD_t;
+
+/*
+ * Time on air in microseconds of a LoRa packet with phySz bytes of PHY payload (as per Semtech AN1200.13)
+ */
+uint32_t app_core_airtime_us(const APP_CORE_LORA_MOD_t* mod, uint8_t phySz);
+/*
+ * Time on air in microseconds of a LoRaWAN UL carrying appSz bytes of app payload, at the given SF.
+ * All regions use 125kHz for the data rates we select via SF, so the region only decides which SFs are usable, not the airtime.
+ */
+uint32_t app_core_airtime_ul_us(uint8_t sf, uint8_t appSz);
+/*
+ * Total time on air in ms of all the messages built in a UL set (ie as ready to be sent in SendingUL)
+ */
+uint32_t app_core_airtime_ulset_ms(APP_CORE_UL_t* ul, uint8_t sf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_APP_AIRTIME_H */
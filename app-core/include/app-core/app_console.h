@@ -27,6 +27,12 @@ bool consoleIsInit();
 bool isConsoleActive();
 // Allow execution of an at cmd directly
 ATRESULT execConsoleCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]);
+// Allow a module to add its own at cmd (call in its init). Returns false if no space (APP_CORE_MAX_ATCMDS)
+bool registerConsoleCmd(ATCMD_DEF_t* cmd);
+// Workload for AT+BENCH : runs it nb times and returns the total elapsed time in os_cputime ticks
+typedef uint32_t (*CONSOLE_BENCH_FN_t)(uint32_t nb);
+// Allow a module to add its own workload to AT+BENCH (call in its init). Returns false if no space
+bool registerConsoleBench(const char* name, CONSOLE_BENCH_FN_t fn);
 #ifdef __cplusplus
 }
 #endif
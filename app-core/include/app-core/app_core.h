@@ -68,12 +68,17 @@ bool AppCore_getModuleState(APP_MOD_ID_t mid);
 void AppCore_setModuleState(APP_MOD_ID_t mid, bool active);
 // Timestamp (relative to boot) of last UL (attempted)
 uint32_t AppCore_lastULTime();
+// Total time on air (ms) of the ULs sent since boot
+uint32_t AppCore_getULAirtimeMs();
 // Time in ms to next UL in theory
 uint32_t AppCore_getTimeToNextUL();
 // Get UL message to add TLVs to it (outside of getData() callbacks)
 APP_CORE_UL_t* AppCore_getUL();
 // Go for UL preparation NOW - optionally with only requested module being run. If -1 then normal data collection.
+// Ignored if a UL cycle is already running.
 bool AppCore_forceUL(int reqModule);
+// Same, but if a UL cycle is already running (eg called from a getData() callback), the forced one is done as soon as it ends.
+bool AppCore_forceULAfterCycle(int reqModule);
 // Tell core we're done processing
 void AppCore_module_done(APP_MOD_ID_t id);
 // Tell core if the device should be in the 'active' mode (default) or the inactive mode (no data collection, specific inter-UL time)
@@ -101,6 +106,9 @@ typedef enum { APP_CORE_UL_VERSION=0, APP_CORE_UL_UPTIME=1, APP_CORE_UL_CONFIG=2
     APP_CORE_UL_BLE_ERRORMASK=23, APP_CORE_UL_ENV_LASTLOGCALLER=24, APP_CORE_UL_BLE_PRESENCE=25,
     APP_CORE_UL_APP_ACK_REQ=26, 
     APP_CORE_UL_BLE_PROX_ENTER=27, APP_CORE_UL_BLE_PROX_EXIT=28,
+    APP_CORE_UL_METRICS=29,
+    APP_CORE_UL_BLE_ENTER_PACKED=30, APP_CORE_UL_BLE_EXIT_PACKED=31, APP_CORE_UL_BLE_PRESENCE_PACKED=32,
+    APP_CORE_UL_BLE_COUNT_EST=33, APP_CORE_UL_BLE_COUNT_WINDOW=34,
     // Add new generic tags in here...
     APP_CORE_UL_APP_SPECIFIC_START=240,  // from this point on, not interpreted by generic backends
 } APP_CORE_UL_TAGS;
@@ -135,6 +143,7 @@ typedef enum { APP_CORE_DL_REBOOT=1, APP_CORE_DL_SET_CONFIG=2, APP_CORE_DL_GET_C
 #define CFG_UTIL_KEY_DEVICE_ACTIVE              CFGKEY(CFG_MODULE_APP_CORE, 15)
 #define CFG_UTIL_KEY_IDLE_TIME_INACTIVE_MINS    CFGKEY(CFG_MODULE_APP_CORE, 16)
 #define CFG_UTIL_KEY_ENABLE_DEVICE_STATE_LEDS    CFGKEY(CFG_MODULE_APP_CORE, 17)
+#define CFG_UTIL_KEY_METRICS_UL_PERIOD_MINS     CFGKEY(CFG_MODULE_APP_CORE, 18)
 
 // LOra config is in app level for app-core
 #define CFG_UTIL_KEY_LORA_DEVEUI CFGKEY(CFG_MODULE_LORA, 1)
@@ -178,6 +187,25 @@ typedef enum { APP_CORE_DL_REBOOT=1, APP_CORE_DL_SET_CONFIG=2, APP_CORE_DL_GET_C
 #define CFG_UTIL_KEY_BLE_PROX_STIME_MINS        CFGKEY(CFG_MODULE_APP_MOD, 40)
 #define CFG_UTIL_KEY_BLE_PROX_SRSSI             CFGKEY(CFG_MODULE_APP_MOD, 41)
 #define CFG_UTIL_KEY_BLE_PROX_UL_REPS           CFGKEY(CFG_MODULE_APP_MOD, 42)
+#define CFG_UTIL_KEY_BLE_SCAN_MIN_TIME_MS       CFGKEY(CFG_MODULE_APP_MOD, 43)
+#define CFG_UTIL_KEY_BLE_SCAN_QUIET_MS          CFGKEY(CFG_MODULE_APP_MOD, 44)
+#define CFG_UTIL_KEY_BLE_SCAN_TARGET_PCT        CFGKEY(CFG_MODULE_APP_MOD, 45)
+#define CFG_UTIL_KEY_BLE_SCAN_MAX_TIME_MS       CFGKEY(CFG_MODULE_APP_MOD, 46)
+#define CFG_UTIL_KEY_BLE_ENTER_RSSI             CFGKEY(CFG_MODULE_APP_MOD, 47)
+#define CFG_UTIL_KEY_BLE_EXIT_RSSI              CFGKEY(CFG_MODULE_APP_MOD, 48)
+#define CFG_UTIL_KEY_BLE_EXIT_MISSED_SCANS      CFGKEY(CFG_MODULE_APP_MOD, 49)
+#define CFG_UTIL_KEY_BLE_UL_WEIGHTS             CFGKEY(CFG_MODULE_APP_MOD, 50)
+#define CFG_UTIL_KEY_BLE_UL_FLUSH_BACKLOG       CFGKEY(CFG_MODULE_APP_MOD, 51)
+#define CFG_UTIL_KEY_BLE_UL_PACKED              CFGKEY(CFG_MODULE_APP_MOD, 52)
+#define CFG_UTIL_KEY_BLE_COUNT_SKETCH           CFGKEY(CFG_MODULE_APP_MOD, 53)
+#define CFG_UTIL_KEY_BLE_COUNT_WINDOW_MINS      CFGKEY(CFG_MODULE_APP_MOD, 54)
+#define CFG_UTIL_KEY_BLE_COUNT_WINDOW_STATS     CFGKEY(CFG_MODULE_APP_MOD, 55)
+#define CFG_UTIL_KEY_BLE_ALERT_TRIGGERS         CFGKEY(CFG_MODULE_APP_MOD, 56)
+#define CFG_UTIL_KEY_BLE_ALERT_RSSI             CFGKEY(CFG_MODULE_APP_MOD, 57)
+#define CFG_UTIL_KEY_BLE_ALERT_DEBOUNCE_SCANS   CFGKEY(CFG_MODULE_APP_MOD, 58)
+#define CFG_UTIL_KEY_BLE_ALERT_MIN_INTERVAL_SECS CFGKEY(CFG_MODULE_APP_MOD, 59)
+#define CFG_UTIL_KEY_BLE_NAV_RSSI_AGG           CFGKEY(CFG_MODULE_APP_MOD, 60)
+#define CFG_UTIL_KEY_BLE_NAV_RSSI_AGG_SCANS     CFGKEY(CFG_MODULE_APP_MOD, 61)
 
 #ifdef __cplusplus
 }
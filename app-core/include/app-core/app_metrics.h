@@ -0,0 +1,61 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_APP_METRICS_H
+#define H_APP_METRICS_H
+
+#include <inttypes.h>
+#include "app_msg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fixed memory metrics registry : modules register their counters/gauges/histograms at init, and the core
+// dumps them on AT+STATS and sends what changed since the last time in an APP_CORE_UL_METRICS TLV periodically.
+// Metric ids are the registration order, so are stable for a given firmware (AT+STATS shows the id->name mapping)
+typedef enum { APP_CORE_METRIC_COUNTER=0, APP_CORE_METRIC_GAUGE=1, APP_CORE_METRIC_HISTO=2 } APP_CORE_METRIC_TYPE_t;
+typedef uint8_t APP_CORE_METRIC_ID_t;
+#define APP_CORE_METRIC_NONE (0xFF)     // id returned when registry is full : using it is ok, its just ignored
+// Histograms have log2 buckets : 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+
+#define APP_CORE_METRIC_HISTO_NB (8)
+
+/*
+ * Register a metric. Registering the same name again (with same type) returns the existing id, so modules can share one.
+ * <returns>Returns the metric id, or APP_CORE_METRIC_NONE if no space left (APP_CORE_MAX_METRICS / APP_CORE_MAX_METRIC_HISTOS)</returns>
+ */
+APP_CORE_METRIC_ID_t app_core_metrics_register(const char* name, APP_CORE_METRIC_TYPE_t type);
+// Counters
+void app_core_metrics_inc(APP_CORE_METRIC_ID_t id);
+void app_core_metrics_add(APP_CORE_METRIC_ID_t id, uint32_t n);
+// Gauges
+void app_core_metrics_set(APP_CORE_METRIC_ID_t id, int32_t v);
+// Histograms : count the value in its bucket
+void app_core_metrics_histo(APP_CORE_METRIC_ID_t id, uint32_t v);
+
+// Access for AT+STATS
+uint8_t app_core_metrics_nb();
+// Get metric info. Returns false if no such id. buckets must have space for APP_CORE_METRIC_HISTO_NB values (or be NULL)
+bool app_core_metrics_get(APP_CORE_METRIC_ID_t id, const char** name, APP_CORE_METRIC_TYPE_t* type, int32_t* value, uint32_t* buckets);
+
+/*
+ * Add the metrics that changed since the last export to the UL, if periodMins has elapsed since then (or if the last one
+ * didn't fit in 1 TLV). periodMins=0 means never.
+ * <returns>Returns true if a TLV was added</returns>
+ */
+bool app_core_metrics_ul_add(APP_CORE_UL_t* ul, uint32_t periodMins);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_APP_METRICS_H */
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+/**
+ * LoRa time on air calculation, to know what each UL cycle costs us
+ */
+
+#include "os/os.h"
+
+#include "app-core/app_msg.h"
+#include "app-core/app_airtime.h"
+
+uint32_t app_core_airtime_us(const APP_CORE_LORA_MOD_t* mod, uint8_t phySz) {
+    int sf = mod->sf;
+    int bwkHz = mod->bwkHz;
+    if (sf<6 || sf>12 || bwkHz<=0) {
+        return 0;       // not a lora modulation we know
+    }
+    // symbol time in us : exact for 125/250/500kHz
+    uint32_t tsymUS = ((1u<<sf)*1000u) / bwkHz;
+    // low data rate optimisation is mandated when symbol time >= 16ms (SF11/12 at 125kHz)
+    int de = (tsymUS>=16000) ? 1 : 0;
+    int num = (8*phySz) - (4*sf) + 28 + (mod->crc ? 16 : 0) - (mod->explicitHeader ? 0 : 20);
+    int den = 4*(sf - (2*de));
+    int nPayloadSyms = 8;
+    if (num>0) {
+        nPayloadSyms += ((num + den - 1) / den) * (mod->cr + 4);       // ceil()
+    }
+    // preamble is (n + 4.25) symbols
+    uint32_t tPreambleUS = ((4*mod->preambleSyms + 17) * tsymUS) / 4;
+    return tPreambleUS + (nPayloadSyms * tsymUS);
+}
+
+uint32_t app_core_airtime_ul_us(uint8_t sf, uint8_t appSz) {
+    APP_CORE_LORA_MOD_t mod = {
+        .sf = sf,
+        .bwkHz = 125,
+        .cr = 1,
+        .preambleSyms = 8,
+        .explicitHeader = true,
+        .crc = true,
+    };
+    return app_core_airtime_us(&mod, appSz + LORAWAN_FRAME_OVERHEAD);
+}
+
+uint32_t app_core_airtime_ulset_ms(APP_CORE_UL_t* ul, uint8_t sf) {
+    uint32_t totalUS = 0;
+    for(int i=0;i<=ul->msgNbFilling && i<APP_CORE_UL_MAX_NB;i++) {
+        // same rule as tx : any message with a size (even just the header) is sent
+        if (ul->msgs[i].sz>0) {
+            totalUS += app_core_airtime_ul_us(sf, ul->msgs[i].sz);
+        }
+    }
+    return (totalUS+500)/1000;
+}
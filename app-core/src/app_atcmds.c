@@ -26,6 +26,8 @@
 
 #include "app-core/app_core.h"
 #include "app-core/app_console.h"
+#include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 
 /**
  *  AT Commands for appcore in idle mode
@@ -523,6 +525,7 @@ static ATRESULT atcmd_linfo(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
 
     // join status
     (*pfn)("LoRa Status: JOINED[%s]", lora_api_isJoined()?"YES":"NO");
+    (*pfn)("LoRa UL airtime since boot[%d ms]", AppCore_getULAirtimeMs());
     // current SF, tx power, ADR status
 //    (*pfn)("LoRa SF[%d] TXPower[%d] ADR[%d]", lora_api_get_sf(), lora_api_get_txpower(), lora_api_get_adr());
     // devaddr/newkskey/appskey
@@ -532,7 +535,133 @@ static ATRESULT atcmd_linfo(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
     return ATCMD_PROCESSED;
 }
 
-static ATCMD_DEF_t ATCMDS[] = {
+static ATRESULT atcmd_stats(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    // Dump all the registered metrics, with their id as used in the UL
+    for(int i=0;i<app_core_metrics_nb();i++) {
+        const char* name;
+        APP_CORE_METRIC_TYPE_t type;
+        int32_t value;
+        uint32_t b[APP_CORE_METRIC_HISTO_NB];
+        if (app_core_metrics_get(i, &name, &type, &value, b)) {
+            if (type==APP_CORE_METRIC_HISTO) {
+                (*pfn)("%02d %s[%d] : %d/%d/%d/%d/%d/%d/%d/%d", i, name, value, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+            } else {
+                (*pfn)("%02d %s[%d]", i, name, value);
+            }
+        }
+    }
+    return ATCMD_PROCESSED;
+}
+
+// AT+BENCH : fixed workloads to compare MCUs/compiler flags on the real hw. Times are in os_cputime ticks (and us)
+#define MAX_BENCH_HOOKS (4)
+#define BENCH_DEFAULT_NB (100)
+#define BENCH_MAX_CFGSETS (10)      // config sets may write the eeprom, so don't do too many
+static struct {
+    APP_CORE_UL_t ul;       // not on the stack please
+    APP_CORE_DL_t dl;
+    struct {
+        const char* name;
+        CONSOLE_BENCH_FN_t fn;
+    } hooks[MAX_BENCH_HOOKS];
+    uint8_t nbHooks;
+} _bench;
+
+static void benchResult(PRINTLN_t pfn, const char* name, uint32_t nb, uint32_t ticks) {
+    uint32_t us = os_cputime_ticks_to_usecs(ticks);
+    (*pfn)("%s x%d : %d ticks (%d us), %d us each", name, nb, ticks, us, (nb>0?(us/nb):0));
+}
+// Fill all the UL messages with TLVs and finalise each for tx, as done for a full UL cycle
+static void benchULEncode() {
+    uint8_t v[APP_CORE_UL_MAX_SZ];
+    for(int i=0;i<sizeof(v);i++) {
+        v[i] = i;
+    }
+    app_core_msg_ul_init(&_bench.ul);
+    // 10 byte values ie 4 per message
+    while(app_core_msg_ul_addTLV(&_bench.ul, APP_CORE_UL_APP_SPECIFIC_START, 10, v)) {
+    }
+    while(app_core_msg_ul_prepareNextTx(&_bench.ul, 0, false)>0) {
+    }
+}
+// Build a max size DL (max nb of actions that fit in APP_CORE_DL_MAX_SZ) of GET_MODS actions which do nothing but log
+static void benchDLBuild() {
+    app_core_msg_dl_init(&_bench.dl);
+    int nbActions = 0x0f;
+    int alen = ((APP_CORE_DL_MAX_SZ-2)/nbActions)-2;
+    _bench.dl.payload[0] = 0x06 | (APP_CORE_MSGS_VERSION_DL<<4);       // msg type 6, already even parity
+    _bench.dl.payload[1] = nbActions;                       // dlId 0
+    int off = 2;
+    for(int i=0;i<nbActions;i++) {
+        _bench.dl.payload[off++] = APP_CORE_DL_GET_MODS;
+        _bench.dl.payload[off++] = alen;
+        off += alen;
+    }
+    _bench.dl.sz = off;
+}
+
+static ATRESULT atcmd_bench(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    uint32_t nb = BENCH_DEFAULT_NB;
+    if (nargs>1) {
+        if (sscanf(argv[1], "%u", &nb)<1 || nb==0) {
+            (*pfn)("AT+BENCH [nb iterations]");
+            return ATCMD_BADARG;
+        }
+    }
+    // UL encode of a full set
+    uint32_t start = os_cputime_get32();
+    for(int i=0;i<nb;i++) {
+        benchULEncode();
+    }
+    benchResult(pfn, "UL encode 4 msgs", nb, os_cputime_get32() - start);
+    // DL decode and execute (note this includes the actions' logging)
+    benchDLBuild();
+    start = os_cputime_get32();
+    for(int i=0;i<nb;i++) {
+        if (app_core_msg_dl_decode(&_bench.dl)) {
+            app_core_msg_dl_execute(&_bench.dl);
+        }
+    }
+    benchResult(pfn, "DL decode/exec 15 actions", nb, os_cputime_get32() - start);
+    // config get/set round trips, setting back the value we read so nothing changes
+    uint8_t cv[16];
+    int cl = CFMgr_getElement(CFG_UTIL_KEY_MAXTIME_UL_MINS, cv, sizeof(cv));
+    start = os_cputime_get32();
+    for(int i=0;i<nb;i++) {
+        CFMgr_getElement(CFG_UTIL_KEY_MAXTIME_UL_MINS, cv, sizeof(cv));
+    }
+    benchResult(pfn, "config get", nb, os_cputime_get32() - start);
+    if (cl>0) {
+        uint32_t nbSets = (nb<BENCH_MAX_CFGSETS?nb:BENCH_MAX_CFGSETS);
+        start = os_cputime_get32();
+        for(int i=0;i<nbSets;i++) {
+            CFMgr_setElement(CFG_UTIL_KEY_MAXTIME_UL_MINS, cv, cl);
+            CFMgr_getElement(CFG_UTIL_KEY_MAXTIME_UL_MINS, cv, sizeof(cv));
+        }
+        benchResult(pfn, "config set/get", nbSets, os_cputime_get32() - start);
+    }
+    // and those added by the modules
+    for(int i=0;i<_bench.nbHooks;i++) {
+        benchResult(pfn, _bench.hooks[i].name, nb, (*_bench.hooks[i].fn)(nb));
+    }
+    return ATCMD_PROCESSED;
+}
+
+// Modules can add a workload to AT+BENCH (call from their init).
+bool registerConsoleBench(const char* name, CONSOLE_BENCH_FN_t fn) {
+    if (_bench.nbHooks>=MAX_BENCH_HOOKS) {
+        log_warn("AC:no space for bench %s", name);
+        return false;
+    }
+    _bench.hooks[_bench.nbHooks].name = name;
+    _bench.hooks[_bench.nbHooks].fn = fn;
+    _bench.nbHooks++;
+    return true;
+}
+
+// Core commands, plus space for those added by modules (see registerConsoleCmd())
+#define MAX_ATCMDS  (MYNEWT_VAL(APP_CORE_MAX_ATCMDS))
+static ATCMD_DEF_t ATCMDS[MAX_ATCMDS] = {
     { .cmd="AT", .desc="Wakeup", atcmd_hello},
     { .cmd="AT+HELLO", .desc="Wakeup", atcmd_hello},
     { .cmd="AT+WHO", .desc="Dsplay card type", atcmd_who},
@@ -553,9 +682,19 @@ static ATCMD_DEF_t ATCMDS[] = {
     { .cmd="AT+TX", .desc="LoRa TX", atcmd_tx},
     { .cmd="AT+RX", .desc="LoRa RX", atcmd_rx},
     { .cmd="AT+LINFO", .desc="LoRa info", atcmd_linfo},
+    { .cmd="AT+STATS", .desc="Show metrics", atcmd_stats},
+    { .cmd="AT+BENCH", .desc="Run processing benchmarks", atcmd_bench},
 };
+// Number of commands actually defined in the table (unused entries have no cmd)
+static uint8_t nbATCmds() {
+    uint8_t cl = 0;
+    while(cl<MAX_ATCMDS && ATCMDS[cl].cmd!=NULL) {
+        cl++;
+    }
+    return cl;
+}
 static ATRESULT atcmd_listcmds(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
-    uint8_t cl = sizeof(ATCMDS)/sizeof(ATCMDS[0]);
+    uint8_t cl = nbATCmds();
     for(int i=0;i<cl;i++) {
         (*pfn)("%s: %s", ATCMDS[i].cmd, ATCMDS[i].desc);
     }
@@ -565,7 +704,7 @@ static ATRESULT atcmd_listcmds(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
 // Allow a function to execute an at command found in argv[0] of the parsed command line, and output to the given println fn
 ATRESULT execConsoleCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
     // find it in the list
-    uint8_t cl = sizeof(ATCMDS)/sizeof(ATCMDS[0]);
+    uint8_t cl = nbATCmds();
     for(int i=0;i<cl;i++) {
         if (strcmp(argv[0], ATCMDS[i].cmd)==0) {
             // gotcha
@@ -578,12 +717,23 @@ ATRESULT execConsoleCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
     return ATCMD_GENERR;
 }
 
+// Modules can add their own commands (call from their init, ie before console is started). Returns false if no space left.
+bool registerConsoleCmd(ATCMD_DEF_t* cmd) {
+    uint8_t cl = nbATCmds();
+    if (cl>=MAX_ATCMDS) {
+        log_warn("AC:no space for atcmd %s", cmd->cmd);
+        return false;
+    }
+    ATCMDS[cl] = *cmd;
+    return true;
+}
+
 void initConsole() {
     wconsole_mgr_init(MYNEWT_VAL(WCONSOLE_UART_DEV), MYNEWT_VAL(WCONSOLE_UART_BAUD), MYNEWT_VAL(WCONSOLE_UART_SELECT));
 }
 bool startConsole() {
     if (wconsole_isInit()) {
-        uint8_t cl = sizeof(ATCMDS)/sizeof(ATCMDS[0]);
+        uint8_t cl = nbATCmds();
         log_debug("AC:console starts with %d commands", cl);
         // start with our command set, no idle timeout
         wconsole_start(cl, ATCMDS, 0);
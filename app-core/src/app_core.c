@@ -29,6 +29,8 @@
 #include "app-core/app_console.h"
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_airtime.h"
+#include "app-core/app_metrics.h"
 
 //MYNEWT_VAL(APP_CORE_MAX_MODS) - fix max number of modules that may be defined in a specific target 
 #define MAX_MODS (8)        
@@ -59,10 +61,13 @@ static struct appctx
     uint8_t modsMask[MOD_MASK_SZ]; // bit mask to indicate if module is active or not currently
     int currentSerialModIdx;
     int requestedModule; // If forced UL then it may request only one module is run
+    bool forceULPending; // UL asked for by AppCore_forceULAfterCycle(), not yet started (asked during a cycle, when it can't be)
+    void *forceULData;   // and its event data
     bool ulIsCrit;       // during data collection, module can signal critical data change ie must send UL
     APP_CORE_UL_t txmsg; // for building UL messages
     APP_CORE_DL_t rxmsg; // for decoding DL messages
     uint32_t lastULTime; // timestamp of last uplink in seconds since boot
+    uint32_t ulAirtimeMs; // total time on air of the ULs we have sent since boot (at the configured SF)
     uint32_t idleTimeMovingSecs;
     uint32_t idleTimeNotMovingMins;
     uint32_t idleTimeInactiveMins;
@@ -71,6 +76,7 @@ static struct appctx
     uint32_t idleStartTS; // In seconds since epoch
     uint32_t joinStartTS; // in seconds since epoch
     uint32_t maxTimeBetweenULMins;
+    uint32_t metricsULPeriodMins;
     bool doReboot;
     uint8_t notStockMode;
     uint32_t joinTimeCheckSecs;
@@ -94,6 +100,14 @@ static struct appctx
         uint8_t appkey[16];
     } loraCfg;
     APP_CORE_FW_t fw;
+    struct {
+        APP_CORE_METRIC_ID_t txOk;
+        APP_CORE_METRIC_ID_t txRetry;
+        APP_CORE_METRIC_ID_t txNotJoin;
+        APP_CORE_METRIC_ID_t joinAttempts;
+        APP_CORE_METRIC_ID_t ulAirtimeMs;
+        APP_CORE_METRIC_ID_t ulSz;
+    } metrics;
 } _ctx = {
     .doReboot = false,
     .deviceActive = 1,
@@ -112,6 +126,7 @@ static struct appctx
     .notStockMode = 0, // in stock mode by default until a rejoin works
     .modSetupTimeSecs = 3,
     .maxTimeBetweenULMins = 120, // 2 hours
+    .metricsULPeriodMins = MYNEWT_VAL(METRICS_UL_PERIOD_MINS),     // 1 day
     .lastULTime = 0,
     .lastDLId = 0, // default when new, will be read from the config mgr
     .loraCfg = {
@@ -199,6 +214,7 @@ static void configChangedCB(void* ctx, uint16_t key)
     CFMgr_getOrAddElement(CFG_UTIL_KEY_JOIN_TIMEOUT_SECS, &_ctx.joinTimeCheckSecs, sizeof(uint32_t));
     CFMgr_getOrAddElement(CFG_UTIL_KEY_RETRY_JOIN_TIME_MINS, &_ctx.rejoinWaitMins, sizeof(uint32_t));
     CFMgr_getOrAddElement(CFG_UTIL_KEY_RETRY_JOIN_TIME_SECS, &_ctx.rejoinWaitSecs, sizeof(uint32_t));
+    CFMgr_getOrAddElement(CFG_UTIL_KEY_METRICS_UL_PERIOD_MINS, &_ctx.metricsULPeriodMins, sizeof(uint32_t));
 }
 static bool isModActive(uint8_t *mask, APP_MOD_ID_t id)
 {
@@ -349,6 +365,7 @@ static SM_STATE_ID_t State_Startup(void *arg, int e, void *data)
     // Force UL is how we say go...
     case ME_FORCE_UL:
     {
+        ctx->forceULPending = false;
         // Can we go for normal operation?
         if (ctx->deviceConfigOk)
         {
@@ -507,6 +524,7 @@ static SM_STATE_ID_t State_WaitJoinRetry(void *arg, int e, void *data)
         checkReboot(ctx);
         // Start the retry join timeout
         ctx->nbJoinAttempts++;
+        app_core_metrics_inc(ctx->metrics.joinAttempts);
         // We are allowing up to X tries with just Y second intervals, after which we go to a longer timeout of Z mins
         uint8_t maxrapid = 3; // Default of 3 goes before sleeping a long time
         CFMgr_getOrAddElement(CFG_UTIL_KEY_MAX_RAPID_JOIN_ATTEMPTS, &maxrapid, 1);
@@ -571,6 +589,13 @@ static SM_STATE_ID_t State_Idle(void *arg, int e, void *data)
         //Initialise the DM we're sending next time -> this means executed actions can start to fill it during idle time
         app_core_msg_ul_init(&ctx->txmsg);
         ctx->ulIsCrit = false; // assume we're not gonna send it (its not critical)
+        if (ctx->forceULPending)
+        {
+            // a module asked for a UL while we were busy : go again straight away
+            log_debug("AC:pending forced UL");
+            sm_sendEvent(ctx->mySMId, ME_FORCE_UL, ctx->forceULData);
+            return SM_STATE_CURRENT;
+        }
         if (ctx->idleTimeMovingSecs == 0)
         {
             // no idleness, this device runs continuously... (eg if its powered)
@@ -661,6 +686,11 @@ static SM_STATE_ID_t State_Idle(void *arg, int e, void *data)
     {
         // another module woke us up...
         // potentially deal with request to only run 1 module.... data is either NULL or 1000+module id
+        // (a full cycle, or the one that was pending, does what was pending)
+        if (data == NULL || data == ctx->forceULData)
+        {
+            ctx->forceULPending = false;
+        }
         _ctx.requestedModule = -1;
         if (data != NULL)
         {
@@ -856,6 +886,8 @@ static SM_STATE_ID_t State_GettingParallelMods(void *arg, int e, void *data)
         ctx->ulIsCrit |= ((TMMgr_getRelTimeSecs() - ctx->lastULTime) > (ctx->maxTimeBetweenULMins * 60));
         if (ctx->ulIsCrit)
         {
+            // Metrics go along with the UL when its time (only now we know it will be sent)
+            app_core_metrics_ul_add(&ctx->txmsg, ctx->metricsULPeriodMins);
             return MS_SENDING_UL;
         }
         else
@@ -883,7 +915,12 @@ static LORA_TX_RESULT_t tryTX(struct appctx *ctx, bool willListen)
         if (txres == LORAWAN_RES_OK)
         {
             res = LORA_TX_OK;
-            log_info("AC:UL tx req SF %d, ack %d, listen %d, sz %d", ctx->loraCfg.loraSF, ctx->loraCfg.useAck, willListen, txsz);
+            // Note if ADR is on the stack may actually use a different SF, this is what it costs at the configured one
+            uint32_t airtimeMs = (app_core_airtime_ul_us(ctx->loraCfg.loraSF, txsz)+500)/1000;
+            ctx->ulAirtimeMs += airtimeMs;
+            app_core_metrics_add(ctx->metrics.ulAirtimeMs, airtimeMs);
+            app_core_metrics_histo(ctx->metrics.ulSz, txsz);
+            log_info("AC:UL tx req SF %d, ack %d, listen %d, sz %d, airtime %d ms", ctx->loraCfg.loraSF, ctx->loraCfg.useAck, willListen, txsz, airtimeMs);
         }
         else
         {
@@ -910,6 +947,7 @@ static SM_STATE_ID_t State_SendingUL(void *arg, int e, void *data)
         // start leds for UL
         ledStart(MYNEWT_VAL(NET_ACTIVE_LED), FLASH_5HZ, -1);
         log_debug("UL has %d elements, sz %d %d %d %d", ctx->txmsg.msgNbFilling, ctx->txmsg.msgs[0].sz, ctx->txmsg.msgs[1].sz, ctx->txmsg.msgs[2].sz, ctx->txmsg.msgs[3].sz);
+        log_info("AC:UL set airtime %d ms at SF %d (region %d)", app_core_airtime_ulset_ms(&ctx->txmsg, ctx->loraCfg.loraSF), ctx->loraCfg.loraSF, ctx->fw.loraregion);
         LORA_TX_RESULT_t res = tryTX(ctx, true);
         if (res == LORA_TX_OK)
         {
@@ -955,17 +993,20 @@ static SM_STATE_ID_t State_SendingUL(void *arg, int e, void *data)
         {
             log_info("AC:tx : ACKD");
             ctx->lastULTime = TMMgr_getRelTimeSecs();
+            app_core_metrics_inc(ctx->metrics.txOk);
             break;
         }
         case LORA_TX_OK:
         {
             log_info("AC:tx : OK");
             ctx->lastULTime = TMMgr_getRelTimeSecs();
+            app_core_metrics_inc(ctx->metrics.txOk);
             break;
         }
         case LORA_TX_ERR_RETRY:
         {
             log_warn("AC:tx : fail:retry");
+            app_core_metrics_inc(ctx->metrics.txRetry);
             // Step back one in ULs so that next tryTx gets same one to retry
             // TODO                    app_core_msg_ul_retry(&ctx->txmsg);
             break;
@@ -974,6 +1015,7 @@ static SM_STATE_ID_t State_SendingUL(void *arg, int e, void *data)
         {
             // Retry join here? change the SF? TODO
             log_warn("AC:tx : fail : notJOIN?");
+            app_core_metrics_inc(ctx->metrics.txNotJoin);
             return MS_IDLE;
         }
         case LORA_TX_ERR_FATAL:
@@ -1062,8 +1104,17 @@ void app_core_start(int fwmaj, int fwmin, int fwbuild, const char *fwdate, const
     CFMgr_getOrAddElement(CFG_UTIL_KEY_STOCK_MODE, &_ctx.notStockMode, sizeof(uint8_t));
     CFMgr_getOrAddElement(CFG_UTIL_KEY_DEVICE_ACTIVE, &_ctx.deviceActive, sizeof(uint8_t));
     CFMgr_getOrAddElement(CFG_UTIL_KEY_ENABLE_DEVICE_STATE_LEDS, &_ctx.enableStateLeds, sizeof(uint8_t));
+    CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_METRICS_UL_PERIOD_MINS, &_ctx.metricsULPeriodMins, 0, 7 * 24 * 60);
     CFMgr_registerCB(configChangedCB); // For changes to our config
 
+    // Our metrics (the modules register theirs in their init)
+    _ctx.metrics.txOk = app_core_metrics_register("tx_ok", APP_CORE_METRIC_COUNTER);
+    _ctx.metrics.txRetry = app_core_metrics_register("tx_retry", APP_CORE_METRIC_COUNTER);
+    _ctx.metrics.txNotJoin = app_core_metrics_register("tx_notjoin", APP_CORE_METRIC_COUNTER);
+    _ctx.metrics.joinAttempts = app_core_metrics_register("join_tries", APP_CORE_METRIC_COUNTER);
+    _ctx.metrics.ulAirtimeMs = app_core_metrics_register("ul_airtime_ms", APP_CORE_METRIC_COUNTER);
+    _ctx.metrics.ulSz = app_core_metrics_register("ul_sz", APP_CORE_METRIC_HISTO);
+
     registerActions();
     // register to be able to change LowPower mode (no callback as we don't care about lp changes...)
     _ctx.lpUserId = LPMgr_register(NULL);
@@ -1240,6 +1291,11 @@ uint32_t AppCore_lastULTime()
 {
     return _ctx.lastULTime;
 }
+// Total time on air of ULs sent since boot in ms
+uint32_t AppCore_getULAirtimeMs()
+{
+    return _ctx.ulAirtimeMs;
+}
 // Time in ms to next UL
 uint32_t AppCore_getTimeToNextUL()
 {
@@ -1261,6 +1317,19 @@ bool AppCore_forceUL(int reqModule)
     }
     return sm_sendEvent(_ctx.mySMId, ME_FORCE_UL, ed);
 }
+// Same, but if a UL cycle is running the request is kept and done on going idle at its end
+bool AppCore_forceULAfterCycle(int reqModule)
+{
+    void *ed = NULL;
+    if (reqModule >= 0 && reqModule < APP_MOD_LAST)
+    {
+        ed = (void *)(1000 + reqModule);
+    }
+    // The event is only acted on when idle : if we're not, going idle starts it
+    _ctx.forceULPending = true;
+    _ctx.forceULData = ed;
+    return sm_sendEvent(_ctx.mySMId, ME_FORCE_UL, ed);
+}
 
 // Tell core we're done processing
 void AppCore_module_done(APP_MOD_ID_t id)
@@ -0,0 +1,225 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+/**
+ * Metrics registry : counters, gauges and small histograms that modules can update, exported by AT+STATS and in UL
+ */
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/timemgr.h"
+
+#include "app-core/app_core.h"
+#include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
+
+#define MAX_METRICS (MYNEWT_VAL(APP_CORE_MAX_METRICS))
+#define MAX_HISTOS (MYNEWT_VAL(APP_CORE_MAX_METRIC_HISTOS))
+// ids are sent in 6 bits
+#if MYNEWT_VAL(APP_CORE_MAX_METRICS) > 64
+#error "APP_CORE_MAX_METRICS must be <= 64"
+#endif
+// Largest entry in the UL TLV is a histo with all buckets changed : id, mask, and 3 bytes max per bucket
+#define MAX_UL_ENTRY_SZ (2+(APP_CORE_METRIC_HISTO_NB*3))
+
+static struct {
+    struct {
+        const char* name;
+        uint8_t type;
+        uint8_t histoIdx;
+        int32_t value;          // count for counters/histos, current value for gauges
+        int32_t sent;           // value as at last UL export
+    } metrics[MAX_METRICS];
+    uint8_t nbMetrics;
+    struct {
+        uint16_t buckets[APP_CORE_METRIC_HISTO_NB];
+        uint16_t sent[APP_CORE_METRIC_HISTO_NB];
+    } histos[MAX_HISTOS];
+    uint8_t nbHistos;
+    uint32_t lastExportS;       // time of last export in secs since boot
+    bool pending;               // last export didn't fit
+} _ctx;     // all 0 as bss
+
+// unsigned LEB128 ie 7 bits per byte with b7 set if more to come
+static uint8_t writeVarint(uint8_t* b, uint32_t v) {
+    uint8_t n = 0;
+    while (v>=0x80) {
+        b[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    return n;
+}
+static uint8_t histoBucket(uint32_t v) {
+    uint8_t b = 0;
+    while (v>0 && b<(APP_CORE_METRIC_HISTO_NB-1)) {
+        v >>= 1;
+        b++;
+    }
+    return b;
+}
+
+APP_CORE_METRIC_ID_t app_core_metrics_register(const char* name, APP_CORE_METRIC_TYPE_t type) {
+    for(int i=0;i<_ctx.nbMetrics;i++) {
+        if (strcmp(_ctx.metrics[i].name, name)==0) {
+            if (_ctx.metrics[i].type==type) {
+                return i;
+            }
+            log_warn("AC:metric %s already registered with type %d", name, _ctx.metrics[i].type);
+            return APP_CORE_METRIC_NONE;
+        }
+    }
+    if (_ctx.nbMetrics>=MAX_METRICS || (type==APP_CORE_METRIC_HISTO && _ctx.nbHistos>=MAX_HISTOS)) {
+        log_warn("AC:no space for metric %s", name);
+        return APP_CORE_METRIC_NONE;
+    }
+    APP_CORE_METRIC_ID_t id = _ctx.nbMetrics++;
+    _ctx.metrics[id].name = name;
+    _ctx.metrics[id].type = type;
+    if (type==APP_CORE_METRIC_HISTO) {
+        _ctx.metrics[id].histoIdx = _ctx.nbHistos++;
+    }
+    return id;
+}
+
+void app_core_metrics_inc(APP_CORE_METRIC_ID_t id) {
+    app_core_metrics_add(id, 1);
+}
+void app_core_metrics_add(APP_CORE_METRIC_ID_t id, uint32_t n) {
+    if (id<_ctx.nbMetrics && _ctx.metrics[id].type==APP_CORE_METRIC_COUNTER) {
+        _ctx.metrics[id].value += n;        // wraps, the UL delta copes
+    }
+}
+void app_core_metrics_set(APP_CORE_METRIC_ID_t id, int32_t v) {
+    if (id<_ctx.nbMetrics && _ctx.metrics[id].type==APP_CORE_METRIC_GAUGE) {
+        _ctx.metrics[id].value = v;
+    }
+}
+void app_core_metrics_histo(APP_CORE_METRIC_ID_t id, uint32_t v) {
+    if (id<_ctx.nbMetrics && _ctx.metrics[id].type==APP_CORE_METRIC_HISTO) {
+        _ctx.histos[_ctx.metrics[id].histoIdx].buckets[histoBucket(v)]++;
+        _ctx.metrics[id].value++;
+    }
+}
+
+uint8_t app_core_metrics_nb() {
+    return _ctx.nbMetrics;
+}
+bool app_core_metrics_get(APP_CORE_METRIC_ID_t id, const char** name, APP_CORE_METRIC_TYPE_t* type, int32_t* value, uint32_t* buckets) {
+    if (id>=_ctx.nbMetrics) {
+        return false;
+    }
+    *name = _ctx.metrics[id].name;
+    *type = _ctx.metrics[id].type;
+    *value = _ctx.metrics[id].value;
+    if (buckets!=NULL) {
+        for(int i=0;i<APP_CORE_METRIC_HISTO_NB;i++) {
+            buckets[i] = (_ctx.metrics[id].type==APP_CORE_METRIC_HISTO) ? _ctx.histos[_ctx.metrics[id].histoIdx].buckets[i] : 0;
+        }
+    }
+    return true;
+}
+
+// Write the entry for this metric if it changed since last export. Returns bytes written (0 if unchanged)
+static uint8_t writeEntry(APP_CORE_METRIC_ID_t id, uint8_t* b) {
+    if (_ctx.metrics[id].value==_ctx.metrics[id].sent) {
+        return 0;       // nothing new (note histos count every value so this works for them too)
+    }
+    uint8_t n = 0;
+    b[n++] = (_ctx.metrics[id].type<<6) | id;
+    switch(_ctx.metrics[id].type) {
+        case APP_CORE_METRIC_COUNTER: {
+            n += writeVarint(&b[n], (uint32_t)(_ctx.metrics[id].value - _ctx.metrics[id].sent));
+            break;
+        }
+        case APP_CORE_METRIC_GAUGE: {
+            // zigzag so small negative values are small too
+            int32_t v = _ctx.metrics[id].value;
+            n += writeVarint(&b[n], ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+            break;
+        }
+        case APP_CORE_METRIC_HISTO: {
+            // mask of the buckets that changed, then the delta for each of them
+            uint8_t* mask = &b[n++];
+            *mask = 0;
+            for(int i=0;i<APP_CORE_METRIC_HISTO_NB;i++) {
+                uint16_t d = _ctx.histos[_ctx.metrics[id].histoIdx].buckets[i] - _ctx.histos[_ctx.metrics[id].histoIdx].sent[i];
+                if (d!=0) {
+                    *mask |= (1<<i);
+                    n += writeVarint(&b[n], d);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return n;
+}
+static void markSent(APP_CORE_METRIC_ID_t id) {
+    _ctx.metrics[id].sent = _ctx.metrics[id].value;
+    if (_ctx.metrics[id].type==APP_CORE_METRIC_HISTO) {
+        memcpy(_ctx.histos[_ctx.metrics[id].histoIdx].sent, _ctx.histos[_ctx.metrics[id].histoIdx].buckets,
+            sizeof(_ctx.histos[0].sent));
+    }
+}
+
+// TLV value : 2 bytes LE minutes since previous export, then for each changed metric 1 byte (b6-7 type, b0-5 id) followed by
+// counter : varint delta, gauge : zigzag varint value, histo : 1 byte mask of changed buckets then varint delta for each
+bool app_core_metrics_ul_add(APP_CORE_UL_t* ul, uint32_t periodMins) {
+    uint32_t now = TMMgr_getRelTimeSecs();
+    if (periodMins==0 || (!_ctx.pending && (now - _ctx.lastExportS) < (periodMins*60))) {
+        return false;
+    }
+    uint8_t v[APP_CORE_UL_MAX_SZ];
+    uint8_t maxsz = app_core_msg_ul_maxBlockSz() - 2;       // TL header
+    uint32_t mins = (now - _ctx.lastExportS)/60;
+    Util_writeLE_uint16_t(v, 0, (mins>0xFFFF ? 0xFFFF : mins));
+    uint8_t sz = 2;
+    _ctx.pending = false;
+    for(int i=0;i<_ctx.nbMetrics;i++) {
+        uint8_t entry[MAX_UL_ENTRY_SZ];
+        uint8_t esz = writeEntry(i, entry);
+        if (esz==0) {
+            continue;
+        }
+        if ((sz + esz) > maxsz) {
+            // rest goes in the next UL
+            _ctx.pending = true;
+            break;
+        }
+        memcpy(&v[sz], entry, esz);
+        sz += esz;
+    }
+    if (sz<=2) {
+        return false;       // nothing changed, keep the period running
+    }
+    if (!app_core_msg_ul_addTLV(ul, APP_CORE_UL_METRICS, sz, v)) {
+        log_debug("AC:no space for metrics in UL");
+        _ctx.pending = true;
+        return false;
+    }
+    // only mark as sent what was actually added
+    for(int i=0, off=2;i<_ctx.nbMetrics && off<sz;i++) {
+        uint8_t entry[MAX_UL_ENTRY_SZ];
+        uint8_t esz = writeEntry(i, entry);
+        if (esz>0) {
+            markSent(i);
+            off += esz;
+        }
+    }
+    _ctx.lastExportS = now;
+    log_info("AC:metrics %d bytes to UL (%d mins)", sz, mins);
+    return true;
+}
@@ -19,65 +19,98 @@
 
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/configmgr.h"
+#include "wyres-generic/timemgr.h"
 #include "wyres-generic/wblemgr.h"
 #include "cbor.h"
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 #include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_navsel.h"
+#include "mod-ble/ble_arena.h"
+#include "mod-ble/ble_scan.h"
+#include "mod-ble/ble_trace.h"
 
 // How many ibeacons will we deal with?
 // Keep history between scans of this number
 #define MAX_BLE_TOSCAN  (16)     
 // Max number we send up (the 'best' rssi ones)
 #define MAX_BLE_TOSEND MYNEWT_VAL(MOD_BLE_MAXIBS_ALERT)
+// Beacons we keep the last scans rssi of for the aggregation
+#define NAV_HIST_SZ (MYNEWT_VAL(MOD_BLE_NAV_HIST_SZ))
+// The table and nav history must fit in the BLE arena
+BLE_ARENA_CHECK_FITS(arena_fits_scan_alert, BLE_TABLE_SLOTS(MAX_BLE_TOSCAN)*sizeof(BLE_TABLE_ENTRY_t) + NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t), 0);
 // how long till we remove them out of history if we don't see them? 
 #define MAX_BEACON_TIMEOUT_SECS (MYNEWT_VAL(MOD_BLE_MAX_TIMEOUT_BEACONS))
+// What changes trigger an alert UL (config 0538 bits)
+#define ALERT_TRIG_SET (0x01)       // any beacon arriving or leaving
+#define ALERT_TRIG_BEST (0x02)      // a new best rssi beacon
+#define ALERT_TRIG_TOPK (0x04)      // the set of the best ones sent in the UL changed
+#define ALERT_TRIG_RSSI (0x08)      // the set of the ones at or above the alert rssi changed
+#define ALERT_NTRIGS (4)
 
+// Fingerprints of what the triggers look at (0 for those not enabled), to compare with the last alert
+typedef struct {
+    uint64_t fp[ALERT_NTRIGS];
+} ALERT_STATE_t;
 
 static struct {
-    void* wbleCtx;
     uint8_t maxNavPerUL;
     uint8_t bleErrorMask;
-    uint32_t bleTableHash;
-    ibeacon_data_t iblist[MAX_BLE_TOSCAN];
-    ibeacon_data_t bestiblist[MAX_BLE_TOSEND];
-    uint8_t uuid[UUID_SZ];
+    APP_CORE_METRIC_ID_t mTableFull;
+    uint8_t alertTriggers;
+    int8_t alertRSSI;
+    uint8_t alertDebounceScans;     // a change must be seen in this many consecutive scans to alert
+    uint32_t alertMinIntervalSecs;  // and not sooner than this after the last alert
+    ALERT_STATE_t alerted;          // as at the last alert
+    ALERT_STATE_t pending;          // change being debounced
+    uint8_t nbPending;              // consecutive scans it has been seen in
+    bool pendingHeld;               // it was counted in the held metric
+    uint32_t lastAlertS;
+    APP_CORE_METRIC_ID_t mHeld;
+    BLE_TABLE_t ibtable;
+    uint8_t navRSSIAgg;
+    uint8_t navRSSIAggScans;
+    BLE_NAVSEL_t navsel;
+    BLE_NAVSEL_ENTRY_t best[MAX_BLE_TOSEND];
 } _ctx;     // inited to 0 by definition
 
-/** callback fns from BLE generic package */
-static void ble_cb(WBLE_EVENT_t e, void* d) {
-    switch(e) {
-        case WBLE_COMM_FAIL: {
-            log_debug("MBN: comm nok");
-            _ctx.bleErrorMask |= EM_BLE_COMM_FAIL;
-            break;
-        }
-        case WBLE_COMM_OK: {
-            log_debug("MBN: comm ok");
-            // we use the 'fixed navigation' type (sparsely deployed, we shouldn't see many, only send up best rssi ones)
-            // Scan selecting only majors between 0x0000 and 0x00FF ie short range
-            wble_scan_start(_ctx.wbleCtx, _ctx.uuid, (BLE_TYPE_NAV<<8), ((BLE_TYPE_NAV<<8)+0xFF), MAX_BLE_TOSCAN, &_ctx.iblist[0]);
-            break;
+// Get the state of what the enabled triggers look at, the best ones being in _ctx.best[]
+static void getAlertState(ALERT_STATE_t* st, int nbBest) {
+    memset(st, 0, sizeof(ALERT_STATE_t));
+    if (_ctx.alertTriggers & ALERT_TRIG_SET) {
+        st->fp[0] = BLETable_fingerprint(&_ctx.ibtable);
+    }
+    if ((_ctx.alertTriggers & ALERT_TRIG_BEST) && nbBest>0) {
+        st->fp[1] = BLETable_idHash(_ctx.best[0].major, _ctx.best[0].minor);
+    }
+    if (_ctx.alertTriggers & ALERT_TRIG_TOPK) {
+        // (a set, so the best ones swapping places is not a change)
+        for(int i=0;i<nbBest;i++) {
+            st->fp[2] += BLETable_idHash(_ctx.best[i].major, _ctx.best[i].minor);
         }
-        case WBLE_SCAN_RX_IB: {
-//            log_debug("MBN:ib %d:%d rssi %d", ib->major, ib->minor, ib->rssi);
-            // just get them all at the end
-            break;
+    }
+    if (_ctx.alertTriggers & ALERT_TRIG_RSSI) {
+        BLE_TABLE_ITER_t it;
+        BLE_TABLE_ENTRY_t* ib;
+        BLETable_iterStart(&_ctx.ibtable, &it);
+        while((ib=BLETable_iterNext(&_ctx.ibtable, &it))!=NULL) {
+            if (ib->rssi>=_ctx.alertRSSI) {
+                st->fp[3] += BLETable_idHash(ib->major, ib->minor);
+            }
         }
-        default: {
-            log_debug("MBN cb %d", e);
-            break;         
-        }   
     }
 }
-// generate hash over beacon list using minor numbers to know if list changes between scans
-static uint32_t generateBLEListHash(int tbsz, ibeacon_data_t* list) {
-    uint32_t hash=0;
-    for(int i=0; i<tbsz; i++) {
-        hash += list[i].minor;
+
+// The pending change is held back : count it, once
+static void countHeld() {
+    if (!_ctx.pendingHeld) {
+        app_core_metrics_inc(_ctx.mHeld);
+        _ctx.pendingHeld = true;
     }
-    return hash;
 }
+
 // My api functions
 static uint32_t start() {
     // When device is inactive this module is not used
@@ -87,28 +120,28 @@ static uint32_t start() {
     // Get max BLEs, validate value is ok to avoid issues...
     _ctx.maxNavPerUL = MAX_BLE_TOSEND;
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_MAX_NAV_PER_UL, &_ctx.maxNavPerUL, 1, MAX_BLE_TOSEND);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG, &_ctx.navRSSIAgg, BLE_NAVSEL_AGG_NONE, BLE_NAVSEL_AGG_MEDIAN);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG_SCANS, &_ctx.navRSSIAggScans, 1, BLE_NAVSEL_MAX_SCANS);
+    BLENavSel_setAggregation(&_ctx.navsel, _ctx.navRSSIAgg, _ctx.navRSSIAggScans);
+
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_ALERT_TRIGGERS, &_ctx.alertTriggers, 1, 0x0F);      // (0 would never alert)
+    CFMgr_getOrAddElementCheckRangeINT8(CFG_UTIL_KEY_BLE_ALERT_RSSI, &_ctx.alertRSSI, -127, 0);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_ALERT_DEBOUNCE_SCANS, &_ctx.alertDebounceScans, 1, 255);
+    CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_ALERT_MIN_INTERVAL_SECS, &_ctx.alertMinIntervalSecs, 0, 24*3600);
 
     // no errors yet
     _ctx.bleErrorMask = 0;
-    // get hash of list before
-    _ctx.bleTableHash = generateBLEListHash(MAX_BLE_TOSCAN, &_ctx.iblist[0]);
-    // and tell ble to go with a callback to tell me when its got something
-    wble_start(_ctx.wbleCtx, ble_cb);
     // Return the scan time
     uint32_t bleScanTimeMS = MYNEWT_VAL(MOD_BLE_DEFAULT_SCAN_TIME_MS);
     CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_TIME_MS, &bleScanTimeMS, 1000, 60000);
-    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_IBEACON_UUID, &_ctx.uuid, UUID_SZ);
 
-    return bleScanTimeMS;
+    // scan, unless another BLE module already did it for us this cycle
+    return BLEScan_start(APP_MOD_BLE_SCAN_ALERT, bleScanTimeMS);
 }
 
 static void stop() {
-    // Done BLE, go idle
-    wble_scan_stop(_ctx.wbleCtx);
-    // clean out ones that we haven't seen since...
-    wble_resetList(_ctx.wbleCtx, MAX_BEACON_TIMEOUT_SECS);
-    // and power down 
-    wble_stop(_ctx.wbleCtx);
+    // Done BLE, go idle (if we were the one scanning)
+    BLEScan_stop(APP_MOD_BLE_SCAN_ALERT);
 }
 static void off() {
 
@@ -122,19 +155,36 @@ static bool getData(APP_CORE_UL_t* ul) {
     if (!AppCore_isDeviceActive()) {
         return false;
     }
+    // get any last ones from the scanner
+    BLEScan_flush();
+    _ctx.bleErrorMask |= BLEScan_getErrors(APP_MOD_BLE_SCAN_ALERT);
+    // Debug builds can record the raw scan table for offline replay
+    BLETrace_snapshotTable(APP_MOD_BLE_SCAN_ALERT, &_ctx.ibtable);
     // get rid of any that have timed out
-    wble_resetList(_ctx.wbleCtx, MAX_BEACON_TIMEOUT_SECS);
+    uint32_t now = TMMgr_getRelTimeSecs();
+    BLETable_removeOlder(&_ctx.ibtable, MAX_BEACON_TIMEOUT_SECS, now);
 
         // Check if table is full.
-    int nActive = wble_getNbIBActive(_ctx.wbleCtx,0);
+    int nActive = BLETable_nbActive(&_ctx.ibtable);
     log_debug("MBA: proc %d active BLE", nActive);
-    if (nActive==MAX_BLE_TOSCAN) {
+    if (BLETable_isFull(&_ctx.ibtable)) {
         _ctx.bleErrorMask |= EM_BLE_TABLE_FULL;        
+        app_core_metrics_inc(_ctx.mTableFull);
     }
 
     // This module is concerned with the fixed navigation ones - we sent up a short 'best rsssi' list every time
-    // Get list of ibs in order into this array please
-    int nbSent = wble_getSortedIBList(_ctx.wbleCtx, MAX_BLE_TOSEND, _ctx.bestiblist);
+    // Offer them to the selector, which keeps the best ones (on their rssi over the last scans if aggregating) in order.
+    // When aggregating only the ones seen in this scan are offered : the history is what keeps the others, at the rssi they had then
+    bool seenOnly = BLENavSel_isAggregating(&_ctx.navsel);
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(&_ctx.ibtable, &it);
+    while((e=BLETable_iterNext(&_ctx.ibtable, &it))!=NULL) {
+        if (!seenOnly || BLETable_missedScans(&_ctx.ibtable, e)==0) {
+            BLENavSel_offer(&_ctx.navsel, e->major, e->minor, e->rssi, e->extra);
+        }
+    }
+    int nbSent = BLENavSel_endScan(&_ctx.navsel);
     if (nbSent>0) {
         if (nbSent>_ctx.maxNavPerUL) {
             nbSent = _ctx.maxNavPerUL;      // can limit to less than the max
@@ -143,13 +193,14 @@ static bool getData(APP_CORE_UL_t* ul) {
         uint8_t* vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_CURR,nbSent*5);
         if (vp!=NULL) {
             for(int i=0;i<nbSent;i++) {
-                *vp++ = (_ctx.bestiblist[i].major & 0xff);
+                BLE_NAVSEL_ENTRY_t* ib = &_ctx.best[i];
+                *vp++ = (ib->major & 0xff);
                 // no point in sending up MSB of major, not used in id
-//                *vp++ = ((_ctx.bestiblist[i].major >> 8) & 0xff);
-                *vp++ = (_ctx.bestiblist[i].minor & 0xff);
-                *vp++ = ((_ctx.bestiblist[i].minor >> 8) & 0xff);
-                *vp++ = _ctx.bestiblist[i].rssi;
-                *vp++ = _ctx.bestiblist[i].extra;
+//                *vp++ = ((ib->major >> 8) & 0xff);
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ib->rssi;
+                *vp++ = ib->extra;
             }
         }
         // Set a global flag so gps knows we saw 'indoor' type localisation stuff
@@ -163,12 +214,39 @@ static bool getData(APP_CORE_UL_t* ul) {
         app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_ERRORMASK, 1, &_ctx.bleErrorMask);
     }
 
-    // If table list hasn't changed this time, you dont need to send (but we have added our info in case...)
-    if (_ctx.bleTableHash == generateBLEListHash(MAX_BLE_TOSCAN, &_ctx.iblist[0])) {
-        log_info("MBA:UL saw unchanged %d added best %d err %02x", wble_getNbIBActive(_ctx.wbleCtx, 0), nbSent, _ctx.bleErrorMask);
+    // If nothing we alert on has changed since the last alert, you dont need to send (but we have added our info in case...)
+    ALERT_STATE_t state;
+    getAlertState(&state, nbSent);
+    if (memcmp(&state, &_ctx.alerted, sizeof(ALERT_STATE_t))==0) {
+        // (and if a change was being debounced, it went back : just a flicker)
+        _ctx.nbPending = 0;
+        log_info("MBA:UL saw unchanged %d added best %d err %02x", nActive, nbSent, _ctx.bleErrorMask);
+        return false;
+    }
+    // A change must last for the debounce scans (the same change : a different one starts again)
+    if (_ctx.nbPending==0 || memcmp(&state, &_ctx.pending, sizeof(ALERT_STATE_t))!=0) {
+        _ctx.pending = state;
+        _ctx.nbPending = 0;
+        _ctx.pendingHeld = false;
+    }
+    if (_ctx.nbPending<255) {
+        _ctx.nbPending++;
+    }
+    if (_ctx.nbPending < _ctx.alertDebounceScans) {
+        log_info("MBA:UL saw change %d/%d scans, %d added best %d err %02x", _ctx.nbPending, _ctx.alertDebounceScans, nActive, nbSent, _ctx.bleErrorMask);
+        countHeld();
         return false;
     }
-    log_info("MBA:UL saw changed %d sent best %d err %02x", wble_getNbIBActive(_ctx.wbleCtx, 0), nbSent, _ctx.bleErrorMask);
+    // and not come too soon after the last alert (it stays pending, so goes as soon as it can if it lasts)
+    if (_ctx.lastAlertS!=0 && (now - _ctx.lastAlertS) < _ctx.alertMinIntervalSecs) {
+        log_info("MBA:UL saw change %ds after last alert, %d added best %d err %02x", (now - _ctx.lastAlertS), nActive, nbSent, _ctx.bleErrorMask);
+        countHeld();
+        return false;
+    }
+    _ctx.alerted = state;
+    _ctx.nbPending = 0;
+    _ctx.lastAlertS = now;
+    log_info("MBA:UL saw changed %d sent best %d err %02x", nActive, nbSent, _ctx.bleErrorMask);
     return true;        // always gotta send UL if list has changed as 'no BLEs seen' is also important!
 }
 
@@ -184,11 +262,32 @@ static APP_CORE_API_t _api = {
 void mod_ble_scan_alert_init(void) {
     // _ctx initied to 0 by definition (bss). Set any non-0 defaults here
     _ctx.maxNavPerUL = MAX_BLE_TOSEND;
-
-    // initialise access
-    _ctx.wbleCtx = wble_mgr_init(MYNEWT_VAL(MOD_BLE_UART), MYNEWT_VAL(MOD_BLE_UART_BAUDRATE), MYNEWT_VAL(MOD_BLE_PWRIO), MYNEWT_VAL(MOD_BLE_UARTIO), MYNEWT_VAL(MOD_BLE_UART_SELECT));
+    _ctx.navRSSIAgg = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG);
+    _ctx.navRSSIAggScans = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG_SCANS);
+    _ctx.alertTriggers = MYNEWT_VAL(MOD_BLE_ALERT_TRIGGERS);
+    _ctx.alertRSSI = MYNEWT_VAL(MOD_BLE_ALERT_RSSI);
+    _ctx.alertDebounceScans = MYNEWT_VAL(MOD_BLE_ALERT_DEBOUNCE_SCANS);
+    _ctx.alertMinIntervalSecs = MYNEWT_VAL(MOD_BLE_ALERT_MIN_INTERVAL_SECS);
+    // The table keeps its history between cycles (to see if it changed), so has its own partition of the BLE arena
+    BLE_TABLE_ENTRY_t* slots = BLEArena_leasePersistent(APP_MOD_BLE_SCAN_ALERT, BLE_TABLE_SLOTS(MAX_BLE_TOSCAN)*sizeof(BLE_TABLE_ENTRY_t));
+    assert(slots!=NULL);
+    BLETable_init(&_ctx.ibtable, slots, MAX_BLE_TOSCAN);
+    // as does the rssi history of the best list selector (if any)
+    BLE_NAVSEL_HIST_t* hist = NULL;
+    if (NAV_HIST_SZ>0) {
+        hist = BLEArena_leasePersistent(APP_MOD_BLE_SCAN_ALERT, NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t));
+        assert(hist!=NULL);
+    }
+    BLENavSel_init(&_ctx.navsel, &_ctx.best[0], MAX_BLE_TOSEND, hist, NAV_HIST_SZ);
+    // we use the 'fixed navigation' type (sparsely deployed, we shouldn't see many, only send up best rssi ones)
+    // Get only majors between 0x0000 and 0x00FF ie short range from the scan
+    BLEScan_subscribe(APP_MOD_BLE_SCAN_ALERT, (BLE_TYPE_NAV<<8), ((BLE_TYPE_NAV<<8)+0xFF), &_ctx.ibtable, false);
 
     // hook app-core for ble scan - serialised as competing for UART
     AppCore_registerModule("BLE-SCAN-ALERT", APP_MOD_BLE_SCAN_ALERT, &_api, EXEC_SERIAL);
+    // shared with the other BLE modules
+    _ctx.mTableFull = app_core_metrics_register("ble_tblfull", APP_CORE_METRIC_COUNTER);
+    // changes not (yet) alerted because of the debounce or the min interval
+    _ctx.mHeld = app_core_metrics_register("ble_alert_held", APP_CORE_METRIC_COUNTER);
 //    log_debug("MB:mod-ble-scan-alert inited");
 }
@@ -17,56 +17,42 @@
 
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/configmgr.h"
+#include "wyres-generic/timemgr.h"
 #include "wyres-generic/wblemgr.h"
 #include "cbor.h"
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 #include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_navsel.h"
+#include "mod-ble/ble_arena.h"
+#include "mod-ble/ble_scan.h"
+#include "mod-ble/ble_trace.h"
 
 // How many ibeacons will we deal with?
-// Keep history between scans of this number
-#define MAX_BLE_TOSCAN  (16)     
+#define MAX_BLE_TOSCAN  (16)
 // Max number we send up (the 'best' rssi ones)
 #define MAX_BLE_TOSEND MYNEWT_VAL(MOD_BLE_MAXIBS_NAV)
+// Beacons we keep the last scans rssi of for the aggregation
+#define NAV_HIST_SZ (MYNEWT_VAL(MOD_BLE_NAV_HIST_SZ))
+// The table and nav history must fit in the BLE arena
+BLE_ARENA_CHECK_FITS(arena_fits_scan_nav, BLE_TABLE_SLOTS(MAX_BLE_TOSCAN)*sizeof(BLE_TABLE_ENTRY_t) + NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t), 0);
 // how long till we remove them out of history? For navigation, we keep no history between scans generally, as backend deals with history
 #define MAX_BEACON_TIMEOUT_SECS (60)
 
 
 static struct {
-    void* wbleCtx;
     uint8_t maxNavPerUL;
     uint8_t bleErrorMask;
-    ibeacon_data_t iblist[MAX_BLE_TOSCAN];
-    ibeacon_data_t bestiblist[MAX_BLE_TOSEND];
-    uint8_t uuid[UUID_SZ];
+    APP_CORE_METRIC_ID_t mTableFull;
+    BLE_TABLE_t ibtable;
+    uint8_t navRSSIAgg;
+    uint8_t navRSSIAggScans;
+    BLE_NAVSEL_t navsel;
+    BLE_NAVSEL_ENTRY_t best[MAX_BLE_TOSEND];
 } _ctx;     // inited to 0 by definition
 
-/** callback fns from BLE generic package */
-static void ble_cb(WBLE_EVENT_t e, void* d) {
-    switch(e) {
-        case WBLE_COMM_FAIL: {
-            log_debug("MBN: comm nok");
-            _ctx.bleErrorMask |= EM_BLE_COMM_FAIL;
-            break;
-        }
-        case WBLE_COMM_OK: {
-            log_debug("MBN: comm ok");
-            // Scan selecting only majors between 0x0000 and 0x00FF ie short range
-            wble_scan_start(_ctx.wbleCtx, _ctx.uuid, (BLE_TYPE_NAV<<8), ((BLE_TYPE_NAV<<8)+0xFF), MAX_BLE_TOSCAN, &_ctx.iblist[0]);
-            break;
-        }
-        case WBLE_SCAN_RX_IB: {
-//            log_debug("MBN:ib %d:%d rssi %d", ib->major, ib->minor, ib->rssi);
-            // just get them all at the end
-            break;
-        }
-        default: {
-            log_debug("MBN cb %d", e);
-            break;         
-        }   
-    }
-}
-
 // My api functions
 static uint32_t start() {
     // When device is inactive this module is not used
@@ -75,27 +61,24 @@ static uint32_t start() {
     }
     // Get max BLEs, validate value is ok to avoid issues...
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_MAX_NAV_PER_UL, &_ctx.maxNavPerUL, 1, MAX_BLE_TOSEND);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG, &_ctx.navRSSIAgg, BLE_NAVSEL_AGG_NONE, BLE_NAVSEL_AGG_MEDIAN);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG_SCANS, &_ctx.navRSSIAggScans, 1, BLE_NAVSEL_MAX_SCANS);
+    BLENavSel_setAggregation(&_ctx.navsel, _ctx.navRSSIAgg, _ctx.navRSSIAggScans);
 
     // no errors yet
     _ctx.bleErrorMask = 0;
 
-    // and tell ble to go with a callback to tell me when its got something
-    wble_start(_ctx.wbleCtx, ble_cb);
     // Return the scan time
     uint32_t bleScanTimeMS = 3000;
     CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_TIME_MS, &bleScanTimeMS, 1000, 60000);
-    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_IBEACON_UUID, &_ctx.uuid, UUID_SZ);
 
-    return bleScanTimeMS;
+    // scan, unless another BLE module already did it for us this cycle
+    return BLEScan_start(APP_MOD_BLE_SCAN_NAV, bleScanTimeMS);
 }
 
 static void stop() {
-    // Done BLE, go idle
-    wble_scan_stop(_ctx.wbleCtx);
-    // only keep ones we saw this scan
-    wble_resetList(_ctx.wbleCtx, MAX_BEACON_TIMEOUT_SECS);
-    // and power down 
-    wble_stop(_ctx.wbleCtx);
+    // Done BLE, go idle (if we were the one scanning)
+    BLEScan_stop(APP_MOD_BLE_SCAN_NAV);
 }
 static void off() {
 
@@ -109,19 +92,38 @@ static bool getData(APP_CORE_UL_t* ul) {
     if (!AppCore_isDeviceActive()) {
         return false;
     }
+    // get any last ones from the scanner
+    BLEScan_flush();
+    _ctx.bleErrorMask |= BLEScan_getErrors(APP_MOD_BLE_SCAN_NAV);
+    // Debug builds can record the raw scan table for offline replay
+    BLETrace_snapshotTable(APP_MOD_BLE_SCAN_NAV, &_ctx.ibtable);
+    // only keep ones we saw recently
+    uint32_t now = TMMgr_getRelTimeSecs();
+    BLETable_removeOlder(&_ctx.ibtable, MAX_BEACON_TIMEOUT_SECS, now);
     // we have knowledge of 2 types of ibeacons
     // - 'fixed navigation' type (sparsely deployed, we shouldn't see many, only send up best rssi ones)
     // - 'mobile tag' type : may congregate in areas so we see a lot of them. In this case, we do in/out notifications
         // Check if table is full.
-    int nActive = wble_getNbIBActive(_ctx.wbleCtx,0);
+    int nActive = BLETable_nbActive(&_ctx.ibtable);
     log_debug("MBN: proc %d active BLE", nActive);
-    if (nActive==MAX_BLE_TOSCAN) {
+    if (BLETable_isFull(&_ctx.ibtable)) {
         _ctx.bleErrorMask |= EM_BLE_TABLE_FULL;        
+        app_core_metrics_inc(_ctx.mTableFull);
     }
 
     // This module is concerned with the fixed navigation ones - we sent up a short 'best rsssi' list every time
-    // Get list of ibs in order into this array please
-    int nbSent = wble_getSortedIBList(_ctx.wbleCtx, MAX_BLE_TOSEND, _ctx.bestiblist);
+    // Offer them to the selector, which keeps the best ones (on their rssi over the last scans if aggregating) in order.
+    // When aggregating only the ones seen in this scan are offered : the history is what keeps the others, at the rssi they had then
+    bool seenOnly = BLENavSel_isAggregating(&_ctx.navsel);
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(&_ctx.ibtable, &it);
+    while((e=BLETable_iterNext(&_ctx.ibtable, &it))!=NULL) {
+        if (!seenOnly || BLETable_missedScans(&_ctx.ibtable, e)==0) {
+            BLENavSel_offer(&_ctx.navsel, e->major, e->minor, e->rssi, e->extra);
+        }
+    }
+    int nbSent = BLENavSel_endScan(&_ctx.navsel);
     if (nbSent>0) {
         if (nbSent>_ctx.maxNavPerUL) {
             nbSent = _ctx.maxNavPerUL;      // can limit to less than the max
@@ -130,13 +132,14 @@ static bool getData(APP_CORE_UL_t* ul) {
         uint8_t* vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_CURR,nbSent*5);
         if (vp!=NULL) {
             for(int i=0;i<nbSent;i++) {
-                *vp++ = (_ctx.bestiblist[i].major & 0xff);
+                BLE_NAVSEL_ENTRY_t* ib = &_ctx.best[i];
+                *vp++ = (ib->major & 0xff);
                 // no point in sending up MSB of major, not used in id
-//                *vp++ = ((_ctx.bestiblist[i].major >> 8) & 0xff);
-                *vp++ = (_ctx.bestiblist[i].minor & 0xff);
-                *vp++ = ((_ctx.bestiblist[i].minor >> 8) & 0xff);
-                *vp++ = _ctx.bestiblist[i].rssi;
-                *vp++ = _ctx.bestiblist[i].extra;
+//                *vp++ = ((ib->major >> 8) & 0xff);
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ib->rssi;
+                *vp++ = ib->extra;
             }
         }
         // Set a global flag so gps knows we saw 'indoor' type localisation stuff
@@ -150,7 +153,7 @@ static bool getData(APP_CORE_UL_t* ul) {
         app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_ERRORMASK, 1, &_ctx.bleErrorMask);
     }
 
-    log_info("MBN:UL saw %d sent best %d err %02x", wble_getNbIBActive(_ctx.wbleCtx, 0), nbSent, _ctx.bleErrorMask);
+    log_info("MBN:UL saw %d sent best %d err %02x", nActive, nbSent, _ctx.bleErrorMask);
 //    return (nbSent>0);
     return true;        // always gotta send UL as 'no BLEs seen' is also important!
 }
@@ -167,11 +170,26 @@ static APP_CORE_API_t _api = {
 void mod_ble_scan_nav_init(void) {
     // _ctx initied to 0 by definition (bss). Set any non-0 defaults here
     _ctx.maxNavPerUL = MAX_BLE_TOSEND;
-
-    // initialise access
-    _ctx.wbleCtx = wble_mgr_init(MYNEWT_VAL(MOD_BLE_UART), MYNEWT_VAL(MOD_BLE_UART_BAUDRATE), MYNEWT_VAL(MOD_BLE_PWRIO), MYNEWT_VAL(MOD_BLE_UARTIO), MYNEWT_VAL(MOD_BLE_UART_SELECT));
+    _ctx.navRSSIAgg = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG);
+    _ctx.navRSSIAggScans = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG_SCANS);
+
+    // The table is fed by the scans of the other BLE modules too, so has its own partition of the BLE arena
+    BLE_TABLE_ENTRY_t* slots = BLEArena_leasePersistent(APP_MOD_BLE_SCAN_NAV, BLE_TABLE_SLOTS(MAX_BLE_TOSCAN)*sizeof(BLE_TABLE_ENTRY_t));
+    assert(slots!=NULL);
+    BLETable_init(&_ctx.ibtable, slots, MAX_BLE_TOSCAN);
+    // as does the rssi history of the best list selector (if any)
+    BLE_NAVSEL_HIST_t* hist = NULL;
+    if (NAV_HIST_SZ>0) {
+        hist = BLEArena_leasePersistent(APP_MOD_BLE_SCAN_NAV, NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t));
+        assert(hist!=NULL);
+    }
+    BLENavSel_init(&_ctx.navsel, &_ctx.best[0], MAX_BLE_TOSEND, hist, NAV_HIST_SZ);
+    // Get only majors between 0x0000 and 0x00FF ie short range from the scan
+    BLEScan_subscribe(APP_MOD_BLE_SCAN_NAV, (BLE_TYPE_NAV<<8), ((BLE_TYPE_NAV<<8)+0xFF), &_ctx.ibtable, false);
 
     // hook app-core for ble scan - serialised as competing for UART
     AppCore_registerModule("BLE-SCAN-NAV", APP_MOD_BLE_SCAN_NAV, &_api, EXEC_SERIAL);
+    // shared with the other BLE modules
+    _ctx.mTableFull = app_core_metrics_register("ble_tblfull", APP_CORE_METRIC_COUNTER);
 //    log_debug("MB:mod-ble-scan-nav inited");
 }
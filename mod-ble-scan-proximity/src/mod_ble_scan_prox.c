@@ -23,12 +23,22 @@
 #include "cbor.h"
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 #include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_navsel.h"
+#include "mod-ble/ble_arena.h"
+#include "mod-ble/ble_scan.h"
+#include "mod-ble/ble_trace.h"
+#include "mod-ble/ble_bench.h"
 
 // Define this to get devaddress as remote contact id, rather than major/minor
 //#define SEND_DEVADDR    1
 
 #ifdef SEND_DEVADDR
+#if !MYNEWT_VAL(MOD_BLE_TABLE_DEVADDR)
+#error "SEND_DEVADDR needs MOD_BLE_TABLE_DEVADDR: 1 in the target syscfg so the tracking table keeps the devaddr"
+#endif
 #define PROX_ENTER_UL_SZ (8)
 #define PROX_EXIT_UL_SZ (7)
 #define PROX_ENTER_TAG (APP_CORE_UL_BLE_PROX_ENTER)
@@ -47,50 +57,114 @@
 #define MAX_BLE_TRACKED (MYNEWT_VAL(MOD_BLE_MAXIBS_TAG_INZONE)+10)
 // Max ibeacons we sent up of navigation type (MSB major = 0x00)
 #define MAX_NAV (5)
+// Nav beacons we keep the last scans rssi of for the aggregation
+#define NAV_HIST_SZ (MYNEWT_VAL(MOD_BLE_NAV_HIST_SZ))
+// New contacts are referenced from the start of the refs list, ended ones from the end (an entry can't be both)
+#define NEW_REF(n) (_ctx.ulrefs[(n)])
+#define END_REF(n) (_ctx.ulrefs[MAX_BLE_TRACKED-1-(n)])
+// The table, nav history and refs must fit in the BLE arena
+BLE_ARENA_CHECK_FITS(arena_fits_prox, BLE_TABLE_SLOTS(MAX_BLE_TRACKED)*sizeof(BLE_TABLE_ENTRY_t) + NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t),
+    MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t));
 
 static struct {
-    void* wbleCtx;
     uint8_t exitTimeoutMins;
+    uint8_t exitMissedScans;        // or gone after this many scans without being seen (0=use the timeout)
     uint8_t contactSignifTimeMins;
-    int8_t contactSignifRSSI;
+    int8_t contactSignifRSSI;       // config 0529
+    int8_t contactRSSI;             // smoothed rssi needed to be a contact (0529 if MOD_BLE_PROX_RSSI_GATE, else any)
+    int8_t exitRSSI;                // and under which a contact has ended
     uint8_t maxContactsPerUL;
-    ibeacon_data_t iblist[MAX_BLE_TRACKED];
-    ibeacon_data_t navIBList[MAX_NAV];      // list of 'best' navigation beacons currently
-    uint8_t nbNav;
+    BLE_TABLE_t ibtable;
+    uint8_t navRSSIAgg;
+    uint8_t navRSSIAggScans;
+    BLE_NAVSEL_t navsel;            // selects the 'best' navigation beacons seen since the last UL
+    BLE_NAVSEL_ENTRY_t navIBList[MAX_NAV];
+    BLE_TABLE_REF_t* ulrefs;        // only needed from start() to stop() (or during getData() if not started), so in the shared arena partition
+    // Results of classifying the table for this cycle
+    int nbContactCurrent;           // how many 'proximity' type guys currently near me
+    int nbContactNew;               // How many are 'new' contacts (ie > X mins of being there)
+    int nbContactEnd;               // how many that were there are no longer there?
     uint8_t bleErrorMask;
+    APP_CORE_METRIC_ID_t mTableFull;
     uint8_t nbULRepeats;
-    uint8_t uuid[UUID_SZ];
 //    uint8_t cborbuf[MAX_BLE_ENTER*6];
 } _ctx;
 
-/** callback fns from BLE generic package */
-static void ble_cb(WBLE_EVENT_t e, void* d) {
-    switch(e) {
-        case WBLE_COMM_FAIL: {
-            log_debug("MBP: comm nok");
-            _ctx.bleErrorMask |= EM_BLE_COMM_FAIL;
-            break;
-        }
-        case WBLE_COMM_OK: {
-            log_debug("MBP: comm ok");
-            // Scan for both PROXIMITY and navigation beacons (sadly this means we get all the guys in between too but life...)
-            // Note that request for scan should not impact ibeaconning (v2 BLE can do both in parallel)
-            wble_scan_start(_ctx.wbleCtx, _ctx.uuid, (BLE_TYPE_NAV<<8), (BLE_TYPE_PROXIMITY<<8) + 0xFF, MAX_BLE_TRACKED, &_ctx.iblist[0]);
-            break;
-        }
-        case WBLE_SCAN_RX_IB: {
-            //ibeacon_data_t* ib = (ibeacon_data_t*)d;
-//            log_debug("MBT:ib %d:%d rssi %d", ib->major, ib->minor, ib->rssi);
-            // wble mgr fills in / updates the list we gave it
-            break;
+// Classify the table for this cycle : check each one's type, doing the counts and picking the nav ones, and referencing the new/ended
+// contacts so that the UL stages only look at the ones they will send. Also removes the ones that have gone or that we don't want.
+static void classify(uint32_t now) {
+    _ctx.nbContactCurrent = 0;
+    _ctx.nbContactNew = 0;
+    _ctx.nbContactEnd = 0;
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* ib;
+    BLETable_iterStart(&_ctx.ibtable, &it);
+    while((ib=BLETable_iterNext(&_ctx.ibtable, &it))!=NULL) {
+        uint8_t bletype = (ib->major & 0xff00) >> 8;
+        if (bletype==BLE_TYPE_PROXIMITY) {
+            _ctx.nbContactCurrent++;     // count how many are around me
+            if (ib->new && (BLETable_firstSeenAgeS(&_ctx.ibtable, ib, now) > (_ctx.contactSignifTimeMins*60)) &&
+                    ib->rssi>=_ctx.contactRSSI) {
+                // Been seen for long enough, and close enough, to count as a contact (and not yet sent?)
+                BLETable_iterRef(&_ctx.ibtable, &it, now, &NEW_REF(_ctx.nbContactNew));
+                _ctx.nbContactNew++;
+            } else if (BLETable_isGone(&_ctx.ibtable, ib, now, _ctx.exitTimeoutMins*60, _ctx.exitMissedScans) ||
+                    ((!ib->new || ib->inULCnt>0) && ib->rssi<_ctx.exitRSSI)) {
+                // is he timed out (exited), or has a contact got too weak? [note only check once his 'newness' has been sent to backend]
+                // was he a proper 'contact' ie sent up as one? (if not he can just go)
+                if (!ib->new || ib->inULCnt>0) {
+                    // Yes, and now he's not present (and we'll remove him once sent up)
+                    BLETable_iterRef(&_ctx.ibtable, &it, now, &END_REF(_ctx.nbContactEnd));
+                    _ctx.nbContactEnd++;     // processing is done once he's been in UL
+                } else {
+                    // no, and now he's gone, so can just remove him from the list (don't tell about 'exit' of non-contacts)
+                    BLETable_iterRemove(&_ctx.ibtable, &it);
+                }
+            }
+            // else still around but not (yet) a contact : may become one once seen for long enough at the smoothed rssi
+        } else if (bletype==BLE_TYPE_NAV) {
+            // fine gonna pick the best ones
+            BLENavSel_offer(&_ctx.navsel, ib->major, ib->minor, ib->rssi, ib->extra);
+            // and remove nav beacons from main table each time
+            BLETable_iterRemove(&_ctx.ibtable, &it);
+        } else {
+            // ignore. may happen as we scan from nav to prox majors, and this includes other types we don't care about
+            log_debug("MBP:remove unex type=%d", bletype);
+            // Free up the space
+            BLETable_iterRemove(&_ctx.ibtable, &it);
         }
-        default: {
-            log_debug("MBP cb %d", e);
-            break;         
-        }   
     }
 }
 
+// Advert handler (MOD_BLE_SCAN_STREAM) : nav beacons go straight into the best list (and never take a slot in the table), proximity
+// ones are added/updated. Whether they are contacts depends on the whole scan, so that is up to getData()'s classify().
+static uint8_t rxIB(ibeacon_data_t* ib, uint32_t now) {
+    uint8_t bletype = (ib->major & 0xff00) >> 8;
+    if (bletype==BLE_TYPE_NAV) {
+        BLENavSel_offer(&_ctx.navsel, ib->major, ib->minor, ib->rssi, ib->extra);
+        return 0;
+    }
+    if (bletype!=BLE_TYPE_PROXIMITY) {
+        // ignore. may happen as we scan from nav to prox majors, and this includes other types we don't care about
+        return 0;
+    }
+    if (BLETable_addOrUpdate(&_ctx.ibtable, ib, now)==NULL) {
+        return EM_BLE_TABLE_FULL;
+    }
+    return 0;
+}
+
+// The UL building refs are in the shared arena partition
+static bool leaseRefs() {
+    uint32_t arenaSz;
+    _ctx.ulrefs = BLEArena_lease(APP_MOD_BLE_IB, MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t), &arenaSz);
+    return (_ctx.ulrefs!=NULL);       // (reserved at init, so only if another module holds it : arena logged it)
+}
+static void releaseRefs() {
+    _ctx.ulrefs = NULL;
+    BLEArena_release(APP_MOD_BLE_IB);
+}
+
 // My api functions
 static uint32_t start() {
     // When device is inactive this module is not used
@@ -98,27 +172,41 @@ static uint32_t start() {
         return 0;
     }
     // Read config each start() to take into account any changes
-    // exit timeout should actually be in function of the delay between scans...
+    // exit timeout should actually be in function of the delay between scans... which is what counting missed scans does
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_EXIT_TIMEOUT_MINS, &_ctx.exitTimeoutMins, 1, 4*60);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_EXIT_MISSED_SCANS, &_ctx.exitMissedScans, 0, 15);
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_MAX_ENTER_PER_UL, &_ctx.maxContactsPerUL, 1, 255);
 
     // Allow these config items to be updated all the time
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_PROX_UL_REPS, &_ctx.nbULRepeats, 1, 10);
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_PROX_STIME_MINS, &_ctx.contactSignifTimeMins, 1, 60);
     CFMgr_getOrAddElementCheckRangeINT8(CFG_UTIL_KEY_BLE_PROX_SRSSI, &_ctx.contactSignifRSSI, -100, 0);
-    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_IBEACON_UUID, &_ctx.uuid, UUID_SZ);
+    CFMgr_getOrAddElementCheckRangeINT8(CFG_UTIL_KEY_BLE_EXIT_RSSI, &_ctx.exitRSSI, -127, 0);
+    // 0529 was never used before, so deployed devices may have any value in it : only gate contacts on it if built to
+    _ctx.contactRSSI = (MYNEWT_VAL(MOD_BLE_PROX_RSSI_GATE) ? _ctx.contactSignifRSSI : -127);
+    if (_ctx.exitRSSI>_ctx.contactRSSI) {
+        _ctx.exitRSSI = _ctx.contactRSSI;        // or they would flap in and out
+    }
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG, &_ctx.navRSSIAgg, BLE_NAVSEL_AGG_NONE, BLE_NAVSEL_AGG_MEDIAN);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_NAV_RSSI_AGG_SCANS, &_ctx.navRSSIAggScans, 1, BLE_NAVSEL_MAX_SCANS);
+    BLENavSel_setAggregation(&_ctx.navsel, _ctx.navRSSIAgg, _ctx.navRSSIAggScans);
 
     // no errors yet
     _ctx.bleErrorMask = 0;
-    // start ble to go (may already be running), with a callback to tell me when its comm is ok (may be immediate if already running)
-    // Request to scan is sent once comm is ok
-    wble_start(_ctx.wbleCtx, ble_cb);
+    if (!leaseRefs()) {
+        return 0;       // can't run this cycle
+    }
+#if MYNEWT_VAL(MOD_BLE_SCAN_STREAM)
+    // Clear out the ones already gone before the scan, so the slots are free for what it sees
+    classify(TMMgr_getRelTimeSecs());
+#endif
 
     // Return the scan time (checking config is ok)
     uint32_t bleScanTimeMS = 3000;
     CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_TIME_MS, &bleScanTimeMS, 1000, 60000);
 
-    return bleScanTimeMS;
+    // scan, unless another BLE module already did it for us this cycle
+    return BLEScan_start(APP_MOD_BLE_IB, bleScanTimeMS);
 }
 
 static void stop() {
@@ -143,8 +231,9 @@ static void stop() {
     // Again, switch to ibeaconning ok directly from scanning
     wble_ibeacon_start(_ctx.wbleCtx, _ctx.uuid, major, minor, 0, interMS, txpower);
 */
-    // Done BLE scanning
-    wble_scan_stop(_ctx.wbleCtx);
+    releaseRefs();
+    // Done BLE scanning (if we were the one scanning)
+    BLEScan_stop(APP_MOD_BLE_IB);
     // Don't bother turning module off as for proximity product it ibeacons in idle
 }
 
@@ -160,88 +249,46 @@ static bool getData(APP_CORE_UL_t* ul) {
     if (!AppCore_isDeviceActive()) {
         return false;
     }
-
-    int nbContactCurrent=0;     // how many 'proximity' type guys currently near me
-    int nbContactNew=0;         // How many are 'new' contacts (ie > X mins of being there)
-    int nbContactEnd=0;         // how many that were there are no longer there?
-
-    uint32_t now = TMMgr_getRelTimeSecs();
-    
-    // nav beacon list is emptied before processing
-    _ctx.nbNav = 0;
+    bool started = (_ctx.ulrefs!=NULL);
+    if (!started) {
+        // eg benchmark : just need the refs for this call
+        if (!leaseRefs()) {
+            return false;
+        }
+    }
+    // When benched, the table is a synthetic one : leave the scan, errors and metrics alone
+    bool bench = BLEBench_isRunning();
+    if (!bench) {
+        // get any last ones from the scanner
+        BLEScan_flush();
+        _ctx.bleErrorMask |= BLEScan_getErrors(APP_MOD_BLE_IB);
+        // Debug builds can record the raw scan table for offline replay
+        BLETrace_snapshotTable(APP_MOD_BLE_IB, &_ctx.ibtable);
+    }
 
     // Check if table is full.
-    int nActive = wble_getNbIBActive(_ctx.wbleCtx,0);
+    int nActive = BLETable_nbActive(&_ctx.ibtable);
     log_debug("MBP: %d BLE", nActive);
-    if (nActive==MAX_BLE_TRACKED) {
+    if (BLETable_isFull(&_ctx.ibtable)) {
         _ctx.bleErrorMask |= EM_BLE_TABLE_FULL;        
-    }
-    // for each one in the list (now updated), check its type, flagging new ones, doing the count, etc
-    for(int i=0;i<MAX_BLE_TRACKED;i++) {
-        if (_ctx.iblist[i].lastSeenAt>0) {      // its a valid entry
-            uint8_t bletype = (_ctx.iblist[i].major & 0xff00) >> 8;
-            if (bletype==BLE_TYPE_PROXIMITY) {
-                nbContactCurrent++;     // count how many are around me
-                if (_ctx.iblist[i].new && ((now-_ctx.iblist[i].firstSeenAt) > (_ctx.contactSignifTimeMins*60))) {
-                    // Been seen for long enough to count as a contact (and not yet sent?)
-                    nbContactNew++;
-                } else if ((now-_ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60)) {
-                    // is he timed out (exited)? [note only check once his 'newness' has been sent to backend]
-                    // was he a proper 'contact' ie was present for the minimum time? (and hence notified)
-                    if ((now-_ctx.iblist[i].firstSeenAt) > (_ctx.contactSignifTimeMins*60)) {
-                        // Yes, and now he's not present (and we'll 'delete' him by resetting his lastSeenAt once sent up)
-                        nbContactEnd++;     // processing is done once he's been in UL
-                    } else {
-                        // no, and now he's gone, so can just remove him from the list (don't tell about 'exit' of non-contacts)
-                        _ctx.iblist[i].lastSeenAt = 0;
-                    }
-                } else {
-                    // If the RSSI is 'too low' then delete from list
-                    // TODO : do we mean any individual rx is too low, or the mean rssi is too low, or all the rx rssis are too low??
-                }
-            } else if (bletype==BLE_TYPE_NAV) {
-                // fine gonna pick the best 3
-                // if not up to max size, just add to list
-                if (_ctx.nbNav<MAX_NAV) {
-                    // Only copy the bits we need for UL
-                    _ctx.navIBList[_ctx.nbNav].major = _ctx.iblist[i].major;
-                    _ctx.navIBList[_ctx.nbNav].minor = _ctx.iblist[i].minor;
-                    _ctx.navIBList[_ctx.nbNav].rssi = _ctx.iblist[i].rssi;
-                    _ctx.navIBList[_ctx.nbNav].extra = _ctx.iblist[i].extra;
-                    _ctx.nbNav++;
-                } else {
-                    // find lowest in list that is lower than the one we're looking at
-                    int worstRSSI = _ctx.iblist[i].rssi;
-                    int worstRSSIIdx = -1;
-                    for(int nvi = 0; nvi < MAX_NAV; nvi++) {
-                        if (_ctx.navIBList[nvi].rssi < worstRSSI) {
-                            worstRSSI = _ctx.navIBList[nvi].rssi;
-                            worstRSSIIdx = nvi;
-                        }
-                    }
-                    if (worstRSSIIdx>=0) {
-                        // new guy is better than someone, overwrite him in the list
-                        _ctx.navIBList[worstRSSIIdx].major = _ctx.iblist[i].major;
-                        _ctx.navIBList[worstRSSIIdx].minor = _ctx.iblist[i].minor;
-                        _ctx.navIBList[worstRSSIIdx].rssi = _ctx.iblist[i].rssi;
-                        _ctx.navIBList[worstRSSIIdx].extra = _ctx.iblist[i].extra;
-                    }
-                }
-                // and remove nav beacons from main table each time
-                _ctx.iblist[i].lastSeenAt = 0;
-            } else {
-                // ignore. may happen as we scan from nav to prox majors, and this includes other types we don't care about
-                log_debug("MBP:remove unex type=%d", bletype);
-                // Free up the space
-                _ctx.iblist[i].lastSeenAt=0;
-            }
+        if (!bench) {
+            app_core_metrics_inc(_ctx.mTableFull);
         }
     }
-    if (_ctx.nbNav>0) {
+    // The contacts (new, ended, how many around) depend on what the whole scan saw, so are always found now
+    uint32_t now = TMMgr_getRelTimeSecs();
+    classify(now);
+    int nbContactCurrent = _ctx.nbContactCurrent;
+    int nbContactNew = _ctx.nbContactNew;
+    int nbContactEnd = _ctx.nbContactEnd;
+    // The best nav beacons since the last UL (the selection starts again with the next one offered). Not when benched, that
+    // would use up the real ones
+    int nbNav = (bench ? 0 : BLENavSel_endScan(&_ctx.navsel));
+    if (nbNav>0) {
         // put it into UL if possible
-        uint8_t* vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_CURR,_ctx.nbNav*5);
+        uint8_t* vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_CURR,nbNav*5);
         if (vp!=NULL) {
-            for(int i=0;i<_ctx.nbNav;i++) {
+            for(int i=0;i<nbNav;i++) {
                 *vp++ = (_ctx.navIBList[i].major & 0xff);
                 // no point in sending up MSB of major, not used in id
 //                *vp++ = ((_ctx.bestiblist[i].major >> 8) & 0xff);
@@ -281,136 +328,128 @@ static bool getData(APP_CORE_UL_t* ul) {
         int nbAdded = 0;
         uint8_t* vp = NULL;
         int nbThisUL = 0;
-        for(int i=0;i<MAX_BLE_TRACKED && nbAdded<nbContactNew; i++) {
-            // If entry is valid, and of type enter/exit, and is new, then...
-            if ((_ctx.iblist[i].lastSeenAt>0) 
-                    && (((_ctx.iblist[i].major & 0xFF00) >> 8) == BLE_TYPE_PROXIMITY)
-                    && _ctx.iblist[i].new) {
-                if (nbThisUL <= 0) {
-                    // Find space in UL
-                    int bytesInUL = app_core_msg_ul_remainingSz(ul);
-                    // Check if space for TL and 1 ble at least
-                    if (bytesInUL < (TL_HDR_UL_SZ + PROX_ENTER_UL_SZ)) {
-                        // move to next message and get size (0=no next!)
-                        if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
-                            // no more messages, sorry
-                            log_debug("MBN: unexpected no next UL still got enter %d",(nbContactNew-nbAdded));
-                            _ctx.bleErrorMask |= EM_UL_NONEXTUL;
-                            break;      // from for, we're done here
-                        }
+        while(nbAdded<nbContactNew) {
+            // the new contacts, as found above
+            BLE_TABLE_ENTRY_t* ib = BLETable_refEntry(&_ctx.ibtable, &NEW_REF(nbAdded));
+            if (nbThisUL <= 0) {
+                // Find space in UL
+                int bytesInUL = app_core_msg_ul_remainingSz(ul);
+                // Check if space for TL and 1 ble at least
+                if (bytesInUL < (TL_HDR_UL_SZ + PROX_ENTER_UL_SZ)) {
+                    // move to next message and get size (0=no next!)
+                    if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
+                        // no more messages, sorry
+                        log_debug("MBN: unexpected no next UL still got enter %d",(nbContactNew-nbAdded));
+                        _ctx.bleErrorMask |= EM_UL_NONEXTUL;
+                        break;      // from for, we're done here
                     }
-                    nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / PROX_ENTER_UL_SZ; 
-                    if (nbThisUL > (nbContactNew-nbAdded)) {
-                        // should always give a >0 answer as nbAdded is never >= nbContactNew here
-                        nbThisUL = (nbContactNew-nbAdded);
-                        assert(nbThisUL>0);
-                    }
-                    vp = app_core_msg_ul_addTLgetVP(ul, PROX_ENTER_TAG, nbThisUL*PROX_ENTER_UL_SZ);
                 }
-                if (vp!=NULL) {
+                nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / PROX_ENTER_UL_SZ; 
+                if (nbThisUL > (nbContactNew-nbAdded)) {
+                    // should always give a >0 answer as nbAdded is never >= nbContactNew here
+                    nbThisUL = (nbContactNew-nbAdded);
+                    assert(nbThisUL>0);
+                }
+                vp = app_core_msg_ul_addTLgetVP(ul, PROX_ENTER_TAG, nbThisUL*PROX_ENTER_UL_SZ);
+            }
+            if (vp!=NULL) {
 #ifdef SEND_DEVADDR
-                    int seenSinceMins = ((now - _ctx.iblist[i].firstSeenAt) / 60);
-                    // new format with devAddr/timeSinceEntered/RSSI 
-                    memcpy(vp, &_ctx.iblist[i].devaddr[0], DEVADDR_SZ);
-                    vp+=DEVADDR_SZ;
-                    *vp++ = _ctx.iblist[i].rssi;
-                    *vp++ = (seenSinceMins<255 ? seenSinceMins : 255);      // Total time seen in minutes, max'd at 255
+                // new format with devAddr/timeSinceEntered/RSSI 
+                memcpy(vp, &ib->devaddr[0], DEVADDR_SZ);
+                vp+=DEVADDR_SZ;
+                *vp++ = ib->rssi;
+                *vp++ = NEW_REF(nbAdded).seenMins;      // Total time seen in minutes, max'd at 255
 #else
-                    // add maj/min to UL (number of bytes == ENTER_UL_SZ)
-                    *vp++ = (_ctx.iblist[i].major & 0xFF);        // Just LSB of major
-                    *vp++ = (_ctx.iblist[i].minor & 0xff);
-                    *vp++ = ((_ctx.iblist[i].minor >> 8) & 0xff);
-                    *vp++ = _ctx.iblist[i].rssi;
-                    *vp++ = _ctx.iblist[i].extra;
+                // add maj/min to UL (number of bytes == ENTER_UL_SZ)
+                *vp++ = (ib->major & 0xFF);        // Just LSB of major
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ib->rssi;
+                *vp++ = ib->extra;
 #endif
-                    
-                    // we want to tell backend at least twice per contact
-                    _ctx.iblist[i].inULCnt++;  
-                    if (_ctx.iblist[i].inULCnt > _ctx.nbULRepeats) {
-                        _ctx.iblist[i].new = false;     // we've told the backend several times!
-                        _ctx.iblist[i].inULCnt = 0;     // ready for reuse
-                    }
-                    nbAdded++;
-                    nbThisUL--;
-                    if (nbAdded>=nbContactNew) {
-                        break;      // added all that we're allowed
-                    }
-
-                } else {
-                    // this should not happen if the previous calculations were correct...
-                    log_debug("MBN: no space in UL for contacts %d",nbThisUL);
-                    _ctx.bleErrorMask |= EM_UL_NOSPACE;
-                    break;
+                
+                // we want to tell backend at least twice per contact
+                ib->inULCnt++;  
+                if (ib->inULCnt > _ctx.nbULRepeats) {
+                    ib->new = false;     // we've told the backend several times!
+                    ib->inULCnt = 0;     // ready for reuse
                 }
+                nbAdded++;
+                nbThisUL--;
+            } else {
+                // this should not happen if the previous calculations were correct...
+                log_debug("MBN: no space in UL for contacts %d",nbThisUL);
+                _ctx.bleErrorMask |= EM_UL_NOSPACE;
+                break;
             }
         }
     }
+    int nbEndSent = 0;
     if (nbContactEnd>0) {
         int nbAdded = 0;
         uint8_t* vp = NULL;
         int nbThisUL = 0;
-        for(int i=0;i<MAX_BLE_TRACKED && nbAdded<nbContactEnd; i++) {
-            // If a valid entry, and of proximity ble type, and has timed out...
-            if ((_ctx.iblist[i].lastSeenAt>0) 
-                    && (((_ctx.iblist[i].major & 0xFF00) >> 8) == BLE_TYPE_PROXIMITY) 
-                    && ((now-_ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60))) {
-                if (nbThisUL <= 0) {
-                    // Find space in UL
-                    int bytesInUL = app_core_msg_ul_remainingSz(ul);
-                    // Check if space for TL and 1 ble at least
-                    if (bytesInUL < (TL_HDR_UL_SZ + PROX_EXIT_UL_SZ)) {
-                        // move to next message and get size (0=no next!)
-                        if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
-                            // no more messages, sorry
-                            log_debug("MBN: unexpected no next UL still got %d",(nbContactEnd-nbAdded));
-                            _ctx.bleErrorMask |= EM_UL_NONEXTUL;
-                            break;      // from for, we're done here
-                        }
-                    }
-                    nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / PROX_EXIT_UL_SZ; 
-                    if (nbThisUL > (nbContactEnd-nbAdded)) {
-                        // should always give a >0 answer as nbAdded is never >= nbContactEnd here
-                        nbThisUL = (nbContactEnd-nbAdded);
-                        assert(nbThisUL>0);
+        while(nbAdded<nbContactEnd) {
+            // the timed out contacts, as found above
+            BLE_TABLE_REF_t* ref = &END_REF(nbAdded);
+            BLE_TABLE_ENTRY_t* ib = BLETable_refEntry(&_ctx.ibtable, ref);
+            if (nbThisUL <= 0) {
+                // Find space in UL
+                int bytesInUL = app_core_msg_ul_remainingSz(ul);
+                // Check if space for TL and 1 ble at least
+                if (bytesInUL < (TL_HDR_UL_SZ + PROX_EXIT_UL_SZ)) {
+                    // move to next message and get size (0=no next!)
+                    if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
+                        // no more messages, sorry
+                        log_debug("MBN: unexpected no next UL still got %d",(nbContactEnd-nbAdded));
+                        _ctx.bleErrorMask |= EM_UL_NONEXTUL;
+                        break;      // from for, we're done here
                     }
-                    vp = app_core_msg_ul_addTLgetVP(ul, PROX_EXIT_TAG, nbThisUL*PROX_EXIT_UL_SZ);
                 }
-                if (vp!=NULL) {
-                    int seenSinceMins = ((now - _ctx.iblist[i].firstSeenAt) / 60);
+                nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / PROX_EXIT_UL_SZ; 
+                if (nbThisUL > (nbContactEnd-nbAdded)) {
+                    // should always give a >0 answer as nbAdded is never >= nbContactEnd here
+                    nbThisUL = (nbContactEnd-nbAdded);
+                    assert(nbThisUL>0);
+                }
+                vp = app_core_msg_ul_addTLgetVP(ul, PROX_EXIT_TAG, nbThisUL*PROX_EXIT_UL_SZ);
+            }
+            if (vp!=NULL) {
 #ifdef SEND_DEVADDR
-                    // new format with devAddr/timeSinceEntered 
-                    memcpy(vp, &_ctx.iblist[i].devaddr[0], DEVADDR_SZ);
-                    vp+=DEVADDR_SZ;
-                    *vp++ = (seenSinceMins<255 ? seenSinceMins : 255);      // Total time seen in minutes, max'd at 255
+                // new format with devAddr/timeSinceEntered 
+                memcpy(vp, &ib->devaddr[0], DEVADDR_SZ);
+                vp+=DEVADDR_SZ;
+                *vp++ = ref->seenMins;      // Total time seen in minutes, max'd at 255
 #else
-                    // add maj/min to UL : must be number of bytes equal to EXIT_UL_SZ
-                    *vp++ = (_ctx.iblist[i].major & 0xFF);        // Just LSB of major
-                    *vp++ = (_ctx.iblist[i].minor & 0xff);
-                    *vp++ = ((_ctx.iblist[i].minor >> 8) & 0xff);
-                    *vp++ = (seenSinceMins<255 ? seenSinceMins : 255);      // Total time seen in minutes, max'd at 255
+                // add maj/min to UL : must be number of bytes equal to EXIT_UL_SZ
+                *vp++ = (ib->major & 0xFF);        // Just LSB of major
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ref->seenMins;      // Total time seen in minutes, max'd at 255
 #endif
-                    _ctx.iblist[i].inULCnt++;  
-                    // TODO Problem here - intermittant reception can mean getting a 'exit' in 1 or 2 UL, but then we rx, so no longer in exit,
-                    // but not new, so didn't get an enter.... backend will be confused...
-                    if (_ctx.iblist[i].inULCnt > _ctx.nbULRepeats) {
-                        // delete from active list
-                        _ctx.iblist[i].lastSeenAt=0;
-                        _ctx.iblist[i].inULCnt=0;       // reset for next time
-                    }
-                    log_debug("MBP: %04x:%04x exit, been in %d UL", _ctx.iblist[i].major, _ctx.iblist[i].minor, _ctx.iblist[i].inULCnt);
-                    nbAdded++;
-                    nbThisUL--;
-                    if (nbAdded>=nbContactEnd) {
-                        break;      // added all that we're allowed
-                    }
-                } else {
-                    // this should not happen if the previous calculations were correct...
-                    log_debug("MBN: unexpected no space in UL for %d",nbThisUL);
-                    _ctx.bleErrorMask |= EM_UL_NOSPACE;
-                    break;
-                }
+                ib->inULCnt++;  
+                // TODO Problem here - intermittant reception can mean getting a 'exit' in 1 or 2 UL, but then we rx, so no longer in exit,
+                // but not new, so didn't get an enter.... backend will be confused...
+                log_debug("MBP: %04x:%04x exit, been in %d UL", ib->major, ib->minor, ib->inULCnt);
+                // deleted from active list once the UL is built if sent enough times (as that moves entries about)
+                nbAdded++;
+                nbThisUL--;
+            } else {
+                // this should not happen if the previous calculations were correct...
+                log_debug("MBN: unexpected no space in UL for %d",nbThisUL);
+                _ctx.bleErrorMask |= EM_UL_NOSPACE;
+                break;
             }
         }
+        nbEndSent = nbAdded;
+    }
+    // Now remove the ended contacts we've told the backend about enough times, last found first so that the references to the
+    // others stay valid
+    for(int i=nbEndSent-1;i>=0;i--) {
+        BLE_TABLE_ENTRY_t* ib = BLETable_refEntry(&_ctx.ibtable, &END_REF(i));
+        if (ib->inULCnt > _ctx.nbULRepeats) {
+            BLETable_remove(&_ctx.ibtable, ib);
+        }
     }
 
 /*    if (nbSent>0) {
@@ -449,8 +488,12 @@ static bool getData(APP_CORE_UL_t* ul) {
         app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_ERRORMASK, 1, &_ctx.bleErrorMask);
     }
     log_info("MBp:UL curr %d new %d exit %d nav %d err %02x", 
-        nbContactCurrent, nbContactNew, nbContactEnd, _ctx.nbNav>0, _ctx.bleErrorMask);
-    return (nbContactNew>0 || nbContactEnd>0 || nbContactCurrent>0 || _ctx.nbNav>0 || _ctx.bleErrorMask!=0);
+        nbContactCurrent, nbContactNew, nbContactEnd, nbNav>0, _ctx.bleErrorMask);
+    bool ret = (nbContactNew>0 || nbContactEnd>0 || nbContactCurrent>0 || nbNav>0 || _ctx.bleErrorMask!=0);
+    if (!started) {
+        releaseRefs();
+    }
+    return ret;
 }
 
 static APP_CORE_API_t _api = {
@@ -468,10 +511,32 @@ void mod_ble_scan_prox_init(void) {
     _ctx.exitTimeoutMins=4;
     _ctx.maxContactsPerUL=50;
     _ctx.nbULRepeats = 2;
+    _ctx.exitMissedScans = MYNEWT_VAL(MOD_BLE_EXIT_MISSED_SCANS);
     _ctx.contactSignifTimeMins = MYNEWT_VAL(MOD_BLE_PROX_SIGNIF_CONTACT);
     _ctx.contactSignifRSSI = MYNEWT_VAL(MOD_BLE_PROX_SIGNIF_RSSI);
-    // initialise access (this is resistant to multiple calls...)
-    _ctx.wbleCtx = wble_mgr_init(MYNEWT_VAL(MOD_BLE_UART), MYNEWT_VAL(MOD_BLE_UART_BAUDRATE), MYNEWT_VAL(MOD_BLE_PWRIO), MYNEWT_VAL(MOD_BLE_UARTIO), MYNEWT_VAL(MOD_BLE_UART_SELECT));
+    _ctx.exitRSSI = MYNEWT_VAL(MOD_BLE_EXIT_RSSI);
+    _ctx.navRSSIAgg = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG);
+    _ctx.navRSSIAggScans = MYNEWT_VAL(MOD_BLE_NAV_RSSI_AGG_SCANS);
+    // The tracking table keeps its history between cycles, so has its own partition of the BLE arena
+    BLE_TABLE_ENTRY_t* slots = BLEArena_leasePersistent(APP_MOD_BLE_IB, BLE_TABLE_SLOTS(MAX_BLE_TRACKED)*sizeof(BLE_TABLE_ENTRY_t));
+    assert(slots!=NULL);
+    BLETable_init(&_ctx.ibtable, slots, MAX_BLE_TRACKED);
+    // as does the rssi history of the nav beacon selector (if any)
+    BLE_NAVSEL_HIST_t* hist = NULL;
+    if (NAV_HIST_SZ>0) {
+        hist = BLEArena_leasePersistent(APP_MOD_BLE_IB, NAV_HIST_SZ*sizeof(BLE_NAVSEL_HIST_t));
+        assert(hist!=NULL);
+    }
+    // and the UL building refs will need the shared partition every cycle : make sure now that the other modules leave room for them
+    bool reserved = BLEArena_reserveShared(APP_MOD_BLE_IB, MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t));
+    assert(reserved);
+    BLENavSel_init(&_ctx.navsel, &_ctx.navIBList[0], MAX_NAV, hist, NAV_HIST_SZ);
+    // Get both PROXIMITY and navigation beacons from the scan (sadly this means we get all the guys in between too but life...)
+    // The BLE is kept powered between scans as for proximity product it ibeacons in idle
+    BLEScan_subscribe(APP_MOD_BLE_IB, (BLE_TYPE_NAV<<8), (BLE_TYPE_PROXIMITY<<8) + 0xFF, &_ctx.ibtable, true);
+#if MYNEWT_VAL(MOD_BLE_SCAN_STREAM)
+    BLEScan_setRxHandler(APP_MOD_BLE_IB, &rxIB);
+#endif
 
     // Default major/minor for ibeaconning are the low 3 bytes from the lora devEUI... and major must have specific proximity MSB
     uint8_t devEUI[8];
@@ -489,5 +554,9 @@ void mod_ble_scan_prox_init(void) {
 
     // hook app-core for ble scan - serialised as competing for UART. Note we claim we're an ibeaon module
     AppCore_registerModule("BLE-SCAN-PROX", APP_MOD_BLE_IB, &_api, EXEC_SERIAL);
+    // shared with the other BLE modules
+    _ctx.mTableFull = app_core_metrics_register("ble_tblfull", APP_CORE_METRIC_COUNTER);
+    // Benchmark builds can exercise our getData() with synthetic tables
+    BLEBench_register(APP_MOD_BLE_IB, &_ctx.ibtable, &getData);
 //    log_debug("MB:mod-ble-scan-prox inited");
 }
@@ -24,129 +24,217 @@
 #include "cbor.h"
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 #include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_arena.h"
+#include "mod-ble/ble_scan.h"
+#include "mod-ble/ble_trace.h"
+#include "mod-ble/ble_bench.h"
+#include "mod-ble/ble_ul.h"
+#include "mod-ble/ble_classify.h"
+#include "mod-ble/ble_sketch.h"
+#include "mod-ble/ble_window.h"
 
 #define ENTER_UL_SZ (5)
 #define EXIT_UL_SZ (4)
 #define COUNT_UL_SZ (2)
+#define COUNT_EST_UL_SZ (3)
+#define COUNT_WINDOW_HDR_UL_SZ (2)
+#define COUNT_WINDOW_UL_SZ (3)
+#define COUNT_WINDOW_STATS_UL_SZ (4)
 #define PRESENCE_HDR_UL_SZ (2)
 #define TL_HDR_UL_SZ (2)
+// Typical sizes in the packed lists (1 byte id delta for clustered minors), used to share out the UL space
+#define ENTER_PACKED_UL_SZ (3)
+#define EXIT_PACKED_UL_SZ (2)
 
 // Max ibeacons we track in the scan history. We give ourselves some space over the defined limit to deal with the 'exit' timeouts.
 #define MAX_BLE_TRACKED (MYNEWT_VAL(MOD_BLE_MAXIBS_TAG_INZONE)+10)
 
-#define BLE_NTYPES ((BLE_TYPE_COUNTABLE_END-BLE_TYPE_COUNTABLE_START)+1)
+// Countable types that can be counted by a distinct count sketch rather than in the table (see ble_sketch.h)
+#define NB_SKETCHES (MYNEWT_VAL(MOD_BLE_COUNT_SKETCH_TYPES))
+// Countable types that can be counted over a sliding window (see ble_window.h)
+#define NB_WINDOW_TYPES (MYNEWT_VAL(MOD_BLE_COUNT_WINDOW_TYPES))
+// UL space classes, in the order they go in the UL
+#define UL_CLASS_EXIT (0)
+#define UL_CLASS_ENTER (1)
+#define UL_CLASS_COUNT (2)
+#define UL_NCLASSES (3)
+// Enters are referenced from the start of the refs list, exits from the end (see ble_classify.h)
+#define ENTER_REF(n) BLE_CLASSIFY_ENTER_REF(&_ctx.cls, (n))
+#define EXIT_REF(n) BLE_CLASSIFY_EXIT_REF(&_ctx.cls, (n))
+// The table and refs must fit in the BLE arena
+BLE_ARENA_CHECK_FITS(arena_fits_scanA_tag, BLE_TABLE_SLOTS(MAX_BLE_TRACKED)*sizeof(BLE_TABLE_ENTRY_t), MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t));
 // don't want these on the stack, and trying to avoid malloc
 
 
 static struct {
-    void* wbleCtx;
-    uint8_t exitTimeoutMins;
     uint8_t maxEnterPerUL;
     uint8_t maxExitPerUL;
-    uint8_t presenceMinorMSB;
-    ibeacon_data_t iblist[MAX_BLE_TRACKED];
+    uint8_t ulWeights[UL_NCLASSES]; // share of the UL space for each class when short
+    uint8_t ulFlushBacklog;         // ask for an extra UL if more enter/exits than this are left waiting (0=never)
+    bool flushAsked;                // this UL is the extra one (so don't ask again)
+    uint8_t ulPacked;               // send the enters/exits as packed lists (see ble_ul.h)
+    uint8_t countSketch;            // count the countables in the sketches rather than the table
+    uint8_t countWindowMins;        // count the countables seen over this sliding window rather than in the table (0=off)
+    uint8_t countWindowStats;       // and send their peak and mean since the last UL
+    BLE_TABLE_t ibtable;
     uint8_t bleErrorMask;
-    uint8_t tcount[BLE_NTYPES];
-    uint8_t uuid[UUID_SZ];
+    APP_CORE_METRIC_ID_t mTableFull;
+    APP_CORE_METRIC_ID_t mBacklog;
+#if NB_SKETCHES>0
+    BLE_SKETCH_t sketches[NB_SKETCHES];     // per countable type, since the last UL
+#endif
+#if NB_WINDOW_TYPES>0
+    BLE_WINDOW_t window;
+    BLE_WINDOW_TYPE_t windowTypes[NB_WINDOW_TYPES];
+#endif
+    BLE_TABLE_REF_t* ulrefs;        // only needed from start() to stop() (or during getData() if not started), so in the shared arena partition
+    // Results of classifying the table for this cycle (and its config) : done at start() with the new enters added as each advert is
+    // received (see rxIB()), then what depends on the whole scan rechecked at the end (see BLEClassify_settle())
+    BLE_CLASSIFY_t cls;
+    bool classified;
 //    uint8_t cborbuf[MAX_BLE_ENTER*6];
 } _ctx;
-#if 0
-static int findIB(uint16_t maj, uint16_t min) {
-    for(int i=0;i<MAX_BLE_TRACKED;i++) {
-        if ((_ctx.iblist[i].lastSeenAt>0) && _ctx.iblist[i].ib.major==maj && _ctx.iblist[i].ib.minor==min) {
-            return i;
-        }
-    }
-    return -1;
+
+// Classify the table for this cycle (see ble_classify.h). Also removes the ones that have timed out or that we don't want.
+static void classify(uint32_t now) {
+    _ctx.bleErrorMask |= BLEClassify_table(&_ctx.cls, now);
+    _ctx.classified = true;
 }
-static int findEmptyIB() {
-    for(int i=0;i<MAX_BLE_TRACKED;i++) {
-        if (_ctx.iblist[i].lastSeenAt==0) {
-            return i;
+
+#if NB_SKETCHES>0
+// Distinct countables in the sketches, all types
+static uint32_t sketchTotal() {
+    uint32_t total = 0;
+    for(int i=0;i<NB_SKETCHES;i++) {
+        if (_ctx.sketches[i].type!=0) {
+            total += BLESketch_estimate(&_ctx.sketches[i]);
         }
     }
-    return -1;
+    return total;
 }
-static bool addOrUpdateList(ibeacon_data_t* ib) {
-    int idx = findIB(ib->major, ib->minor);
-    if (idx<0) {
-        // insert
-        idx = findEmptyIB();
-        if (idx<0) {
-            // poo
-            log_debug("MBT: no space to add new tag");
-            return false;
-        } else {
-            _ctx.iblist[idx].lastSeenAt = TMMgr_getRelTimeSecs();
-            _ctx.iblist[idx].ib.major = ib->major;
-            _ctx.iblist[idx].ib.minor = ib->minor;
-            _ctx.iblist[idx].ib.rssi = ib->rssi;
-            _ctx.iblist[idx].ib.extra = ib->extra;
-            _ctx.iblist[idx].new = true;        // for UL
-        }
-    } else {
-        // update
-        _ctx.iblist[idx].lastSeenAt = TMMgr_getRelTimeSecs();
-        _ctx.iblist[idx].ib.rssi = ib->rssi;
-        _ctx.iblist[idx].ib.extra = ib->extra;
+#endif
+// Advert handler (MOD_BLE_SCAN_STREAM) : drop the types we don't track, add/update the others, and if this cycle's classification
+// is done, reference the enter/exit beacons new to the table as enters straight away. The rest is up to BLEClassify_settle() once the
+// scan is over.
+static uint8_t rxIB(ibeacon_data_t* ib, uint32_t now) {
+    BLE_CLASSIFY_ADVERT_t what = BLEClassify_advert(&_ctx.cls, ib);
+    if (what!=BLE_CLASSIFY_TRACK) {
+        // (unexpected types shouldn't happen as the scanner was told to ignore these guys)
+        return (what==BLE_CLASSIFY_UNEXPECTED ? EM_BLE_RX_BADMAJ : 0);
     }
-    return true;
-}
+    uint8_t bletype = (ib->major & 0xff00) >> 8;
+#if NB_WINDOW_TYPES>0 || NB_SKETCHES>0
+    // (the ones counted outside the table tell the scan when they are new, for its early end and adaptive scan time)
+    bool newId = false;
 #endif
-/** callback fns from BLE generic package */
-static void ble_cb(WBLE_EVENT_t e, void* d) {
-    switch(e) {
-        case WBLE_COMM_FAIL: {
-            log_debug("MBT: comm nok");
-            _ctx.bleErrorMask |= EM_BLE_COMM_FAIL;
-            break;
+#if NB_WINDOW_TYPES>0
+    if (_ctx.countWindowMins>0 && bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END &&
+            BLEWindow_seen(&_ctx.window, ib->major, ib->minor, now, &newId)) {
+        // counted over the window without taking a slot in the table (if its type didn't get a slot it goes on as usual)
+        if (newId) {
+            BLEScan_noteNew(APP_MOD_BLE_SCANA_TAGS);
         }
-        case WBLE_COMM_OK: {
-            log_debug("MBT: comm ok");
-            // Scan for both countable and enter/exit types. Note calculation of major range depends on the BLE_TYPExXX values being contigous...
-            wble_scan_start(_ctx.wbleCtx, _ctx.uuid, (BLE_TYPE_COUNTABLE_START<<8), (BLE_TYPE_PROXIMITY<<8) + 0xFF, MAX_BLE_TRACKED, &_ctx.iblist[0]);
-            break;
-        }
-        case WBLE_SCAN_RX_IB: {
-//            log_debug("MBT:ib %d:%d rssi %d", ib->major, ib->minor, ib->rssi);
-            // wble mgr fills in / updates the list we gave it
-            break;
+        return 0;
+    }
+#endif
+#if NB_SKETCHES>0
+    if (_ctx.countSketch && bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END &&
+            BLESketch_add(&_ctx.sketches[0], NB_SKETCHES, ib->major, ib->minor, &newId)) {
+        // counted without taking a slot in the table (if its type didn't get a sketch it goes in the table as usual)
+        if (newId) {
+            // the estimate only moves when a register is raised, but then by as many as it now thinks were missed
+            BLEScan_noteCount(APP_MOD_BLE_SCANA_TAGS, sketchTotal());
         }
-        default: {
-            log_debug("MBT cb %d", e);
-            break;         
-        }   
+        return 0;
+    }
+#endif
+    int nbBefore = BLETable_nbActive(&_ctx.ibtable);
+    bool isNew = (BLETable_find(&_ctx.ibtable, ib->major, ib->minor)==NULL);
+    BLE_TABLE_ENTRY_t* e = BLETable_addOrUpdate(&_ctx.ibtable, ib, now);
+    if (e==NULL) {
+        return EM_BLE_TABLE_FULL;
+    }
+    // Seeing one again changes nothing here (BLEClassify_settle() sees it was seen)
+    if (!isNew || !_ctx.classified) {
+        return 0;
     }
+    if (BLETable_nbActive(&_ctx.ibtable)==nbBefore) {
+        // it evicted another to get in, which moves entries about : classify it all again in getData()
+        _ctx.classified = false;
+        return 0;
+    }
+    BLEClassify_added(&_ctx.cls, e, now);
+    return 0;
+}
+
+// The UL building refs are in the shared arena partition
+static bool leaseRefs() {
+    uint32_t arenaSz;
+    _ctx.ulrefs = BLEArena_lease(APP_MOD_BLE_SCANA_TAGS, MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t), &arenaSz);
+    _ctx.cls.refs = _ctx.ulrefs;
+    _ctx.classified = false;
+    return (_ctx.ulrefs!=NULL);       // (reserved at init, so only if another module holds it : arena logged it)
+}
+static void releaseRefs() {
+    // no refs, no results
+    _ctx.classified = false;
+    _ctx.ulrefs = NULL;
+    _ctx.cls.refs = NULL;
+    BLEArena_release(APP_MOD_BLE_SCANA_TAGS);
 }
 
 // My api functions
 static uint32_t start() {
     // Read config each start() to take into account any changes
-    // exit timeout should actually be in function of the delay between scans...
-    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_EXIT_TIMEOUT_MINS, &_ctx.exitTimeoutMins, 1, 4*60);
+    // exit timeout should actually be in function of the delay between scans... which is what counting missed scans does
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_EXIT_TIMEOUT_MINS, &_ctx.cls.exitTimeoutMins, 1, 4*60);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_EXIT_MISSED_SCANS, &_ctx.cls.exitMissedScans, 0, 15);
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_MAX_ENTER_PER_UL, &_ctx.maxEnterPerUL, 1, 255);
     CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_MAX_EXIT_PER_UL, &_ctx.maxExitPerUL, 1, 255);
-    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_PRESENCE_MINOR, &_ctx.presenceMinorMSB, 0, 255);
+    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_UL_WEIGHTS, &_ctx.ulWeights[0], UL_NCLASSES);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_UL_FLUSH_BACKLOG, &_ctx.ulFlushBacklog, 0, 255);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_UL_PACKED, &_ctx.ulPacked, 0, 1);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_COUNT_SKETCH, &_ctx.countSketch, 0, 1);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_COUNT_WINDOW_MINS, &_ctx.countWindowMins, 0, 255);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_COUNT_WINDOW_STATS, &_ctx.countWindowStats, 0, 1);
+#if NB_WINDOW_TYPES>0
+    if (_ctx.countWindowMins>0) {
+        // (only restarts the counts if the window length changed)
+        BLEWindow_init(&_ctx.window, &_ctx.windowTypes[0], NB_WINDOW_TYPES, _ctx.countWindowMins*60, TMMgr_getRelTimeSecs());
+    }
+#endif
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_PRESENCE_MINOR, &_ctx.cls.presenceMinorMSB, 0, 255);
+    CFMgr_getOrAddElementCheckRangeINT8(CFG_UTIL_KEY_BLE_ENTER_RSSI, &_ctx.cls.enterRSSI, -127, 0);
+    CFMgr_getOrAddElementCheckRangeINT8(CFG_UTIL_KEY_BLE_EXIT_RSSI, &_ctx.cls.exitRSSI, -127, 0);
+    if (_ctx.cls.exitRSSI>_ctx.cls.enterRSSI) {
+        _ctx.cls.exitRSSI = _ctx.cls.enterRSSI;        // or they would flap in and out
+    }
 
     // no errors yet
     _ctx.bleErrorMask = 0;
+    if (!leaseRefs()) {
+        return 0;       // can't run this cycle
+    }
+#if MYNEWT_VAL(MOD_BLE_SCAN_STREAM)
+    // Classify the table as it is before the scan, then the adverts are added in as they are received
+    classify(TMMgr_getRelTimeSecs());
+#endif
 
-    // and tell ble to go with a callback to tell me when its got something
-    wble_start(_ctx.wbleCtx, ble_cb);
     // Return the scan time (checking config is ok)
     uint32_t bleScanTimeMS = 5000;
     CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_TIME_MS, &bleScanTimeMS, 1000, 60000);
-    
-    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_IBEACON_UUID, &_ctx.uuid, UUID_SZ);
-
 
-    return bleScanTimeMS;
+    // scan, unless another BLE module already did it for us this cycle
+    return BLEScan_start(APP_MOD_BLE_SCANA_TAGS, bleScanTimeMS);
 }
 
 static void stop() {
-    // Done BLE, go idle
-    wble_scan_stop(_ctx.wbleCtx);
+    releaseRefs();
+    // End of the cycle, but the scan carries on into our table (if we were the one scanning)
+    BLEScan_stop(APP_MOD_BLE_SCANA_TAGS);
 }
 static void off() {
     // nothing to do
@@ -156,102 +244,49 @@ static void deepsleep() {
 }
 
 static bool getData(APP_CORE_UL_t* ul) {
-    // we have knowledge of 2 types of ibeacons
-    // - short range 'fixed navigation' type (sparsely deployed, we shouldn't see many, only send up best rssi ones)
-    //      - major=0x00xx
-    // - long range 'mobile tag' type : may congregate in areas so we see a lot of them.
-    // Three sub cases : 
-    //      'count only' : major = 0x01xx - 0x7Fxx
-    //      'enter/exit' : major = 0x80xx
-    //      'presence' : major=0x81xx, minor = 0xZZxx where ZZ is configured for this device.
-    // This module deals with the long range types
-    int nbEnter=0;
-    int nbExit=0;
-    int nbCount=0;
-        // Presence guys : this is a single TLV (we only track 1 minor block per device)
-    int maxMinorIdPresence = -1;        // to work out if we see any, and if so, the max id seen (to economise space)
-    uint16_t majorPresence=0;         // Normally we expect all presence guys to have same major...
-
-    uint32_t now = TMMgr_getRelTimeSecs();
-    
-    // reset countables counts
-    memset(&_ctx.tcount[0], 0, sizeof(_ctx.tcount));
+    bool started = (_ctx.ulrefs!=NULL);
+    if (!started) {
+        // eg benchmark : just need the refs for this call
+        if (!leaseRefs()) {
+            return false;
+        }
+    }
+    // When benched, the table is a synthetic one : leave the scan, errors and metrics alone
+    bool bench = BLEBench_isRunning();
+    if (!bench) {
+        // get any last ones from the scanner, and work on the table as it is now (the scan carries on into the staging list)
+        BLEScan_snapshot(APP_MOD_BLE_SCANA_TAGS);
+        _ctx.bleErrorMask |= BLEScan_getErrors(APP_MOD_BLE_SCANA_TAGS);
+        // Debug builds can record the raw scan table for offline replay
+        BLETrace_snapshotTable(APP_MOD_BLE_SCANA_TAGS, &_ctx.ibtable);
+    }
     // Check if table is full.
-    int nActive = wble_getNbIBActive(_ctx.wbleCtx,0);
+    int nActive = BLETable_nbActive(&_ctx.ibtable);
     log_debug("MBT: proc %d active BLE", nActive);
-    if (nActive==MAX_BLE_TRACKED) {
+    if (BLETable_isFull(&_ctx.ibtable)) {
         _ctx.bleErrorMask |= EM_BLE_TABLE_FULL;        
-    }
-    // for each one seen, check its type, flagging new ones, doing the count, etc
-    for(int i=0;i<MAX_BLE_TRACKED;i++) {
-        if (_ctx.iblist[i].lastSeenAt>0) {      // its a valid entry
-            uint8_t bletype = (_ctx.iblist[i].major & 0xff00) >> 8;
-            if (bletype==BLE_TYPE_NAV) {
-                // ignore, shouldn't happen as the scanner was told to ignore these guys
-                log_warn("MBT:remove unex NAV type");
-                _ctx.bleErrorMask |= EM_BLE_RX_BADMAJ;
-                // Free up his space
-                _ctx.iblist[i].lastSeenAt=0;
-            } else if (bletype==BLE_TYPE_ENTEREXIT) {
-                // exit/enter type : if new, we want to put in enter list in the outgoing message
-                if (_ctx.iblist[i].new) {
-                    nbEnter++;
-                } else {
-                    //  if not seen for last X minutes, we want to put in the exit list
-                    if ( (now - _ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60)) {
-                        nbExit++;       // gonna need to flag up as exit
-                    }
-                    // Note for enter/exits we only remove them when we have managed to send their id in the UL
-                }
-            } else if (bletype==BLE_TYPE_PRESENCE) {
-                // Presence type: we only indicate each time if we see or not the minor set we are looking for
-                if (((_ctx.iblist[i].minor & 0xff00) >> 8) == _ctx.presenceMinorMSB) {
-                    // is he timed out (exited)? (using same timeout as enter/exit case)
-                    if ((now-_ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60)) {
-                        // Yes, he's not present (and we'll 'delete' him by resetting his lastSeenAt)
-                        _ctx.iblist[i].lastSeenAt=0;
-                    } else {
-                        // He's present
-                        uint8_t minorId = (_ctx.iblist[i].minor & 0xff);     // bit position
-                        if (minorId > maxMinorIdPresence) {
-                            maxMinorIdPresence = minorId;
-                        }
-                        if (majorPresence!=_ctx.iblist[i].major) {
-                            majorPresence = _ctx.iblist[i].major;
-                            // Should only happen when set first time...
-                            log_debug("MBT:presence major=%d", majorPresence);
-                        }
-                    }
-                } else  {
-                    // we don't care about ones with a minor that we're not looking for - remove from our list to avoid blocking a slot
-                    _ctx.iblist[i].lastSeenAt=0;
-                    log_debug("MBT:remove uncon pres minor=%d", _ctx.iblist[i].minor);
-                }
-            } else if (bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END) {
-                // Ensure remove from our list if timed out
-                if ((now-_ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60)) {
-                    // Yes, he's gone so we'll 'delete' him by setting his lastSeenAt to 0
-                    _ctx.iblist[i].lastSeenAt=0;
-                } else {
-                    // countable type : inc its counter
-                    int idx = (bletype - BLE_TYPE_COUNTABLE_START);
-                    if (idx>=0 && idx<=BLE_NTYPES) {
-                        // dont wrap the counter. 255==too many to count...
-                        if (_ctx.tcount[idx]<255) {
-                            _ctx.tcount[idx]++;
-                        }
-                        nbCount++;
-                    } // else should not happen 
-                }
-            } else {
-                // ignore, shouldn't happen as the scanner was told to ignore these guys
-                log_warn("MBT:remove unex type=%d", bletype);
-                _ctx.bleErrorMask |= EM_BLE_RX_BADMAJ;
-                // Free up the space
-                _ctx.iblist[i].lastSeenAt=0;
-            }
+        if (!bench) {
+            app_core_metrics_inc(_ctx.mTableFull);
         }
     }
+    uint32_t now = TMMgr_getRelTimeSecs();
+    if (!_ctx.classified) {
+        // not streamed (or an eviction upset it) : do it all now
+        classify(now);
+    } else {
+        // streamed : now the scan is over, see who's exited and what's still around
+        BLEClassify_settle(&_ctx.cls, now);
+    }
+    int nbEnter = BLEClassify_entersToSend(&_ctx.cls);
+    int nbCount = _ctx.cls.nbCount;
+    int maxMinorIdPresence = _ctx.cls.maxMinorIdPresence;
+    uint16_t majorPresence = _ctx.cls.majorPresence;
+    int nbExit = _ctx.cls.nbExit;
+    // Oldest first, so the ones that didn't fit in previous ULs go before any newer ones : enters by first seen, exits by last seen.
+    BLETable_sortRefs(&_ctx.ibtable, &ENTER_REF(0), nbEnter, false, true);
+    // (the exit refs run down from the end of the list, so that part is sorted newest first to get the oldest as EXIT_REF(0))
+    BLETable_sortRefs(&_ctx.ibtable, &EXIT_REF(nbExit-1), nbExit, true, false);
+    int nbWaiting = nbEnter + nbExit;
     // Limit numbers in the UL to configured maxes
     if (nbExit>_ctx.maxExitPerUL) {
         nbExit = _ctx.maxExitPerUL;
@@ -259,132 +294,159 @@ static bool getData(APP_CORE_UL_t* ul) {
     if (nbEnter>_ctx.maxEnterPerUL) {
         nbEnter = _ctx.maxEnterPerUL;
     }
+    // The window counted types (which aren't in the table) go in their own TLV
+    int nbWindowTypes = 0;
+#if NB_WINDOW_TYPES>0
+    if (_ctx.countWindowMins>0) {
+        BLEWindow_advance(&_ctx.window, now);
+        for(int i=0;i<NB_WINDOW_TYPES;i++) {
+            if (_ctx.windowTypes[i].type!=0) {
+                nbWindowTypes++;
+            }
+        }
+    }
+#endif
     // Count number of types with non-zero counts
     int nbTypes = 0;
     for(int i=0;(i<BLE_NTYPES);i++) {
-        if (_ctx.tcount[i]>0) {
+        if (_ctx.cls.tcount[i]>0) {
             nbTypes++;
         }
     }
+    // and the estimates of the sketch counted types, which always go in
+    int nbSketches = 0;
+#if NB_SKETCHES>0
+    for(int i=0;i<NB_SKETCHES;i++) {
+        if (_ctx.sketches[i].type!=0) {
+            nbSketches++;
+        }
+    }
+#endif
 
-    // Adjust numbers to divide up remaining UL space 'fairly' between enter/exit/types
-    // how much space would it take (assuming spread over 4 UL packets)
-    int bytesRequired = nbEnter*ENTER_UL_SZ + nbExit*EXIT_UL_SZ + nbTypes*COUNT_UL_SZ + TL_HDR_UL_SZ*6;
-    int bytesAvailable = app_core_msg_ul_getTotalSpaceAvailable(ul);
-    // Assume splitting space evenly ie 1/3 each so everyone has same reduction %age if required
-    int percentReduc = (bytesAvailable>bytesRequired) ? 100 : (bytesAvailable*100 / bytesRequired);
-    int nbEnterToAdd = (nbEnter * percentReduc) / 100;
-    int nbExitToAdd = (nbExit * percentReduc) / 100;
-    int nbTypesToAdd = (nbTypes * percentReduc) / 100;
-    log_debug("MBT:br:%d ba:%d pr:%d ne:%d nea:%d",bytesRequired, bytesAvailable, percentReduc, nbEnter, nbEnterToAdd);
+    // Divide up remaining UL space between exit/enter/types by their weights (keeping space for the TL headers assuming spread over
+    // 4 UL packets). What doesn't fit stays in the table for the next UL.
+    BLE_UL_CLASS_t classes[UL_NCLASSES] = {
+        { .nbWaiting = nbExit, .itemSz = (_ctx.ulPacked ? EXIT_PACKED_UL_SZ : EXIT_UL_SZ), .weight = _ctx.ulWeights[UL_CLASS_EXIT] },
+        { .nbWaiting = nbEnter, .itemSz = (_ctx.ulPacked ? ENTER_PACKED_UL_SZ : ENTER_UL_SZ), .weight = _ctx.ulWeights[UL_CLASS_ENTER] },
+        { .nbWaiting = nbTypes, .itemSz = COUNT_UL_SZ, .weight = _ctx.ulWeights[UL_CLASS_COUNT] },
+    };
+    int bytesAvailable = app_core_msg_ul_getTotalSpaceAvailable(ul) - TL_HDR_UL_SZ*6 - (_ctx.ulPacked ? BLE_UL_PACKED_HDR_SZ*4 : 0)
+                - (nbSketches>0 ? TL_HDR_UL_SZ + nbSketches*COUNT_EST_UL_SZ : 0)
+                - (nbWindowTypes>0 ? TL_HDR_UL_SZ + COUNT_WINDOW_HDR_UL_SZ +
+                    nbWindowTypes*(COUNT_WINDOW_UL_SZ + (_ctx.countWindowStats ? COUNT_WINDOW_STATS_UL_SZ : 0)) : 0);
+    BLEUL_allocate(classes, UL_NCLASSES, bytesAvailable);
+    int nbExitToAdd = classes[UL_CLASS_EXIT].nbToAdd;
+    int nbEnterToAdd = classes[UL_CLASS_ENTER].nbToAdd;
+    int nbTypesToAdd = classes[UL_CLASS_COUNT].nbToAdd;
+    log_debug("MBT:ba:%d nx:%d nxa:%d ne:%d nea:%d", bytesAvailable, nbExit, nbExitToAdd, nbEnter, nbEnterToAdd);
     // Now add the appropriate numbers of each element
-    if (nbExitToAdd>0) {
+    int nbExitSent = 0;
+    int nbEnterSent = 0;
+    BLE_TABLE_REF_t* exitsSent = &EXIT_REF(0);
+    if (nbExitToAdd>0 && _ctx.ulPacked) {
+        // these get sorted by id, so the ones sent are the first of that part of the refs list
+        exitsSent = &EXIT_REF(nbExitToAdd-1);
+        nbExitSent = BLEUL_addPacked(ul, APP_CORE_UL_BLE_EXIT_PACKED, &_ctx.ibtable, exitsSent, nbExitToAdd, BLE_UL_PACKED_SEEN, &_ctx.bleErrorMask);
+    } else if (nbExitToAdd>0) {
         int nbAdded = 0;
         uint8_t* vp = NULL;
         int nbThisUL = 0;
-        for(int i=0;i<MAX_BLE_TRACKED && nbAdded<nbExitToAdd; i++) {
-            // If a valid entry, and of enter/exit ble type, and has timed out...
-            if ((_ctx.iblist[i].lastSeenAt>0) 
-                    && (((_ctx.iblist[i].major & 0xFF00) >> 8) == BLE_TYPE_ENTEREXIT) 
-                    && (now-_ctx.iblist[i].lastSeenAt)>(_ctx.exitTimeoutMins*60)) {
-                if (nbThisUL <= 0) {
-                    // Find space in UL
-                    int bytesInUL = app_core_msg_ul_remainingSz(ul);
-                    // Check if space for TL and 1 ble at least
-                    if (bytesInUL < (TL_HDR_UL_SZ + EXIT_UL_SZ)) {
-                        // move to next message and get size (0=no next!)
-                        if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
-                            // no more messages, sorry
-                            log_debug("MBN: unexpected no next UL still got %d",(nbExitToAdd-nbAdded));
-                            _ctx.bleErrorMask |= EM_UL_NONEXTUL;
-                            break;      // from for, we're done here
-                        }
-                    }
-                    nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / EXIT_UL_SZ; 
-                    if (nbThisUL > (nbExitToAdd-nbAdded)) {
-                        // should always give a >0 answer as nbAdded is never >= nbExitToAdd here
-                        nbThisUL = (nbExitToAdd-nbAdded);
-                        assert(nbThisUL>0);
+        while(nbAdded<nbExitToAdd) {
+            // the timed out enter/exit ones, as found above
+            BLE_TABLE_REF_t* ref = &EXIT_REF(nbAdded);
+            BLE_TABLE_ENTRY_t* ib = BLETable_refEntry(&_ctx.ibtable, ref);
+            if (nbThisUL <= 0) {
+                // Find space in UL
+                int bytesInUL = app_core_msg_ul_remainingSz(ul);
+                // Check if space for TL and 1 ble at least
+                if (bytesInUL < (TL_HDR_UL_SZ + EXIT_UL_SZ)) {
+                    // move to next message and get size (0=no next!)
+                    if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
+                        // no more messages, sorry
+                        log_debug("MBN: unexpected no next UL still got %d",(nbExitToAdd-nbAdded));
+                        _ctx.bleErrorMask |= EM_UL_NONEXTUL;
+                        break;      // from for, we're done here
                     }
-                    vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_EXIT, nbThisUL*EXIT_UL_SZ);
                 }
-                if (vp!=NULL) {
-                    int seenSinceMins = ((now - _ctx.iblist[i].firstSeenAt) / 60);
-                    // add maj/min to UL : must be number of bytes equal to EXIT_UL_SZ
-                    *vp++=(_ctx.iblist[i].major & 0xFF);        // Just LSB of major
-                    *vp++ = (_ctx.iblist[i].minor & 0xff);
-                    *vp++ = ((_ctx.iblist[i].minor >> 8) & 0xff);
-                    *vp++ = (seenSinceMins<255 ? seenSinceMins : 255);      // Total time seen in minutes, max'd at 255
-                    // delete from active list
-                    _ctx.iblist[i].lastSeenAt=0;
-                    nbAdded++;
-                    nbThisUL--;
-                    if (nbAdded>=nbExitToAdd) {
-                        break;      // added all that we're allowed
-                    }
-
-                } else {
-                    // this should not happen if the previous calculations were correct...
-                    log_debug("MBN: unexpected no space in UL for %d",nbThisUL);
-                    _ctx.bleErrorMask |= EM_UL_NOSPACE;
-                    break;
+                nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / EXIT_UL_SZ; 
+                if (nbThisUL > (nbExitToAdd-nbAdded)) {
+                    // should always give a >0 answer as nbAdded is never >= nbExitToAdd here
+                    nbThisUL = (nbExitToAdd-nbAdded);
+                    assert(nbThisUL>0);
                 }
+                vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_EXIT, nbThisUL*EXIT_UL_SZ);
+            }
+            if (vp!=NULL) {
+                // add maj/min to UL : must be number of bytes equal to EXIT_UL_SZ
+                *vp++=(ib->major & 0xFF);        // Just LSB of major
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ref->seenMins;      // Total time seen in minutes, max'd at 255
+                nbAdded++;
+                nbThisUL--;
+            } else {
+                // this should not happen if the previous calculations were correct...
+                log_debug("MBN: unexpected no space in UL for %d",nbThisUL);
+                _ctx.bleErrorMask |= EM_UL_NOSPACE;
+                break;
             }
         }
+        // deleted from active list once the UL is built (as that moves entries about)
+        nbExitSent = nbAdded;
+        exitsSent = &EXIT_REF(nbExitSent-1);
     }
     // put up to max enter elemnents into UL.
-    if (nbEnterToAdd>0) {
+    if (nbEnterToAdd>0 && _ctx.ulPacked) {
+        nbEnterSent = BLEUL_addPacked(ul, APP_CORE_UL_BLE_ENTER_PACKED, &_ctx.ibtable, &ENTER_REF(0), nbEnterToAdd, BLE_UL_PACKED_RSSI | BLE_UL_PACKED_EXTRA, &_ctx.bleErrorMask);
+        for(int i=0;i<nbEnterSent;i++) {
+            BLETable_refEntry(&_ctx.ibtable, &ENTER_REF(i))->new = false;
+        }
+    } else if (nbEnterToAdd>0) {
         int nbAdded = 0;
         uint8_t* vp = NULL;
         int nbThisUL = 0;
-        for(int i=0;i<MAX_BLE_TRACKED && nbAdded<nbEnterToAdd; i++) {
-            // If entry is valid, and of type enter/exit, and is new, then...
-            if ((_ctx.iblist[i].lastSeenAt>0) 
-                    && (((_ctx.iblist[i].major & 0xFF00) >> 8) == BLE_TYPE_ENTEREXIT)
-                    && _ctx.iblist[i].new) {
-                if (nbThisUL <= 0) {
-                    // Find space in UL
-                    int bytesInUL = app_core_msg_ul_remainingSz(ul);
-                    // Check if space for TL and 1 ble at least
-                    if (bytesInUL < (TL_HDR_UL_SZ + ENTER_UL_SZ)) {
-                        // move to next message and get size (0=no next!)
-                        if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
-                            // no more messages, sorry
-                            log_debug("MBN: unexpected no next UL still got enter %d",(nbEnterToAdd-nbAdded));
-                            _ctx.bleErrorMask |= EM_UL_NONEXTUL;
-                            break;      // from for, we're done here
-                        }
+        while(nbAdded<nbEnterToAdd) {
+            // the new enter/exit ones, as found above
+            BLE_TABLE_ENTRY_t* ib = BLETable_refEntry(&_ctx.ibtable, &ENTER_REF(nbAdded));
+            if (nbThisUL <= 0) {
+                // Find space in UL
+                int bytesInUL = app_core_msg_ul_remainingSz(ul);
+                // Check if space for TL and 1 ble at least
+                if (bytesInUL < (TL_HDR_UL_SZ + ENTER_UL_SZ)) {
+                    // move to next message and get size (0=no next!)
+                    if ((bytesInUL = app_core_msg_ul_requestNextUL(ul)) <= 0) {
+                        // no more messages, sorry
+                        log_debug("MBN: unexpected no next UL still got enter %d",(nbEnterToAdd-nbAdded));
+                        _ctx.bleErrorMask |= EM_UL_NONEXTUL;
+                        break;      // from for, we're done here
                     }
-                    nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / ENTER_UL_SZ; 
-                    if (nbThisUL > (nbEnterToAdd-nbAdded)) {
-                        // should always give a >0 answer as nbAdded is never >= nbEnterToAdd here
-                        nbThisUL = (nbEnterToAdd-nbAdded);
-                        assert(nbThisUL>0);
-                    }
-                    vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_ENTER, nbThisUL*ENTER_UL_SZ);
                 }
-                if (vp!=NULL) {
-                    // add maj/min to UL (number of bytes == ENTER_UL_SZ)
-                    *vp++ = (_ctx.iblist[i].major & 0xFF);        // Just LSB of major
-                    *vp++ = (_ctx.iblist[i].minor & 0xff);
-                    *vp++ = ((_ctx.iblist[i].minor >> 8) & 0xff);
-                    *vp++ = _ctx.iblist[i].rssi;
-                    *vp++ = _ctx.iblist[i].extra;
-                    _ctx.iblist[i].new = false;
-                    nbAdded++;
-                    nbThisUL--;
-                    if (nbAdded>=nbEnterToAdd) {
-                        break;      // added all that we're allowed
-                    }
-
-                } else {
-                    // this should not happen if the previous calculations were correct...
-                    log_debug("MBN: no space in UL for enter %d",nbThisUL);
-                    _ctx.bleErrorMask |= EM_UL_NOSPACE;
-                    break;
+                nbThisUL = (bytesInUL-TL_HDR_UL_SZ) / ENTER_UL_SZ; 
+                if (nbThisUL > (nbEnterToAdd-nbAdded)) {
+                    // should always give a >0 answer as nbAdded is never >= nbEnterToAdd here
+                    nbThisUL = (nbEnterToAdd-nbAdded);
+                    assert(nbThisUL>0);
                 }
+                vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_ENTER, nbThisUL*ENTER_UL_SZ);
+            }
+            if (vp!=NULL) {
+                // add maj/min to UL (number of bytes == ENTER_UL_SZ)
+                *vp++ = (ib->major & 0xFF);        // Just LSB of major
+                *vp++ = (ib->minor & 0xff);
+                *vp++ = ((ib->minor >> 8) & 0xff);
+                *vp++ = ib->rssi;
+                *vp++ = ib->extra;
+                ib->new = false;
+                nbAdded++;
+                nbThisUL--;
+            } else {
+                // this should not happen if the previous calculations were correct...
+                log_debug("MBN: no space in UL for enter %d",nbThisUL);
+                _ctx.bleErrorMask |= EM_UL_NOSPACE;
+                break;
             }
         }
+        nbEnterSent = nbAdded;
     }
     // put in types and counts
     // WARNING : backend must handle case where set of type/counts split across multiple ULs - must deal with set of ULs together...
@@ -393,7 +455,7 @@ static bool getData(APP_CORE_UL_t* ul) {
         uint8_t* vp = NULL;
         int nbThisUL = 0;
         for(int i=0;(i<BLE_NTYPES);i++) {
-            if (_ctx.tcount[i]>0) {
+            if (_ctx.cls.tcount[i]>0) {
                 if (nbThisUL <= 0) {
                     // Find space in UL
                     int bytesInUL = app_core_msg_ul_remainingSz(ul);
@@ -417,8 +479,8 @@ static bool getData(APP_CORE_UL_t* ul) {
                 }
                 if (vp!=NULL) {
                     *vp++=(BLE_TYPE_COUNTABLE_START+i);
-                    *vp++=_ctx.tcount[i];
-                    log_debug("MBT: countable tags type %d saw %d", BLE_TYPE_COUNTABLE_START+i, _ctx.tcount[i]);
+                    *vp++=_ctx.cls.tcount[i];
+                    log_debug("MBT: countable tags type %d saw %d", BLE_TYPE_COUNTABLE_START+i, _ctx.cls.tcount[i]);
                     nbAdded++;
                     nbThisUL--;
                     if (nbAdded>=nbTypesToAdd) {
@@ -436,30 +498,74 @@ static bool getData(APP_CORE_UL_t* ul) {
         // add empty TLV to signal we scanned but didnt see them
         app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_COUNT, 0, NULL);
     }
-
-    // Ask for space for TLV if we see any presence guys as active
-    if (maxMinorIdPresence>=0)  { 
-        uint8_t* vp = app_core_msg_ul_addTLgetVP(ul, APP_CORE_UL_BLE_PRESENCE, PRESENCE_HDR_UL_SZ+((maxMinorIdPresence/8)+1));
-        *vp++ = (majorPresence & 0xff);
-        *vp++ = _ctx.presenceMinorMSB;
-        for(int i=0;i<MAX_BLE_TRACKED;i++) {
-            // Is this a valid entry, and a presence type, and for the minor range we monitor?
-            if ((_ctx.iblist[i].lastSeenAt>0) &&
-                (((_ctx.iblist[i].major & 0xff00) >> 8) == BLE_TYPE_PRESENCE) &&
-                (((_ctx.iblist[i].minor & 0xff00) >> 8) == _ctx.presenceMinorMSB)) {
-                uint8_t minorId = (_ctx.iblist[i].minor & 0xff);     // bit position
-                if (minorId<=maxMinorIdPresence) {
-                    // set this bit in byte array
-                    vp[minorId/8] |= (1<<(minorId%8));
-                } else {
-                    // never happens? should be assert?
-                    log_warn("MBT:pres:minorid(%d)>maxminor(%d)", minorId, maxMinorIdPresence);
+#if NB_SKETCHES>0
+    // Sketch counted types : type then LE16 estimated count of distinct ones seen since the last UL
+    if (nbSketches>0) {
+        uint8_t v[NB_SKETCHES*COUNT_EST_UL_SZ];
+        uint8_t sz = 0;
+        for(int i=0;i<NB_SKETCHES;i++) {
+            if (_ctx.sketches[i].type!=0) {
+                uint32_t est = BLESketch_estimate(&_ctx.sketches[i]);
+                v[sz] = _ctx.sketches[i].type;
+                Util_writeLE_uint16_t(v, sz+1, (est>0xFFFF ? 0xFFFF : est));
+                sz += COUNT_EST_UL_SZ;
+                log_debug("MBT: countable tags type %d est %d", _ctx.sketches[i].type, est);
+            }
+        }
+        BLEUL_addTLV(ul, APP_CORE_UL_BLE_COUNT_EST, sz, v, &_ctx.bleErrorMask);
+    }
+    // and start counting again for the next UL
+    if (!bench) {
+        BLESketch_clear(&_ctx.sketches[0], NB_SKETCHES);
+        BLEScan_noteCount(APP_MOD_BLE_SCANA_TAGS, 0);
+    }
+#endif
+#if NB_WINDOW_TYPES>0
+    // Window counted types : window minutes, flags (b0 = peak and mean present), then type, LE16 distinct count seen in the window
+    // and, if b0, LE16 peak and LE16 mean of that count since the last UL
+    if (nbWindowTypes>0) {
+        uint8_t v[COUNT_WINDOW_HDR_UL_SZ + NB_WINDOW_TYPES*(COUNT_WINDOW_UL_SZ+COUNT_WINDOW_STATS_UL_SZ)];
+        uint8_t sz = 0;
+        v[sz++] = _ctx.countWindowMins;
+        v[sz++] = (_ctx.countWindowStats ? 0x01 : 0);
+        for(int i=0;i<NB_WINDOW_TYPES;i++) {
+            if (_ctx.windowTypes[i].type!=0) {
+                uint16_t count = BLEWindow_count(&_ctx.window, i);
+                v[sz] = _ctx.windowTypes[i].type;
+                Util_writeLE_uint16_t(v, sz+1, count);
+                sz += COUNT_WINDOW_UL_SZ;
+                if (_ctx.countWindowStats) {
+                    Util_writeLE_uint16_t(v, sz, BLEWindow_peak(&_ctx.window, i));
+                    Util_writeLE_uint16_t(v, sz+2, BLEWindow_mean(&_ctx.window, i));
+                    sz += COUNT_WINDOW_STATS_UL_SZ;
                 }
+                log_debug("MBT: countable tags type %d in %d mins %d", _ctx.windowTypes[i].type, _ctx.countWindowMins, count);
             }
         }
+        BLEUL_addTLV(ul, APP_CORE_UL_BLE_COUNT_WINDOW, sz, v, &_ctx.bleErrorMask);
+        if (!bench) {
+            BLEWindow_resetStats(&_ctx.window);
+        }
+    }
+#endif
+
+    // Add TLV if we see any presence guys as active
+    if (maxMinorIdPresence>=0)  { 
+        uint8_t v[PRESENCE_HDR_UL_SZ+BLE_UL_PRESENCE_MAX_SZ];
+        v[0] = (majorPresence & 0xff);
+        v[1] = _ctx.cls.presenceMinorMSB;
+        // bits were set as we went through the table
+        if (_ctx.ulPacked) {
+            // as a bitmap, list or runs, whichever is smallest
+            uint8_t sz = BLEUL_packPresence(&_ctx.cls.presenceBits[0], maxMinorIdPresence, &v[PRESENCE_HDR_UL_SZ]);
+            BLEUL_addTLV(ul, APP_CORE_UL_BLE_PRESENCE_PACKED, PRESENCE_HDR_UL_SZ+sz, v, &_ctx.bleErrorMask);
+        } else {
+            memcpy(&v[PRESENCE_HDR_UL_SZ], &_ctx.cls.presenceBits[0], (maxMinorIdPresence/8)+1);
+            BLEUL_addTLV(ul, APP_CORE_UL_BLE_PRESENCE, PRESENCE_HDR_UL_SZ+((maxMinorIdPresence/8)+1), v, &_ctx.bleErrorMask);
+        }
     } else {
         // add empty TLV to signal we scanned but didnt see them
-        app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_PRESENCE, 0, NULL);
+        BLEUL_addTLV(ul, (_ctx.ulPacked ? APP_CORE_UL_BLE_PRESENCE_PACKED : APP_CORE_UL_BLE_PRESENCE), 0, NULL, &_ctx.bleErrorMask);
     }
 
 
@@ -494,12 +600,36 @@ static bool getData(APP_CORE_UL_t* ul) {
         }
     }
 */
+    // Now remove the exits we sent (they're not in table order any more, BLETable_removeRefs() deals with that)
+    BLETable_removeRefs(&_ctx.ibtable, exitsSent, nbExitSent);
+    // Too many left waiting for the next UL? ask for an extra one just for us, straight after this one (but not after an extra one,
+    // so that at most every other UL is an extra)
+    int backlog = nbWaiting - (nbEnterSent + nbExitSent);
+    // (not when benched, it's not a real backlog)
+    if (!bench) {
+        app_core_metrics_set(_ctx.mBacklog, backlog);
+        if (_ctx.ulFlushBacklog>0 && backlog>_ctx.ulFlushBacklog && !_ctx.flushAsked) {
+            log_info("MBT:backlog %d, ask extra UL", backlog);
+            _ctx.flushAsked = AppCore_forceULAfterCycle(APP_MOD_BLE_SCANA_TAGS);
+        } else {
+            _ctx.flushAsked = false;
+        }
+    }
     // If error like tracking list is full and we failed to see a enter/exit guy, flag it up...
     if (_ctx.bleErrorMask!=0) {
         app_core_msg_ul_addTLV(ul, APP_CORE_UL_BLE_ERRORMASK, 1, &_ctx.bleErrorMask);
     }
     log_info("MBT:UL enter %d/%d exit %d/%d types %d/%d/%d, maxPId %d err %02x", 
         nbEnter, nbEnterToAdd, nbExit, nbExitToAdd, nbCount, nbTypes, nbTypesToAdd, maxMinorIdPresence, _ctx.bleErrorMask);
+    // The results are used up : next cycle classifies again
+    _ctx.classified = false;
+    // Let the scan at the table again
+    if (!bench) {
+        BLEScan_commit(APP_MOD_BLE_SCANA_TAGS);
+    }
+    if (!started) {
+        releaseRefs();
+    }
 //    return (nbEnterToAdd>0 || nbExitToAdd>0 || nbTypesToAdd>0 || _ctx.bleErrorMask!=0);
     return true;        // always gotta send UL as 'no BLEs seen' is also important!
 }
@@ -516,13 +646,43 @@ static APP_CORE_API_t _api = {
 void mod_ble_scanA_tag_init(void) {
     // _ctx in bss -> set to 0 by default
     // Set non-0 init values (default before config read)
-    _ctx.exitTimeoutMins=5;
+    _ctx.cls.exitTimeoutMins=5;
     _ctx.maxEnterPerUL=50;
     _ctx.maxExitPerUL=50;
-    // initialise access (this is resistant to multiple calls...)
-    _ctx.wbleCtx = wble_mgr_init(MYNEWT_VAL(MOD_BLE_UART), MYNEWT_VAL(MOD_BLE_UART_BAUDRATE), MYNEWT_VAL(MOD_BLE_PWRIO), MYNEWT_VAL(MOD_BLE_UARTIO), MYNEWT_VAL(MOD_BLE_UART_SELECT));
+    _ctx.ulWeights[UL_CLASS_EXIT] = 1;
+    _ctx.ulWeights[UL_CLASS_ENTER] = 1;
+    _ctx.ulWeights[UL_CLASS_COUNT] = 1;
+    _ctx.ulFlushBacklog = MYNEWT_VAL(MOD_BLE_UL_FLUSH_BACKLOG);
+    _ctx.ulPacked = MYNEWT_VAL(MOD_BLE_UL_PACKED);
+    _ctx.countSketch = MYNEWT_VAL(MOD_BLE_COUNT_SKETCH);
+    _ctx.countWindowMins = MYNEWT_VAL(MOD_BLE_COUNT_WINDOW_MINS);
+    _ctx.countWindowStats = MYNEWT_VAL(MOD_BLE_COUNT_WINDOW_STATS);
+    _ctx.cls.exitMissedScans = MYNEWT_VAL(MOD_BLE_EXIT_MISSED_SCANS);
+    _ctx.cls.enterRSSI = MYNEWT_VAL(MOD_BLE_ENTER_RSSI);
+    _ctx.cls.exitRSSI = MYNEWT_VAL(MOD_BLE_EXIT_RSSI);
+    // The tracking table keeps its history between cycles, so has its own partition of the BLE arena
+    BLE_TABLE_ENTRY_t* slots = BLEArena_leasePersistent(APP_MOD_BLE_SCANA_TAGS, BLE_TABLE_SLOTS(MAX_BLE_TRACKED)*sizeof(BLE_TABLE_ENTRY_t));
+    assert(slots!=NULL);
+    BLETable_init(&_ctx.ibtable, slots, MAX_BLE_TRACKED);
+    _ctx.cls.tbl = &_ctx.ibtable;
+    _ctx.cls.nbRefs = MAX_BLE_TRACKED;
+    // and the UL building refs will need the shared partition every cycle : make sure now that the other modules leave room for them
+    bool reserved = BLEArena_reserveShared(APP_MOD_BLE_SCANA_TAGS, MAX_BLE_TRACKED*sizeof(BLE_TABLE_REF_t));
+    assert(reserved);
+    // Get both countable and enter/exit types from the scan. Note calculation of major range depends on the BLE_TYPExXX values being contigous...
+    BLEScan_subscribe(APP_MOD_BLE_SCANA_TAGS, (BLE_TYPE_COUNTABLE_START<<8), (BLE_TYPE_PROXIMITY<<8) + 0xFF, &_ctx.ibtable, true);
+    // and keep scanning between cycles
+    BLEScan_setContinuous(APP_MOD_BLE_SCANA_TAGS, true);
+#if MYNEWT_VAL(MOD_BLE_SCAN_STREAM) || NB_SKETCHES>0 || NB_WINDOW_TYPES>0
+    BLEScan_setRxHandler(APP_MOD_BLE_SCANA_TAGS, &rxIB);
+#endif
 
     // hook app-core for ble scan - serialised as competing for UART
     AppCore_registerModule("BLE-SCANA-TAG", APP_MOD_BLE_SCANA_TAGS, &_api, EXEC_SERIAL);
+    // shared with the other BLE modules
+    _ctx.mTableFull = app_core_metrics_register("ble_tblfull", APP_CORE_METRIC_COUNTER);
+    _ctx.mBacklog = app_core_metrics_register("ble_tagA_backlog", APP_CORE_METRIC_GAUGE);
+    // Benchmark builds can exercise our getData() with synthetic tables
+    BLEBench_register(APP_MOD_BLE_SCANA_TAGS, &_ctx.ibtable, &getData);
 //    log_debug("MB:mod-ble-scanA-tag inited");
 }
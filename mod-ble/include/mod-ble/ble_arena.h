@@ -0,0 +1,57 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_ARENA_H
+#define H_BLE_ARENA_H
+
+#include <inttypes.h>
+#include "app-core/app_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shared beacon arena : a single block of MOD_BLE_ARENA_SZ bytes that the BLE modules take their beacon lists/tables from, rather
+// than each having its own static ones. The BLE modules are EXEC_SERIAL on the same UART so only one is ever scanning : the lists
+// a module only needs during its own cycle all use the same 'shared' partition, and only the ones that must keep history between
+// cycles take a partition of their own ('persistent').
+// Persistent partitions are taken from the top of the arena, and the shared partition is whatever they leave.
+// Each module's own needs are checked at build time (BLE_ARENA_CHECK_FITS()), and the total of the modules linked at init, so a
+// target whose arena is too small fails at boot rather than its modules silently skipping their cycles.
+
+// Build time check that a module's own partitions fit in the arena (fails to compile, with a negative array size, if not)
+#define BLE_ARENA_CHECK_FITS(name, persistentSz, sharedSz) \
+    typedef char name[(((persistentSz)+(sharedSz)) <= MYNEWT_VAL(MOD_BLE_ARENA_SZ)) ? 1 : -1]
+
+// Take a persistent partition of sz bytes, kept for ever. Must be called at init (ie before any shared lease).
+// Returns NULL (and logs it) if not enough space left in the arena, keeping the shared partition as big as has been reserved.
+void* BLEArena_leasePersistent(APP_MOD_ID_t mid, uint32_t sz);
+// Reserve the minimum size this module will lease the shared partition with, at init. The persistent partitions taken before or after
+// must leave at least the largest reserved size. Returns false (and logs it) if they already don't.
+bool BLEArena_reserveShared(APP_MOD_ID_t mid, uint32_t sz);
+// Lease the shared partition (all of it, size returned in *sz) for this module, typically from its start() to its stop().
+// Its contents are zeroed each time it is leased. Returns NULL (and logs it) if another module holds it or if it is smaller
+// than minSz (which can't happen if minSz was reserved at init). Leasing it again while holding it is ok (and zeroes it again).
+void* BLEArena_lease(APP_MOD_ID_t mid, uint32_t minSz, uint32_t* sz);
+// Release the shared partition (if this module holds it)
+void BLEArena_release(APP_MOD_ID_t mid);
+// Size the shared partition has after the persistent ones are taken
+uint32_t BLEArena_sharedSz();
+// Is the shared partition held by a module (ie one of the BLE modules is in its cycle)?
+bool BLEArena_isLeased();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_ARENA_H */
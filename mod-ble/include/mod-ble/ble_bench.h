@@ -0,0 +1,66 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_BENCH_H
+#define H_BLE_BENCH_H
+
+#include <inttypes.h>
+#include "wyres-generic/wblemgr.h"
+#include "app-core/app_core.h"
+#include "mod-ble/ble_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// getData() benchmark : when MOD_BLE_BENCH is set in the target syscfg, modules that keep their own scan table register it here,
+// and the AT+BLEBENCH console command fills it with synthetic beacon populations (size, type mix, churn) and times their getData()
+// (including UL packing). Does nothing when MOD_BLE_BENCH is 0.
+// The bench only runs between cycles (not while a registered module is running or its table is being fed by a scan), and swaps a
+// scratch table in under the module's table while it runs, so the beacons being tracked are not lost.
+// The AT+BLEREPLAY console command uses the same scratch table to replay scan trace snapshots (see ble_trace.h) through a
+// module's getData(), and prints the UL it builds.
+void BLEBench_register(APP_MOD_ID_t mid, BLE_TABLE_t* tbl, APP_MOD_GETULDATA_FN_t getData);
+#if MYNEWT_VAL(MOD_BLE_BENCH)
+// Fill a table with nb synthetic beacons using the given type mix (index into the bench mixes) and random seed.
+// The table is emptied first. Returns number actually in the table (limited by its capacity)
+int BLEBench_fillTable(BLE_TABLE_t* tbl, int nb, int mixId, uint32_t seed);
+// Name of a bench type mix, or NULL if mixId is past the last one
+const char* BLEBench_mixName(int mixId);
+// Result of a bench run : beacons actually in the table, getData() time, and the UL set it built (valid until the next bench or replay)
+typedef struct {
+    int nb;
+    uint32_t elapsedUS;
+    APP_CORE_UL_t* ul;
+} BLE_BENCH_RESULT_t;
+// Run a registered module's getData() once on a synthetic table of nb beacons of the given mix, as AT+BLEBENCH does (in the scratch
+// table, so nb is limited by it and by the module's table). Returns false if the module is not registered or can't be benched now
+bool BLEBench_run(APP_MOD_ID_t mid, int nb, int mixId, BLE_BENCH_RESULT_t* res);
+// True while the bench is calling a module's getData() : it must then leave alone what is outside its table (the scan, its
+// errors, metrics, the scan trace) and do just the processing and UL building
+bool BLEBench_isRunning();
+// Replay a scan trace snapshot through a registered module's getData() : start with the module and the mark age of the BT:S line
+// (false if the module is not registered or can't be benched now), add the records of each BT:R line, and end to run getData() on
+// them. Returns the UL set it built (valid until the next bench or replay), or NULL if no snapshot was started
+bool BLEBench_replayStart(APP_MOD_ID_t mid, int32_t markAgeS);
+int BLEBench_replayRecords(const uint8_t* recs, int sz);
+APP_CORE_UL_t* BLEBench_replayEnd();
+#else
+#define BLEBench_isRunning() (false)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_BENCH_H */
@@ -0,0 +1,82 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_CLASSIFY_H
+#define H_BLE_CLASSIFY_H
+
+#include <inttypes.h>
+#include "wyres-generic/wblemgr.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Classification of a tag tracking table for a cycle, shared by scan-tag and scanA-tag : the enter/exits to send are referenced
+// (so the UL stages only look at the ones they will send), the countables counted per type and the presence bits set.
+// The long range 'mobile tag' types it deals with :
+//      'count only' : major = 0x01xx - 0x7Fxx
+//      'enter/exit' : major = 0x80xx
+//      'presence' : major=0x81xx, minor = 0xZZxx where ZZ is configured for this device.
+// Proximity types (0x82xx) are in the scanned range but not sent : the enter/exit records only have the major LSB, so they can't be
+// told from the enter/exit types.
+#define BLE_NTYPES ((BLE_TYPE_COUNTABLE_END-BLE_TYPE_COUNTABLE_START)+1)
+
+typedef struct {
+    // Settings : the module's config is read straight into these
+    BLE_TABLE_t* tbl;
+    BLE_TABLE_REF_t* refs;          // enters are referenced from the start, exits from the end (an entry can't be both)
+    int nbRefs;
+    uint8_t exitTimeoutMins;
+    uint8_t exitMissedScans;        // or gone after this many scans without being seen (0=use the timeout)
+    uint8_t presenceMinorMSB;
+    int8_t enterRSSI;               // smoothed rssi needed to enter, and under which an entered one exits
+    int8_t exitRSSI;
+    // Results
+    int nbEnter;
+    int nbExit;
+    int nbCount;
+    int maxMinorIdPresence;         // to work out if we see any, and if so, the max id seen (to economise space)
+    uint16_t majorPresence;         // Normally we expect all presence guys to have same major...
+    uint8_t tcount[BLE_NTYPES];
+    uint8_t presenceBits[32];       // bit per presence minor id (0-255)
+} BLE_CLASSIFY_t;
+#define BLE_CLASSIFY_ENTER_REF(c, n) ((c)->refs[(n)])
+#define BLE_CLASSIFY_EXIT_REF(c, n) ((c)->refs[(c)->nbRefs-1-(n)])
+
+// What to do with an advert (see BLEClassify_advert())
+typedef enum { BLE_CLASSIFY_TRACK, BLE_CLASSIFY_DROP, BLE_CLASSIFY_UNEXPECTED } BLE_CLASSIFY_ADVERT_t;
+
+/*
+ * Classify the whole table : check each one's type, doing the counts and presence bits, and referencing the enters/exits.
+ * Also removes the ones that have timed out or that we don't want (so don't hold entry pointers across it).
+ * <returns>Returns the error bits to flag (EM_BLE_RX_BADMAJ if it had types the scanner was told to ignore)</returns>
+ */
+uint8_t BLEClassify_table(BLE_CLASSIFY_t* c, uint32_t now);
+// The classification streamed into during a scan was done before it : redo the parts that depend on what the scan did or didn't see
+// (which entered ones have exited, and which countables/presence are still around). Nothing is removed so the enter refs stay valid :
+// the ones now gone are removed by the next BLEClassify_table().
+void BLEClassify_settle(BLE_CLASSIFY_t* c, uint32_t now);
+// Should an advert go in the table? Presence ones with another minor MSB, and proximity ones, are dropped
+BLE_CLASSIFY_ADVERT_t BLEClassify_advert(BLE_CLASSIFY_t* c, ibeacon_data_t* ib);
+// Reference an entry new to the classified table (if its type is sent on entering)
+void BLEClassify_added(BLE_CLASSIFY_t* c, BLE_TABLE_ENTRY_t* e, uint32_t now);
+// Keep just the enter refs strong enough to be sent (the others wait in the table until they are, or are gone). Returns how many
+int BLEClassify_entersToSend(BLE_CLASSIFY_t* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_CLASSIFY_H */
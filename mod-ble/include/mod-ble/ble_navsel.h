@@ -0,0 +1,86 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_NAVSEL_H
+#define H_BLE_NAVSEL_H
+
+#include <inttypes.h>
+#include "os/os.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Best nav beacons selector, shared by the modules that send up a 'best rssi' list (scan-nav, scan-alert, proximity).
+// Keeps the k strongest of the beacons offered in a min-heap on rssi : the weakest kept is at the top, so a beacon weaker than it
+// is rejected in O(1) and a stronger one replaces it in O(log k), whatever the number of beacons or the order they come in.
+// A beacon offered several times in a scan keeps its strongest rssi. Equal rssis are ordered by id (lowest first) so the list
+// doesn't reorder from one scan to the next on the order the beacons were offered in.
+// Optionally the rssi each beacon is selected (and sent) with is an aggregate (max or median) of its rssi in each of the last
+// few scans, so that a single noisy scan doesn't reorder the list. This needs a history entry per beacon (14 bytes each).
+#define BLE_NAVSEL_MAX_SCANS (8)
+// rssi of a scan the beacon was not seen in
+#define BLE_NAVSEL_NOT_SEEN (-128)
+
+typedef enum { BLE_NAVSEL_AGG_NONE=0, BLE_NAVSEL_AGG_MAX=1, BLE_NAVSEL_AGG_MEDIAN=2 } BLE_NAVSEL_AGG_t;
+
+typedef struct {
+    uint16_t major;
+    uint16_t minor;
+    int8_t rssi;
+    uint8_t extra;
+} BLE_NAVSEL_ENTRY_t;
+
+// rssi of a beacon in each of the last scans : a ring indexed like the selector's cur
+typedef struct {
+    uint16_t major;
+    uint16_t minor;
+    uint8_t extra;
+    int8_t rssi[BLE_NAVSEL_MAX_SCANS];
+} BLE_NAVSEL_HIST_t;
+
+typedef struct {
+    BLE_NAVSEL_ENTRY_t* heap;
+    uint8_t k;
+    uint8_t nb;
+    bool ended;             // heap holds the result of the last BLENavSel_endScan() : the next offer starts a new scan
+    uint8_t agg;            // BLE_NAVSEL_AGG_t
+    uint8_t nbScans;        // aggregated over
+    uint8_t cur;            // ring index of the current scan in the history entries
+    BLE_NAVSEL_HIST_t* hist;
+    uint8_t histCap;
+    uint8_t nbHist;
+} BLE_NAVSEL_t;
+
+// Init the selector to keep the k best in heap (k entries). hist (histCap entries) is only needed for aggregation (can be NULL/0).
+// Aggregation is off until set with BLENavSel_setAggregation()
+void BLENavSel_init(BLE_NAVSEL_t* s, BLE_NAVSEL_ENTRY_t* heap, int k, BLE_NAVSEL_HIST_t* hist, int histCap);
+// Set the rssi aggregation over the last nbScans scans (1-BLE_NAVSEL_MAX_SCANS). Changing it empties the history.
+// Without history entries it stays off.
+void BLENavSel_setAggregation(BLE_NAVSEL_t* s, BLE_NAVSEL_AGG_t agg, int nbScans);
+// Is the rssi aggregated? If so, only offer the beacons actually seen in the scan (not ones a table still holds from before), or the
+// history would take their old rssi as seen again
+bool BLENavSel_isAggregating(BLE_NAVSEL_t* s);
+// Offer a beacon seen in the current scan. With aggregation, the history only has space for histCap beacons : when it is full
+// a new one replaces the one with the weakest aggregate, if that is weaker than it.
+void BLENavSel_offer(BLE_NAVSEL_t* s, uint16_t major, uint16_t minor, int8_t rssi, uint8_t extra);
+// End the scan : the best ones are in BLENavSel_best(), strongest first, until the next offer. Returns how many.
+// With aggregation they are the best on their aggregate over the last scans, including ones not seen in this scan.
+int BLENavSel_endScan(BLE_NAVSEL_t* s);
+BLE_NAVSEL_ENTRY_t* BLENavSel_best(BLE_NAVSEL_t* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_NAVSEL_H */
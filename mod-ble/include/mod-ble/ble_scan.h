@@ -0,0 +1,75 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_SCAN_H
+#define H_BLE_SCAN_H
+
+#include <inttypes.h>
+#include "app-core/app_core.h"
+#include "mod-ble/ble_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shared scan engine : the BLE modules subscribe their tracking table with the major range they want, and a single scan session
+// (over the union of the ranges of the active subscribers) feeds all of them, each advert going to the tables whose range it is in.
+// The first subscriber to start() in a cycle runs the scan; the others that run after it in the same cycle (ie before the next UL)
+// find their table already fed and only need a token time. So a target with eg scan-nav and scan-tag powers the BLE and scans
+// once per cycle, not twice.
+
+// Time a subscriber needs in start() when its table was fed by the scan of another one this cycle
+#define BLE_SCAN_FED_MS (10)
+
+// Advert handler : if a subscriber sets one, it is called for each advert in its range as it is received, instead of the advert just
+// being added to its table. It does the add (or drops the advert) itself, so it can do its per-beacon processing during the scan
+// window rather than in getData(). Returns the EM_BLE_xxx error bits to flag for it (eg EM_BLE_TABLE_FULL if the add failed).
+typedef uint8_t (*BLE_SCAN_RX_FN_t)(ibeacon_data_t* ib, uint32_t now);
+
+// Register at init. keepPowered : don't power the BLE down after the scan (eg as it ibeacons in between)
+void BLEScan_subscribe(APP_MOD_ID_t mid, uint16_t majorStart, uint16_t majorEnd, BLE_TABLE_t* tbl, bool keepPowered);
+// Set (or clear with NULL) the advert handler for a subscriber
+void BLEScan_setRxHandler(APP_MOD_ID_t mid, BLE_SCAN_RX_FN_t fn);
+// From an advert handler : a beacon new to this scan was counted without being added to the table (eg in a sketch). It then counts
+// for the early scan end and the adaptive scan time like a beacon added to the table does
+void BLEScan_noteNew(APP_MOD_ID_t mid);
+// Or, for a count kept outside the table that is an estimate (eg the sum of its sketch estimates) : give its running total whenever it
+// changes, and when it is reset. What it goes up by counts as that many new beacons
+void BLEScan_noteCount(APP_MOD_ID_t mid, uint32_t total);
+// Continuous subscriber (implies keepPowered) : when the scan that fed it is stopped, it carries on feeding just the continuous
+// subscribers until the next start(), so back to back cycles have no scan gap
+void BLEScan_setContinuous(APP_MOD_ID_t mid, bool continuous);
+// From start() : returns the time for start() to return, ie scanTimeMS if it starts the scan, or BLE_SCAN_FED_MS if its table
+// was already fed this cycle
+uint32_t BLEScan_start(APP_MOD_ID_t mid, uint32_t scanTimeMS);
+// From stop() : stops the scan (and powers down the BLE, unless a subscriber wants it kept on) if this module started it
+void BLEScan_stop(APP_MOD_ID_t mid);
+// At the start of getData() : put the last adverts received into the tables
+void BLEScan_flush();
+// Or, if the scan may still be feeding the table during getData() (continuous subscriber) : put the last adverts received into the
+// tables, then hold the ones received after in the staging list until BLEScan_commit(). So getData() works on a table that doesn't
+// change under it, and its removals and flag changes are all in before the scan touches the table again. Adverts of beacons that don't
+// fit in the staging list (MOD_BLE_STAGING_SZ) meanwhile are missed, but with continuous scanning they are seen again on their next
+// advert. If it filled up, BLEScan_commit() counts it in the ble_stagefull metric.
+void BLEScan_snapshot(APP_MOD_ID_t mid);
+void BLEScan_commit(APP_MOD_ID_t mid);
+// Get the EM_BLE_xxx errors (comm fail, table full) seen while feeding this module's table since the last call
+uint8_t BLEScan_getErrors(APP_MOD_ID_t mid);
+// Is a scan feeding this module's table right now? (its own, another module's this cycle, or a continuous one between cycles)
+bool BLEScan_isFeeding(APP_MOD_ID_t mid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_SCAN_H */
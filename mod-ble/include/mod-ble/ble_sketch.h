@@ -0,0 +1,50 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_SKETCH_H
+#define H_BLE_SKETCH_H
+
+#include <inttypes.h>
+#include "os/os.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Distinct count sketch (HyperLogLog) for countable beacon types : counts the distinct major/minors added in a fixed 65 bytes however
+// many there are, to about 13% (1 standard error) above a few hundred, and closer below (where it counts the empty registers instead).
+// Adding the same beacon again changes nothing, so each advert can be added as it is received.
+#define BLE_SKETCH_REGS (64)
+typedef struct {
+    uint8_t type;                       // countable type (major MSB) it counts, 0=free
+    uint8_t regs[BLE_SKETCH_REGS];      // max rank seen per register
+} BLE_SKETCH_t;
+
+// Empty a set of sketches (all free)
+void BLESketch_clear(BLE_SKETCH_t* sk, int nb);
+// Add a beacon to the sketch for its type (major MSB) in the set, taking a free one for the type if it has none yet.
+// Returns false if there was no sketch free for it. isNew (if not NULL) is set as for BLESketch_addTo()
+bool BLESketch_add(BLE_SKETCH_t* sk, int nb, uint16_t major, uint16_t minor, bool* isNew);
+// Add a beacon to this sketch, whatever its type. Returns true if it raised a register, ie it is certainly new to the sketch
+// (a new beacon that doesn't raise one, more likely the more were added, isn't noticed)
+bool BLESketch_addTo(BLE_SKETCH_t* s, uint16_t major, uint16_t minor);
+// Merge a sketch into another : it then counts the distinct beacons added to either
+void BLESketch_merge(BLE_SKETCH_t* into, BLE_SKETCH_t* from);
+// Estimated number of distinct beacons added
+uint32_t BLESketch_estimate(BLE_SKETCH_t* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_SKETCH_H */
@@ -0,0 +1,166 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_TABLE_H
+#define H_BLE_TABLE_H
+
+#include <inttypes.h>
+#include "os/os.h"
+#include "wyres-generic/wblemgr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Beacon tracking table : open addressing hash table (linear probing) keyed on major/minor, so adding/updating from a scan
+// result is O(1) whatever the table size. Removal shifts back the following entries of the probe chain, so there are no
+// tombstones and lookups never slow down as beacons come and go.
+// The slots are kept at most 75% used so the probe chains stay short when full, and are a power of two so finding the home slot is a
+// mask : the slot array must be BLE_TABLE_SLOTS(capacity) long, ie the power of two at or above capacity*4/3 (max 32768).
+#define BLE_TABLE_POW2(n) ((n)<=4 ? 4 : (n)<=8 ? 8 : (n)<=16 ? 16 : (n)<=32 ? 32 : (n)<=64 ? 64 : (n)<=128 ? 128 : (n)<=256 ? 256 : \
+    (n)<=512 ? 512 : (n)<=1024 ? 1024 : (n)<=2048 ? 2048 : (n)<=4096 ? 4096 : (n)<=8192 ? 8192 : (n)<=16384 ? 16384 : 32768)
+#define BLE_TABLE_SLOTS(capacity) (BLE_TABLE_POW2((((capacity)*4)+2)/3))
+// The wblemgr scans into a small staging list, which is merged into the tables on each rx (see ble_scan.h)
+#define BLE_TABLE_STAGING_SZ (MYNEWT_VAL(MOD_BLE_STAGING_SZ))
+
+// Packed tracking record : 12 bytes rather than the 24 of an ibeacon_data_t, so twice the beacons for the same RAM.
+// Seen times are 16 bit seconds relative to the table's base time : use BLETable_lastSeenAgeS()/BLETable_firstSeenAgeS().
+// The full major is kept as its MSB (the type) varies within a table. The devaddr is only kept if MOD_BLE_TABLE_DEVADDR is set.
+// The rssi is smoothed over the adverts (fixed point EWMA, see MOD_BLE_RSSI_SMOOTH), to 1/16dB : rssi is the dBm part (rounded down).
+typedef struct {
+    uint16_t major;
+    uint16_t minor;
+    int8_t rssi;
+    uint8_t extra;
+    uint16_t lastSeen;
+    uint16_t firstSeen;
+    uint8_t used:1;
+    uint8_t new:1;          // enter not yet sent in UL
+    uint8_t inULCnt:6;      // max 63
+    uint8_t rssiFrac:4;     // 1/16dB above rssi
+    uint8_t missed:4;       // consecutive scans it was not seen in, up to the last mark (max 15)
+#if MYNEWT_VAL(MOD_BLE_TABLE_DEVADDR)
+    uint8_t devaddr[DEVADDR_SZ];
+#endif
+} BLE_TABLE_ENTRY_t;
+
+// What to do with a new beacon when the table is full :
+// - NONE : nothing, it is not recorded
+// - OLDEST : evict the entry last seen longest ago (weakest rssi if same), but only if the new one was seen more recently
+// - WEAKEST : evict the weakest rssi entry (last seen longest ago if same), but only if the new one is stronger
+// The victim is the best one in the next BLE_TABLE_EVICT_SCAN slots (going round the table from one eviction to the next, and on
+// until there is an evictable one), so evicting is not O(table size) : on a large table it is a good candidate rather than the best.
+// Countables (and any unexpected types, eg nav in a tag table) are evicted before presence types, and enter/exit or proximity types
+// are never evicted (so their enter and exit always get sent). Evictions are counted per eviction class
+// (countables and unexpected types : ble_evict_count, presence : ble_evict_pres), not per major type : there can be up to 127
+// countable types, far more than the metrics registry holds.
+typedef enum { BLE_TABLE_EVICT_NONE=0, BLE_TABLE_EVICT_OLDEST=1, BLE_TABLE_EVICT_WEAKEST=2 } BLE_TABLE_EVICT_t;
+#define BLE_TABLE_EVICT_SCAN (32)
+
+typedef struct {
+    BLE_TABLE_ENTRY_t* slots;
+    uint16_t nbSlots;
+    uint16_t capacity;
+    uint16_t nbActive;
+    uint16_t evictFrom;     // where the next eviction starts looking
+    uint32_t baseS;         // time the entry seen times are relative to. Moved on when they would overflow
+    uint8_t evictPolicy;    // BLE_TABLE_EVICT_t
+    uint16_t nbAdded;       // count of entries ever added (wraps), so a caller can see if anything new arrived
+    uint16_t nbSeenSinceMark;   // entries added or updated that hadn't been seen since the mark (see BLETable_mark())
+    uint32_t markS;
+    uint64_t fingerprint;       // of the set of major/minors in the table (see BLETable_fingerprint())
+} BLE_TABLE_t;
+
+// Iteration state. Iteration starts at an empty slot, so that removing the current entry (with BLETable_iterRemove) only
+// ever moves entries not yet visited : every entry is seen exactly once. Don't add entries while iterating.
+typedef struct {
+    uint16_t cur;
+    uint16_t nbDone;
+    bool stay;          // current was removed, so recheck same slot (as something may have moved into it)
+} BLE_TABLE_ITER_t;
+
+// Reference to an entry found while iterating, so that later processing can go straight to it rather than walk the table again.
+// Only valid while nothing is added or removed (except in the way described for BLETable_remove())
+typedef struct {
+    uint16_t slot;
+    uint8_t seenMins;       // minutes since first seen (max 255), as its wanted in most ULs
+} BLE_TABLE_REF_t;
+
+// Init the table for capacity beacons, in slots[BLE_TABLE_SLOTS(capacity)].
+// The eviction policy is MOD_BLE_TABLE_EVICT, which can be changed with BLETable_setEvictPolicy()
+void BLETable_init(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* slots, int capacity);
+void BLETable_setEvictPolicy(BLE_TABLE_t* t, BLE_TABLE_EVICT_t policy);
+void BLETable_clear(BLE_TABLE_t* t);
+int BLETable_capacity(BLE_TABLE_t* t);
+int BLETable_nbActive(BLE_TABLE_t* t);
+bool BLETable_isFull(BLE_TABLE_t* t);
+BLE_TABLE_ENTRY_t* BLETable_find(BLE_TABLE_t* t, uint16_t major, uint16_t minor);
+// Update the entry with the same major/minor, or add it (as new, first seen now), evicting one if full and the policy allows.
+// Returns the entry, or NULL if it didn't fit. Eviction moves other entries so don't call this while iterating.
+BLE_TABLE_ENTRY_t* BLETable_addOrUpdate(BLE_TABLE_t* t, ibeacon_data_t* ib, uint32_t now);
+// Remove an entry (outside of an iteration : use BLETable_iterRemove() when iterating)
+// Removing an entry only moves those after it in iteration order, so to remove several entries referenced during an iteration,
+// remove the last found first and the other references stay valid.
+void BLETable_remove(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e);
+// Fingerprint of the set of major/minors in the table, to see if it changed : the sum of a 64 bit hash of each one, kept up to date as
+// entries are added and removed (including evictions), so O(1) per change. The same set gives the same value whatever the order it was
+// built in, and two different sets have about a 1 in 2^64 chance of the same value (whereas eg a sum of the minors has {1,4}=={2,3})
+uint64_t BLETable_fingerprint(BLE_TABLE_t* t);
+// What one id adds to a fingerprint, so a subset of the entries can be compared the same way (the sum of their hashes)
+uint64_t BLETable_idHash(uint16_t major, uint16_t minor);
+
+// Seconds since the entry was last/first seen. Ages older than the base time (which is kept at least 9 hours back) saturate.
+uint32_t BLETable_lastSeenAgeS(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now);
+uint32_t BLETable_firstSeenAgeS(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now);
+// Set the seen times (in secs since boot like now), eg for synthetic tables
+void BLETable_setSeenAt(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t firstSeenAt, uint32_t lastSeenAt);
+
+// Iterate : BLETable_iterStart(t, &it); while((ib=BLETable_iterNext(t, &it))!=NULL) { ... }
+void BLETable_iterStart(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it);
+BLE_TABLE_ENTRY_t* BLETable_iterNext(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it);
+// Remove the entry just returned by BLETable_iterNext()
+void BLETable_iterRemove(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it);
+// Get a reference to the entry just returned by BLETable_iterNext(), and the entry for a reference
+void BLETable_iterRef(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it, uint32_t now, BLE_TABLE_REF_t* ref);
+// Get a reference to an entry (eg as returned by BLETable_addOrUpdate())
+void BLETable_entryRef(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now, BLE_TABLE_REF_t* ref);
+BLE_TABLE_ENTRY_t* BLETable_refEntry(BLE_TABLE_t* t, BLE_TABLE_REF_t* ref);
+// Sort references by first seen (or by last seen if byLastSeen) time, oldest first (or newest first if !oldestFirst).
+// Same times keep their order, so the order is stable from one cycle to the next.
+void BLETable_sortRefs(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, bool byLastSeen, bool oldestFirst);
+// Sort references by id (major LSB then minor, as sent in the ULs), lowest first
+void BLETable_sortRefsById(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n);
+// Remove the entries for a set of references, whatever order they are in (the refs are reordered so they can be removed last found first)
+void BLETable_removeRefs(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n);
+// Remove the entries not seen for more than maxAgeS
+void BLETable_removeOlder(BLE_TABLE_t* t, uint32_t maxAgeS, uint32_t now);
+// Mark the start of a scan : BLE_TABLE_t.nbSeenSinceMark then counts the distinct beacons seen since. Also counts the scan since the
+// previous mark as missed for the entries not seen in it.
+void BLETable_mark(BLE_TABLE_t* t, uint32_t now);
+// Set the mark time (secs since boot, 0 for none) without counting a scan as missed, eg when rebuilding a table from a scan trace
+void BLETable_setMarkAt(BLE_TABLE_t* t, uint32_t markS);
+// Consecutive scans the entry was not seen in, counting the one since the last mark (so 0 if seen since)
+uint8_t BLETable_missedScans(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e);
+// Has the entry gone? If missedScans is 0 : not seen for more than timeoutS. Else : not seen in the last missedScans scans (and, if
+// MOD_BLE_EXIT_MISSED_WITH_TIME, not seen for more than timeoutS either). Counting scans rather than time means the exit latency
+// doesn't depend on the cycle time (which changes eg when the device stops moving)
+bool BLETable_isGone(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now, uint32_t timeoutS, uint8_t missedScans);
+// Count the enter/exit and proximity type entries (the ones whose exit gets sent) last seen at or after seenSince but
+// not since notSince (times in secs since boot like now), eg the ones seen in the previous scan but not yet in this one
+int BLETable_nbExpected(BLE_TABLE_t* t, uint32_t seenSince, uint32_t notSince, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_TABLE_H */
@@ -0,0 +1,44 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_TRACE_H
+#define H_BLE_TRACE_H
+
+#include <inttypes.h>
+#include "mod-ble/ble_table.h"
+#include "app-core/app_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Scan trace recording : when MOD_BLE_TRACE is set in the target syscfg, each BLE module dumps the raw contents of its
+// scan table to the log at the start of its getData(), so that real site data can be captured and replayed offline.
+// See the mod-ble README for the line format. Does nothing when MOD_BLE_TRACE is 0.
+// The snapshots can be replayed through the modules' getData() on a MOD_BLE_BENCH build (see ble_bench.h).
+void BLETrace_snapshotTable(APP_MOD_ID_t mid, BLE_TABLE_t* t);
+
+// Each table entry is written as a 12 byte record (multi-byte values little endian):
+// major(2), minor(2), rssi(1), extra(1), secs since lastSeenAt(2), secs since firstSeenAt(2),
+// flags(1 : b0=new, b4-7=scans missed up to the mark), inULCnt(1)
+#define BLE_TRACE_REC_SZ (12)
+// Rebuild a table from a snapshot : set its mark (markAgeS as in the BT:S line, -1 for none), then add records (sz bytes, as in
+// the BT:R lines) with their seen times relative to now. Returns the number added, or -1 if sz is not a whole number of records
+void BLETrace_loadMark(BLE_TABLE_t* t, int32_t markAgeS, uint32_t now);
+int BLETrace_loadRecords(BLE_TABLE_t* t, const uint8_t* recs, int sz, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_TRACE_H */
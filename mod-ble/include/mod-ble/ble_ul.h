@@ -0,0 +1,101 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_UL_H
+#define H_BLE_UL_H
+
+#include <inttypes.h>
+#include "app-core/app_core.h"
+#include "mod-ble/ble_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// UL space allocation between the classes of BLE events a module sends (eg enter, exit, count). What doesn't fit stays in the
+// module's table as a backlog for the next UL, so the modules send each class oldest first to bound how long an event can wait.
+typedef struct {
+    uint16_t nbWaiting;     // items of this class wanting to go in the UL
+    uint8_t itemSz;         // bytes per item (>0)
+    uint8_t weight;         // share of the space when it is short (relative to the other classes). 0=only gets what the others leave
+    uint16_t nbToAdd;       // result : how many to put in the UL
+} BLE_UL_CLASS_t;
+
+/*
+ * Share bytesAvailable between the classes in proportion to their weights. A class needing less than its share gets just what it
+ * needs, and the rest is shared out again between the others (water filling), so no space is lost while anyone is waiting.
+ * Any space left after that (rounding, or all of it if no weighted class is waiting) goes to the classes in the order given.
+ * <returns>Returns the number of items that didn't fit (the backlog)</returns>
+ */
+int BLEUL_allocate(BLE_UL_CLASS_t* classes, int nbClasses, int bytesAvailable);
+
+// Packed enter/exit lists (APP_CORE_UL_BLE_ENTER_PACKED/EXIT_PACKED TLVs) : rather than fixed size records, the value is
+//  - flags (1) : BLE_UL_PACKED_xxx, saying which of the optional parts are present
+//  - number of records n (1)
+//  - major LSB (1), if BLE_UL_PACKED_MAJOR : all the records have this major LSB, and their ids are just the minor
+//  - n ids (major LSB<<16 | minor, or minor) in increasing order : the first as a varint (LEB128), then each as a varint of the
+//    difference from the previous one
+//  - if BLE_UL_PACKED_RSSI : n rssis as 4 bits, 2 per byte (first in the low nibble). rssi = BLE_UL_RSSI_Q_MIN + q*BLE_UL_RSSI_Q_STEP
+//  - if BLE_UL_PACKED_EXTRA : n extra bytes
+//  - if BLE_UL_PACKED_SEEN : n bytes of minutes since first seen (max 255)
+// As tags are allocated in blocks of minors, most ids only take 1 byte.
+#define BLE_UL_PACKED_MAJOR (0x01)
+#define BLE_UL_PACKED_RSSI (0x02)
+#define BLE_UL_PACKED_EXTRA (0x04)
+#define BLE_UL_PACKED_SEEN (0x08)
+#define BLE_UL_PACKED_HDR_SZ (3)
+#define BLE_UL_RSSI_Q_MIN (-105)
+#define BLE_UL_RSSI_Q_STEP (4)
+
+// Flags to send these entries with the wanted fields : adds BLE_UL_PACKED_MAJOR if they all have the same major LSB, and drops
+// BLE_UL_PACKED_EXTRA if all their extras are 0
+uint8_t BLEUL_packedFlags(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t fields);
+/*
+ * Pack as many of the entries as fit in maxSz bytes into buf, as a packed list value. The refs must be sorted by id
+ * (BLETable_sortRefsById()).
+ * <returns>Returns the number of entries packed (from the start of refs), and the value size in *sz</returns>
+ */
+int BLEUL_pack(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t flags, uint8_t* buf, int maxSz, uint8_t* sz);
+
+// Packed presence (APP_CORE_UL_BLE_PRESENCE_PACKED TLV) : major LSB (1), minor MSB (1), then a format byte and the present minor LSBs
+// in that format, whichever is smallest :
+//  - BITMAP : bit n (of byte n/8, b0 first) set if minor LSB n present, up to the byte with the highest one present
+//  - LIST : the minor LSBs present, 1 byte each, in increasing order
+//  - RUNS : for each run of consecutive minor LSBs present, the first and the last one of the run (1 byte each), in increasing order
+#define BLE_UL_PRESENCE_BITMAP (0)
+#define BLE_UL_PRESENCE_LIST (1)
+#define BLE_UL_PRESENCE_RUNS (2)
+// Max size of the format byte and data
+#define BLE_UL_PRESENCE_MAX_SZ (1+32)
+/*
+ * Encode the presence bits (32 bytes, bit n set for minor LSB n, highest set being maxId) into buf (BLE_UL_PRESENCE_MAX_SZ bytes)
+ * as the format byte and data, in the smallest format.
+ * <returns>Returns the size written</returns>
+ */
+uint8_t BLEUL_packPresence(const uint8_t* bits, int maxId, uint8_t* buf);
+
+// Add a TLV, in the next UL message if it doesn't fit in this one. Returns false if it can't go in either, setting the reason
+// (EM_UL_NONEXTUL or EM_UL_NOSPACE) in *errorMask
+bool BLEUL_addTLV(APP_CORE_UL_t* ul, uint8_t tag, uint8_t sz, uint8_t* v, uint8_t* errorMask);
+/*
+ * Add the referenced entries to the UL as packed list TLVs (see above), over as many UL messages as needed. They are sorted by id
+ * (so the refs are reordered), and the ones added are the first ones. What doesn't fit sets the reason in *errorMask.
+ * <returns>Returns how many were added</returns>
+ */
+int BLEUL_addPacked(APP_CORE_UL_t* ul, uint8_t tag, BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t fields, uint8_t* errorMask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_UL_H */
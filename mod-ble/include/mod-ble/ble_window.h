@@ -0,0 +1,65 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#ifndef H_BLE_WINDOW_H
+#define H_BLE_WINDOW_H
+
+#include <inttypes.h>
+#include "os/os.h"
+#include "mod-ble/ble_sketch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sliding window counts of the countable beacon types : the number of distinct beacons of each type seen in the last windowS
+// seconds, whatever the exit timeout and cycle time, and without them taking space in a tracking table. The window is a ring of
+// time buckets per type, each a distinct count sketch (see ble_sketch.h) of the beacons seen in its time : the count is the estimate
+// of all the buckets merged, so a beacon seen in several buckets is only counted once, and drops out when the last bucket it was
+// seen in leaves the window. Each type takes BLE_WINDOW_BUCKETS x 65 bytes.
+#define BLE_WINDOW_BUCKETS (MYNEWT_VAL(MOD_BLE_COUNT_WINDOW_BUCKETS))
+typedef struct {
+    uint8_t type;                               // countable type (major MSB), 0=free
+    BLE_SKETCH_t buckets[BLE_WINDOW_BUCKETS];   // beacons seen in each bucket's time
+    uint16_t peak;                              // max of the window count since the last stats reset
+    uint32_t total;                             // sum of the window count samples since the last stats reset
+} BLE_WINDOW_TYPE_t;
+
+typedef struct {
+    BLE_WINDOW_TYPE_t* types;
+    uint8_t nbTypes;
+    uint32_t bucketS;
+    uint32_t bucketStart;       // time the current bucket started (secs since boot)
+    uint8_t cur;                // current bucket
+    uint16_t nbSamples;         // window count samples (one per bucket end) since the last stats reset
+} BLE_WINDOW_t;
+
+// Init (or re-init if the window length changed, which clears the counts) with the type slots
+void BLEWindow_init(BLE_WINDOW_t* w, BLE_WINDOW_TYPE_t* types, int nbTypes, uint32_t windowS, uint32_t now);
+// A beacon was seen : add it to the current bucket of its type (major MSB), taking a free slot for the type if it has none.
+// Returns false if there was no slot for it. isNew (if not NULL) is set if it is new to the current bucket (see BLESketch_addTo())
+bool BLEWindow_seen(BLE_WINDOW_t* w, uint16_t major, uint16_t minor, uint32_t now, bool* isNew);
+// Move the window on to now, sampling the count at each bucket end (for the peak and mean)
+void BLEWindow_advance(BLE_WINDOW_t* w, uint32_t now);
+// Distinct beacons seen in the window for a type slot, and the peak and mean of that since the last stats reset
+uint16_t BLEWindow_count(BLE_WINDOW_t* w, int slot);
+uint16_t BLEWindow_peak(BLE_WINDOW_t* w, int slot);
+uint16_t BLEWindow_mean(BLE_WINDOW_t* w, int slot);
+// Restart the peak/mean (eg once sent in the UL), freeing the slots of the types with nothing left in the window
+void BLEWindow_resetStats(BLE_WINDOW_t* w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_WINDOW_H */
@@ -0,0 +1,89 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// Shared beacon arena for the BLE scanning modules
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+
+#include "app-core/app_core.h"
+#include "mod-ble/ble_arena.h"
+
+// partitions are kept 4 byte aligned so they can hold any of the beacon record types
+#define ARENA_ALIGN(sz) (((sz)+3) & ~3u)
+#define ARENA_SZ (ARENA_ALIGN(MYNEWT_VAL(MOD_BLE_ARENA_SZ)))
+#define NO_HOLDER (-1)
+
+static struct {
+    uint32_t mem[ARENA_SZ/4];
+    uint32_t persistentSz;      // taken from the top
+    uint32_t sharedNeed;        // largest shared size reserved
+    int holder;                 // module id holding the shared partition, or NO_HOLDER
+} _ctx = {
+    .holder = NO_HOLDER,
+};
+
+void* BLEArena_leasePersistent(APP_MOD_ID_t mid, uint32_t sz) {
+    // the shared partition shrinks, so can't be done while its in use
+    assert(_ctx.holder==NO_HOLDER);
+    sz = ARENA_ALIGN(sz);
+    if ((_ctx.persistentSz + sz + _ctx.sharedNeed) > ARENA_SZ) {
+        log_error("BA:mod %d needs %d bytes, only %d left (%d kept shared) : MOD_BLE_ARENA_SZ must be at least %d", mid, sz,
+            (ARENA_SZ - _ctx.persistentSz - _ctx.sharedNeed), _ctx.sharedNeed, (_ctx.persistentSz + sz + _ctx.sharedNeed));
+        return NULL;
+    }
+    _ctx.persistentSz += sz;
+    log_info("BA:mod %d persistent %d bytes, %d left shared", mid, sz, BLEArena_sharedSz());
+    return ((uint8_t*)_ctx.mem) + (ARENA_SZ - _ctx.persistentSz);
+}
+
+bool BLEArena_reserveShared(APP_MOD_ID_t mid, uint32_t sz) {
+    if (sz > BLEArena_sharedSz()) {
+        log_error("BA:mod %d needs %d bytes shared, only %d : MOD_BLE_ARENA_SZ must be at least %d", mid, sz, BLEArena_sharedSz(),
+            (_ctx.persistentSz + sz));
+        return false;
+    }
+    if (sz > _ctx.sharedNeed) {
+        _ctx.sharedNeed = sz;
+    }
+    return true;
+}
+
+void* BLEArena_lease(APP_MOD_ID_t mid, uint32_t minSz, uint32_t* sz) {
+    if (_ctx.holder!=NO_HOLDER && _ctx.holder!=mid) {
+        log_error("BA:mod %d lease but mod %d holds it", mid, _ctx.holder);
+        return NULL;
+    }
+    if (BLEArena_sharedSz() < minSz) {
+        log_error("BA:mod %d needs %d bytes, shared only %d : increase MOD_BLE_ARENA_SZ", mid, minSz, BLEArena_sharedSz());
+        return NULL;
+    }
+    _ctx.holder = mid;
+    *sz = BLEArena_sharedSz();
+    memset(_ctx.mem, 0, *sz);
+    return &_ctx.mem[0];
+}
+
+void BLEArena_release(APP_MOD_ID_t mid) {
+    if (_ctx.holder==mid) {
+        _ctx.holder = NO_HOLDER;
+    }
+}
+
+uint32_t BLEArena_sharedSz() {
+    return ARENA_SZ - _ctx.persistentSz;
+}
+
+bool BLEArena_isLeased() {
+    return (_ctx.holder!=NO_HOLDER);
+}
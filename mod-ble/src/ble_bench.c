@@ -0,0 +1,417 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// BLE getData() benchmark : synthetic beacon populations to see how processing scales with the table size
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/timemgr.h"
+#include "wyres-generic/wblemgr.h"
+#include "wyres-generic/wconsole.h"
+#include "wyres-generic/configmgr.h"
+
+#include "app-core/app_core.h"
+#include "app-core/app_msg.h"
+#include "app-core/app_console.h"
+#include "app-core/app_airtime.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_arena.h"
+#include "mod-ble/ble_scan.h"
+#include "mod-ble/ble_trace.h"
+#include "mod-ble/ble_bench.h"
+
+#if MYNEWT_VAL(MOD_BLE_BENCH)
+// Population type mixes : percentage of enter/exit and presence types (rest are countables), and churn ie percentage of
+// enter/exit ones not yet notified (enters) and of all types not seen for a long time (exits/timeouts)
+typedef struct {
+    const char* name;
+    uint8_t pcEnterExit;
+    uint8_t pcPresence;
+    uint8_t pcNew;
+    uint8_t pcGone;
+} BENCH_MIX_t;
+static const BENCH_MIX_t MIXES[] = {
+    { .name="mixed", .pcEnterExit=40, .pcPresence=10, .pcNew=20, .pcGone=10 },
+    { .name="count", .pcEnterExit=0, .pcPresence=0, .pcNew=0, .pcGone=10 },
+    { .name="enter", .pcEnterExit=100, .pcPresence=0, .pcNew=50, .pcGone=25 },
+};
+#define NB_MIXES (sizeof(MIXES)/sizeof(MIXES[0]))
+// Number of distinct countable types used
+#define BENCH_NB_COUNTABLES (16)
+
+// simple xorshift so that a scenario is the same every run
+static uint32_t nextRand(uint32_t* s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *s = x;
+    return x;
+}
+
+int BLEBench_fillTable(BLE_TABLE_t* tbl, int nb, int mixId, uint32_t seed) {
+    if (mixId<0 || mixId>=NB_MIXES) {
+        mixId = 0;
+    }
+    const BENCH_MIX_t* mix = &MIXES[mixId];
+    uint32_t rs = (seed!=0 ? seed : 1);     // xorshift must not start at 0
+    uint32_t now = TMMgr_getRelTimeSecs();
+    if (now==0) {
+        now = 1;        // 0 means 'empty entry'
+    }
+    if (nb>BLETable_capacity(tbl)) {
+        nb = BLETable_capacity(tbl);
+    }
+    BLETable_clear(tbl);
+    for(int i=0;i<nb;i++) {
+        ibeacon_data_t ib;
+        memset(&ib, 0, sizeof(ib));
+        bool isNew = false;
+        uint32_t r = nextRand(&rs) % 100;
+        if (r<mix->pcEnterExit) {
+            ib.major = (BLE_TYPE_ENTEREXIT<<8) + (i & 0xFF);
+            isNew = ((nextRand(&rs) % 100) < mix->pcNew);
+        } else if (r<(mix->pcEnterExit+mix->pcPresence)) {
+            // presence for minor MSB 0 (default config), minor LSB is the bit position
+            ib.major = (BLE_TYPE_PRESENCE<<8);
+        } else {
+            ib.major = ((BLE_TYPE_COUNTABLE_START + (nextRand(&rs) % BENCH_NB_COUNTABLES))<<8);
+        }
+        // minors are unique so no 2 entries are the same beacon (except presence ones beyond 256, which just update)
+        ib.minor = (ib.major>>8)==BLE_TYPE_PRESENCE ? (i & 0xFF) : i;
+        ib.rssi = -40 - (nextRand(&rs) % 60);
+        // 'gone' ones were last seen at the start of time, which is beyond the exit timeout once the device has been up long enough
+        ib.lastSeenAt = ((nextRand(&rs) % 100) < mix->pcGone) ? 1 : now;
+        BLE_TABLE_ENTRY_t* e = BLETable_addOrUpdate(tbl, &ib, now);
+        if (e!=NULL) {
+            e->new = isNew;
+            BLETable_setSeenAt(tbl, e, 1, ib.lastSeenAt);
+        }
+    }
+    return BLETable_nbActive(tbl);
+}
+
+const char* BLEBench_mixName(int mixId) {
+    return (mixId>=0 && mixId<NB_MIXES) ? MIXES[mixId].name : NULL;
+}
+
+#define MAX_BENCH_MODS (4)
+static const int BENCH_SIZES[] = { 10, 50, 100, 250, 500, 1000 };
+#define NB_BENCH_SIZES (sizeof(BENCH_SIZES)/sizeof(BENCH_SIZES[0]))
+// Table size for the scan-tag workload in AT+BENCH
+#define BENCH_CORE_NB (100)
+// Size of the scratch table the modules work on while benched
+#define BENCH_NB (MYNEWT_VAL(MOD_BLE_BENCH_NB))
+#define BENCH_SLOTS (BLE_TABLE_SLOTS(BENCH_NB))
+
+static struct {
+    struct {
+        APP_MOD_ID_t mid;
+        BLE_TABLE_t* tbl;
+        APP_MOD_GETULDATA_FN_t getData;
+    } mods[MAX_BENCH_MODS];
+    uint8_t nbMods;
+    int8_t scanTagIdx;      // which of the mods is scan-tag for AT+BENCH (-1 if not registered)
+    bool running;
+    BLE_TABLE_t saved;      // the module's own table while the scratch one is in
+    BLE_TABLE_ENTRY_t slots[BENCH_SLOTS];
+    int8_t replayIdx;       // which of the mods the trace snapshot being loaded is for (-1 if none)
+    BLE_TABLE_t replay;     // the snapshot being loaded (in the scratch slots)
+    APP_CORE_UL_t ul;       // not on the stack please
+} _ctx;
+
+// Can only bench between cycles : not while one of the BLE modules is running (it holds the shared arena partition from its start
+// to its stop, and may be using its table), nor while a scan feeds their tables (the scratch table would get the adverts), and only
+// when the modules would do something in their getData(). Returns why not, or NULL if ok
+static const char* whyNot() {
+    if (!AppCore_isDeviceActive()) {
+        return "device not active";
+    }
+    if (BLEArena_isLeased()) {
+        return "module running";
+    }
+    for(int m=0;m<_ctx.nbMods;m++) {
+        if (BLEScan_isFeeding(_ctx.mods[m].mid)) {
+            return "scan running";
+        }
+    }
+    return NULL;
+}
+// Swap the scratch slots in under a module's table (keeping its settings), and back out
+static void useScratch(BLE_TABLE_t* tbl) {
+    // any snapshot being loaded is lost
+    _ctx.replayIdx = -1;
+    _ctx.saved = *tbl;
+    tbl->slots = &_ctx.slots[0];
+    tbl->capacity = (_ctx.saved.capacity < BENCH_NB) ? _ctx.saved.capacity : BENCH_NB;
+    tbl->nbSlots = BLE_TABLE_SLOTS(tbl->capacity);
+    BLETable_clear(tbl);
+    _ctx.running = true;
+}
+static void useOwn(BLE_TABLE_t* tbl) {
+    _ctx.running = false;
+    *tbl = _ctx.saved;
+}
+
+bool BLEBench_isRunning() {
+    return _ctx.running;
+}
+
+// Total bytes in the UL set (including headers)
+static int ulBytes(APP_CORE_UL_t* ul) {
+    int sz = 0;
+    for(int i=0;i<=ul->msgNbFilling && i<APP_CORE_UL_MAX_NB;i++) {
+        sz += ul->msgs[i].sz;
+    }
+    return sz;
+}
+
+static int findMod(APP_MOD_ID_t mid) {
+    for(int m=0;m<_ctx.nbMods;m++) {
+        if (_ctx.mods[m].mid==mid) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+bool BLEBench_run(APP_MOD_ID_t mid, int nb, int mixId, BLE_BENCH_RESULT_t* res) {
+    int m = findMod(mid);
+    if (m<0 || mixId<0 || mixId>=NB_MIXES || whyNot()!=NULL) {
+        return false;
+    }
+    useScratch(_ctx.mods[m].tbl);
+    res->nb = BLEBench_fillTable(_ctx.mods[m].tbl, nb, mixId, 0x57A7 + nb);
+    app_core_msg_ul_init(&_ctx.ul);
+    uint32_t start = os_cputime_get32();
+    (*_ctx.mods[m].getData)(&_ctx.ul);
+    res->elapsedUS = os_cputime_ticks_to_usecs(os_cputime_get32() - start);
+    res->ul = &_ctx.ul;
+    useOwn(_ctx.mods[m].tbl);
+    return true;
+}
+
+// Run a scenario and print its result, or that the table is too small if it must be exactly nb beacons
+static void runScenario(PRINTLN_t pfn, int modIdx, int mixId, int nb, bool exact) {
+    const char* name = AppCore_getModuleName(_ctx.mods[modIdx].mid);
+    BLE_BENCH_RESULT_t res;
+    if (!BLEBench_run(_ctx.mods[modIdx].mid, nb, mixId, &res)) {
+        (*pfn)("%s %s n=%d : can't bench now", name, MIXES[mixId].name, nb);
+        return;
+    }
+    if (exact && res.nb<nb) {
+        (*pfn)("%s %s n=%d : > table size %d (MOD_BLE_MAXIBS_TAG_INZONE, MOD_BLE_BENCH_NB)", name, MIXES[mixId].name, nb, res.nb);
+        return;
+    }
+    // airtime at the currently configured SF, so the output can be diffed between firmware versions
+    uint8_t sf = MYNEWT_VAL(LORA_DEFAULT_SF);
+    CFMgr_getElement(CFG_UTIL_KEY_LORA_SF, &sf, 1);
+    (*pfn)("%s %s n=%d : %d us, UL %d bytes in %d msgs, airtime %d ms at SF%d", name, MIXES[mixId].name,
+        res.nb, res.elapsedUS, ulBytes(res.ul), res.ul->msgNbFilling+1, app_core_airtime_ulset_ms(res.ul, sf), sf);
+}
+
+// AT+BLEBENCH [nb beacons] : run all the scenarios (or just the given size) against each registered module.
+static ATRESULT atcmd_blebench(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    int reqNb = -1;
+    if (nargs>1) {
+        if (sscanf(argv[1], "%d", &reqNb)<1 || reqNb<=0) {
+            (*pfn)("AT+BLEBENCH [nb beacons]");
+            return ATCMD_BADARG;
+        }
+    }
+    if (_ctx.nbMods==0) {
+        (*pfn)("No BLE modules registered for bench");
+        return ATCMD_GENERR;
+    }
+    const char* why = whyNot();
+    if (why!=NULL) {
+        (*pfn)("Can't bench now : %s", why);
+        return ATCMD_GENERR;
+    }
+    for(int m=0;m<_ctx.nbMods;m++) {
+        for(int mix=0;mix<NB_MIXES;mix++) {
+            if (reqNb>0) {
+                runScenario(pfn, m, mix, reqNb, false);
+            } else {
+                for(int s=0;s<NB_BENCH_SIZES;s++) {
+                    runScenario(pfn, m, mix, BENCH_SIZES[s], true);
+                }
+            }
+        }
+    }
+    return ATCMD_OK;
+}
+// AT+BENCH workload : scan-tag classification of a 100 beacon mixed table. Only the getData() is timed, not the table refill.
+static uint32_t benchScanTag(uint32_t nb) {
+    uint32_t ticks = 0;
+    int m = _ctx.scanTagIdx;
+    const char* why = whyNot();
+    if (why!=NULL) {
+        log_warn("MBB:can't bench now : %s", why);
+        return 0;
+    }
+    useScratch(_ctx.mods[m].tbl);
+    for(int i=0;i<nb;i++) {
+        BLEBench_fillTable(_ctx.mods[m].tbl, BENCH_CORE_NB, 0, 0x57A7);
+        app_core_msg_ul_init(&_ctx.ul);
+        uint32_t start = os_cputime_get32();
+        (*_ctx.mods[m].getData)(&_ctx.ul);
+        ticks += (os_cputime_get32() - start);
+    }
+    useOwn(_ctx.mods[m].tbl);
+    return ticks;
+}
+
+// 0 means 'empty entry', so the replay can't be at the start of time
+static uint32_t replayNow() {
+    uint32_t now = TMMgr_getRelTimeSecs();
+    return (now==0 ? 1 : now);
+}
+
+bool BLEBench_replayStart(APP_MOD_ID_t mid, int32_t markAgeS) {
+    int m = findMod(mid);
+    if (m<0 || whyNot()!=NULL) {
+        return false;
+    }
+    // same size as the module's table (if the scratch one is big enough), so it fills up the same
+    uint16_t capacity = _ctx.mods[m].tbl->capacity;
+    BLETable_init(&_ctx.replay, &_ctx.slots[0], (capacity < BENCH_NB) ? capacity : BENCH_NB);
+    BLETable_setEvictPolicy(&_ctx.replay, _ctx.mods[m].tbl->evictPolicy);
+    BLETrace_loadMark(&_ctx.replay, markAgeS, replayNow());
+    _ctx.replayIdx = m;
+    return true;
+}
+
+int BLEBench_replayRecords(const uint8_t* recs, int sz) {
+    if (_ctx.replayIdx<0 || _ctx.replayIdx>=_ctx.nbMods) {
+        return -1;
+    }
+    return BLETrace_loadRecords(&_ctx.replay, recs, sz, replayNow());
+}
+
+APP_CORE_UL_t* BLEBench_replayEnd() {
+    int m = _ctx.replayIdx;
+    if (m<0 || m>=_ctx.nbMods || whyNot()!=NULL) {
+        return NULL;
+    }
+    _ctx.replayIdx = -1;
+    BLE_TABLE_t* tbl = _ctx.mods[m].tbl;
+    _ctx.saved = *tbl;
+    *tbl = _ctx.replay;
+    _ctx.running = true;
+    app_core_msg_ul_init(&_ctx.ul);
+    (*_ctx.mods[m].getData)(&_ctx.ul);
+    useOwn(tbl);
+    return &_ctx.ul;
+}
+
+// Print the UL messages built, in hex
+static void printUL(PRINTLN_t pfn, APP_CORE_UL_t* ul) {
+    char hs[(32*2)+1];
+    for(int i=0;i<=ul->msgNbFilling && i<APP_CORE_UL_MAX_NB;i++) {
+        (*pfn)("UL %d : %d bytes", i, ul->msgs[i].sz);
+        for(int off=0;off<ul->msgs[i].sz;off+=32) {
+            int n = 0;
+            for(;n<32 && (off+n)<ul->msgs[i].sz;n++) {
+                sprintf(&hs[n*2], "%02x", ul->msgs[i].payload[off+n]);
+            }
+            hs[n*2] = '\0';
+            (*pfn)("%s", hs);
+        }
+    }
+}
+// AT+BLEREPLAY S|R|E ... : replay a scan trace snapshot through a module's getData(). Give it the BT:S, BT:R and BT:E lines of a
+// snapshot from the trace log, in order, each prefixed by AT+BLEREPLAY rather than BT: (the seq, time and count args are ignored).
+// The records are loaded into the scratch table, and on the E line it is swapped in under the module's table while its getData()
+// runs, and the UL built is printed in hex.
+static ATRESULT atcmd_blereplay(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    if (nargs<2) {
+        (*pfn)("AT+BLEREPLAY S <module name> <seq> <now> <nb> <mark age> | R [seq] <hex records> | E");
+        return ATCMD_BADARG;
+    }
+    const char* why = whyNot();
+    if (why!=NULL) {
+        (*pfn)("Can't replay now : %s", why);
+        return ATCMD_GENERR;
+    }
+    if (argv[1][0]=='S') {
+        int m = -1;
+        for(int i=0;i<_ctx.nbMods && nargs>2;i++) {
+            if (strcmp(argv[2], AppCore_getModuleName(_ctx.mods[i].mid))==0) {
+                m = i;
+            }
+        }
+        // (traces from before the mark age was logged have no mark)
+        int markAge = -1;
+        if (nargs>6 && sscanf(argv[6], "%d", &markAge)<1) {
+            return ATCMD_BADARG;
+        }
+        if (m<0 || !BLEBench_replayStart(_ctx.mods[m].mid, markAge)) {
+            (*pfn)("No BLE module %s registered for replay", (nargs>2 ? argv[2] : ""));
+            return ATCMD_BADARG;
+        }
+        return ATCMD_OK;
+    }
+    if (_ctx.replayIdx<0) {
+        (*pfn)("No snapshot started (AT+BLEREPLAY S <module name> ...)");
+        return ATCMD_GENERR;
+    }
+    if (argv[1][0]=='R') {
+        uint8_t recs[BLE_TRACE_REC_SZ*4];
+        int sz = (nargs>2 ? Util_scanhex(argv[nargs-1], sizeof(recs), recs) : -1);
+        if (sz<=0 || BLEBench_replayRecords(recs, sz)<0) {
+            (*pfn)("Bad records, must be hex of up to 4 records of %d bytes", BLE_TRACE_REC_SZ);
+            return ATCMD_BADARG;
+        }
+        return ATCMD_OK;
+    }
+    if (argv[1][0]=='E') {
+        APP_MOD_ID_t mid = _ctx.mods[_ctx.replayIdx].mid;
+        (*pfn)("%s : %d beacons", AppCore_getModuleName(mid), BLETable_nbActive(&_ctx.replay));
+        APP_CORE_UL_t* ul = BLEBench_replayEnd();
+        if (ul==NULL) {
+            return ATCMD_GENERR;
+        }
+        printUL(pfn, ul);
+        return ATCMD_OK;
+    }
+    return ATCMD_BADARG;
+}
+static ATCMD_DEF_t BENCH_ATCMD = { .cmd="AT+BLEBENCH", .desc="Benchmark BLE modules processing", atcmd_blebench};
+static ATCMD_DEF_t REPLAY_ATCMD = { .cmd="AT+BLEREPLAY", .desc="Replay BLE scan trace through a module", atcmd_blereplay};
+#endif
+
+void BLEBench_register(APP_MOD_ID_t mid, BLE_TABLE_t* tbl, APP_MOD_GETULDATA_FN_t getData) {
+#if MYNEWT_VAL(MOD_BLE_BENCH)
+    if (_ctx.nbMods>=MAX_BENCH_MODS) {
+        log_warn("MBB:no space to bench mod %d", mid);
+        return;
+    }
+    if (_ctx.nbMods==0) {
+        // first user : add our console commands
+        registerConsoleCmd(&BENCH_ATCMD);
+        registerConsoleCmd(&REPLAY_ATCMD);
+        _ctx.scanTagIdx = -1;
+        _ctx.replayIdx = -1;
+    }
+    if (mid==APP_MOD_BLE_SCAN_TAGS && _ctx.scanTagIdx<0) {
+        _ctx.scanTagIdx = _ctx.nbMods;
+        registerConsoleBench("scan-tag classify 100", &benchScanTag);
+    }
+    _ctx.mods[_ctx.nbMods].mid = mid;
+    _ctx.mods[_ctx.nbMods].tbl = tbl;
+    _ctx.mods[_ctx.nbMods].getData = getData;
+    _ctx.nbMods++;
+#endif
+}
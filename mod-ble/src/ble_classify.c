@@ -0,0 +1,196 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+
+// Classification of the tag tracking tables (scan-tag, scanA-tag)
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_classify.h"
+
+static bool isGone(BLE_CLASSIFY_t* c, BLE_TABLE_ENTRY_t* ib, uint32_t now) {
+    return BLETable_isGone(c->tbl, ib, now, c->exitTimeoutMins*60, c->exitMissedScans);
+}
+// Has an entered enter/exit type gone? (not seen for the timeout, or too weak)
+static bool isExit(BLE_CLASSIFY_t* c, BLE_TABLE_ENTRY_t* ib, uint32_t now) {
+    return (isGone(c, ib, now) || ib->rssi<c->exitRSSI);
+}
+// Presence type : set his bit
+static void setPresent(BLE_CLASSIFY_t* c, BLE_TABLE_ENTRY_t* ib) {
+    uint8_t minorId = (ib->minor & 0xff);     // bit position
+    if (minorId > c->maxMinorIdPresence) {
+        c->maxMinorIdPresence = minorId;
+    }
+    c->presenceBits[minorId/8] |= (1<<(minorId%8));
+    if (c->majorPresence!=ib->major) {
+        c->majorPresence = ib->major;
+        // Should only happen when set first time...
+        log_debug("MB:presence major=%d", c->majorPresence);
+    }
+}
+// Countable type : inc its counter
+static void countType(BLE_CLASSIFY_t* c, uint8_t bletype) {
+    int idx = (bletype - BLE_TYPE_COUNTABLE_START);
+    if (idx>=0 && idx<BLE_NTYPES) {
+        // dont wrap the counter. 255==too many to count...
+        if (c->tcount[idx]<255) {
+            c->tcount[idx]++;
+        }
+        c->nbCount++;
+    } // else should not happen
+}
+static void resetCounts(BLE_CLASSIFY_t* c) {
+    c->nbCount = 0;
+    // Presence guys : this is a single TLV (we only track 1 minor block per device)
+    c->maxMinorIdPresence = -1;
+    c->majorPresence = 0;
+    memset(&c->tcount[0], 0, sizeof(c->tcount));
+    memset(&c->presenceBits[0], 0, sizeof(c->presenceBits));
+}
+
+uint8_t BLEClassify_table(BLE_CLASSIFY_t* c, uint32_t now) {
+    uint8_t errorMask = 0;
+    c->nbEnter = 0;
+    c->nbExit = 0;
+    resetCounts(c);
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* ib;
+    BLETable_iterStart(c->tbl, &it);
+    while((ib=BLETable_iterNext(c->tbl, &it))!=NULL) {
+        uint8_t bletype = (ib->major & 0xff00) >> 8;
+        if (bletype==BLE_TYPE_NAV) {
+            // ignore, shouldn't happen as the scanner was told to ignore these guys
+            log_warn("MB:remove unex NAV type");
+            errorMask |= EM_BLE_RX_BADMAJ;
+            // Free up his space
+            BLETable_iterRemove(c->tbl, &it);
+        } else if (bletype==BLE_TYPE_PROXIMITY) {
+            // in the scanned range, but not sent. Free up the space
+            BLETable_iterRemove(c->tbl, &it);
+        } else if (bletype==BLE_TYPE_ENTEREXIT) {
+            // exit/enter type : if new, we want to put in enter list in the outgoing message (if strong enough by then)
+            if (ib->new) {
+                if (ib->rssi<c->enterRSSI && isGone(c, ib, now)) {
+                    // never got strong enough to enter, and now gone : no exit to send either
+                    BLETable_iterRemove(c->tbl, &it);
+                } else {
+                    BLETable_iterRef(c->tbl, &it, now, &BLE_CLASSIFY_ENTER_REF(c, c->nbEnter));
+                    c->nbEnter++;
+                }
+            } else {
+                //  if not seen for last X minutes (or now too weak), we want to put in the exit list
+                if (isExit(c, ib, now)) {
+                    BLETable_iterRef(c->tbl, &it, now, &BLE_CLASSIFY_EXIT_REF(c, c->nbExit));
+                    c->nbExit++;       // gonna need to flag up as exit
+                }
+                // Note for enter/exits we only remove them when we have managed to send their id in the UL
+            }
+        } else if (bletype==BLE_TYPE_PRESENCE) {
+            // Presence type: we only indicate each time if we see or not the minor set we are looking for
+            if (((ib->minor & 0xff00) >> 8) == c->presenceMinorMSB) {
+                // is he timed out (exited)? (using same timeout as enter/exit case)
+                if (isGone(c, ib, now)) {
+                    // Yes, he's not present (and we'll remove him)
+                    BLETable_iterRemove(c->tbl, &it);
+                } else {
+                    // He's present
+                    setPresent(c, ib);
+                }
+            } else  {
+                // we don't care about ones with a minor that we're not looking for - remove from our list to avoid blocking a slot
+                log_debug("MB:remove uncon pres minor=%d", ib->minor);
+                BLETable_iterRemove(c->tbl, &it);
+            }
+        } else if (bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END) {
+            // Ensure remove from our list if timed out
+            if (isGone(c, ib, now)) {
+                // Yes, he's gone so we'll remove him
+                BLETable_iterRemove(c->tbl, &it);
+            } else {
+                // countable type : inc its counter
+                countType(c, bletype);
+            }
+        } else {
+            // ignore, shouldn't happen as the scanner was told to ignore these guys
+            log_warn("MB:remove unex type=%d", bletype);
+            errorMask |= EM_BLE_RX_BADMAJ;
+            // Free up the space
+            BLETable_iterRemove(c->tbl, &it);
+        }
+    }
+    return errorMask;
+}
+
+void BLEClassify_settle(BLE_CLASSIFY_t* c, uint32_t now) {
+    c->nbExit = 0;
+    resetCounts(c);
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* ib;
+    BLETable_iterStart(c->tbl, &it);
+    while((ib=BLETable_iterNext(c->tbl, &it))!=NULL) {
+        uint8_t bletype = (ib->major & 0xff00) >> 8;
+        if (bletype==BLE_TYPE_ENTEREXIT) {
+            if (!ib->new && isExit(c, ib, now)) {
+                BLETable_iterRef(c->tbl, &it, now, &BLE_CLASSIFY_EXIT_REF(c, c->nbExit));
+                c->nbExit++;
+            }
+        } else if (isGone(c, ib, now)) {
+            continue;
+        } else if (bletype==BLE_TYPE_PRESENCE) {
+            // (the ones with other minors were removed by the classification, and aren't added since)
+            setPresent(c, ib);
+        } else if (bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END) {
+            countType(c, bletype);
+        }
+    }
+}
+
+BLE_CLASSIFY_ADVERT_t BLEClassify_advert(BLE_CLASSIFY_t* c, ibeacon_data_t* ib) {
+    uint8_t bletype = (ib->major & 0xff00) >> 8;
+    if (bletype==BLE_TYPE_PROXIMITY) {
+        // in the scanned range but not sent, so don't let them take a slot
+        return BLE_CLASSIFY_DROP;
+    }
+    if (!(bletype==BLE_TYPE_ENTEREXIT || bletype==BLE_TYPE_PRESENCE ||
+            (bletype>=BLE_TYPE_COUNTABLE_START && bletype<=BLE_TYPE_COUNTABLE_END))) {
+        // shouldn't happen as the scanner was told to ignore these guys
+        log_warn("MB:drop unex type=%d", bletype);
+        return BLE_CLASSIFY_UNEXPECTED;
+    }
+    if (bletype==BLE_TYPE_PRESENCE && ((ib->minor & 0xff00) >> 8) != c->presenceMinorMSB) {
+        // we don't care about ones with a minor that we're not looking for - don't let them take a slot
+        return BLE_CLASSIFY_DROP;
+    }
+    return BLE_CLASSIFY_TRACK;
+}
+
+void BLEClassify_added(BLE_CLASSIFY_t* c, BLE_TABLE_ENTRY_t* e, uint32_t now) {
+    if (((e->major & 0xff00) >> 8)==BLE_TYPE_ENTEREXIT) {
+        BLETable_entryRef(c->tbl, e, now, &BLE_CLASSIFY_ENTER_REF(c, c->nbEnter));
+        c->nbEnter++;
+    }
+}
+
+int BLEClassify_entersToSend(BLE_CLASSIFY_t* c) {
+    int nbEnter = 0;
+    for(int i=0;i<c->nbEnter;i++) {
+        if (BLETable_refEntry(c->tbl, &BLE_CLASSIFY_ENTER_REF(c, i))->rssi>=c->enterRSSI) {
+            BLE_CLASSIFY_ENTER_REF(c, nbEnter) = BLE_CLASSIFY_ENTER_REF(c, i);
+            nbEnter++;
+        }
+    }
+    return nbEnter;
+}
@@ -0,0 +1,239 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// Best nav beacons selection (bounded min-heap) with optional rssi aggregation over the last scans
+#include "os/os.h"
+
+#include "mod-ble/ble_navsel.h"
+
+// Is a weaker than b? Equal rssis : the higher id is the weaker, so the order never depends on the offer order
+static bool weaker(BLE_NAVSEL_ENTRY_t* a, BLE_NAVSEL_ENTRY_t* b) {
+    if (a->rssi!=b->rssi) {
+        return (a->rssi < b->rssi);
+    }
+    return ((((uint32_t)a->major)<<16) | a->minor) > ((((uint32_t)b->major)<<16) | b->minor);
+}
+static void swap(BLE_NAVSEL_ENTRY_t* h, int i, int j) {
+    BLE_NAVSEL_ENTRY_t e = h[i];
+    h[i] = h[j];
+    h[j] = e;
+}
+// Restore the heap order (weakest at the top) for entry i, moving it up or down (in the first n entries)
+static void siftUp(BLE_NAVSEL_ENTRY_t* h, int i) {
+    while(i>0 && weaker(&h[i], &h[(i-1)/2])) {
+        swap(h, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+static void siftDown(BLE_NAVSEL_ENTRY_t* h, int n, int i) {
+    while(true) {
+        int w = i;
+        int l = (2*i)+1;
+        if (l<n && weaker(&h[l], &h[w])) {
+            w = l;
+        }
+        if ((l+1)<n && weaker(&h[l+1], &h[w])) {
+            w = l+1;
+        }
+        if (w==i) {
+            return;
+        }
+        swap(h, i, w);
+        i = w;
+    }
+}
+// Heap sort in place : the weakest goes to the end each time, leaving them strongest first
+static void sortHeap(BLE_NAVSEL_ENTRY_t* h, int n) {
+    for(n--;n>0;n--) {
+        swap(h, 0, n);
+        siftDown(h, n, 0);
+    }
+}
+
+// Keep the beacon if it is one of the k best so far (at its strongest if already kept)
+static void keep(BLE_NAVSEL_t* s, BLE_NAVSEL_ENTRY_t* e) {
+    if (s->nb==s->k && !weaker(&s->heap[0], e)) {
+        // not better than the weakest kept : so not kept, or kept already at least as strong
+        return;
+    }
+    for(int i=0;i<s->nb;i++) {
+        if (s->heap[i].major==e->major && s->heap[i].minor==e->minor) {
+            if (!weaker(&s->heap[i], e)) {
+                return;
+            }
+            // stronger than it was, so can only need to go down
+            s->heap[i] = *e;
+            siftDown(s->heap, s->nb, i);
+            return;
+        }
+    }
+    if (s->nb<s->k) {
+        s->heap[s->nb] = *e;
+        siftUp(s->heap, s->nb);
+        s->nb++;
+    } else {
+        s->heap[0] = *e;
+        siftDown(s->heap, s->nb, 0);
+    }
+}
+
+// Aggregate of the rssi over the scans it was seen in (BLE_NAVSEL_NOT_SEEN if none)
+static int8_t aggregate(BLE_NAVSEL_t* s, BLE_NAVSEL_HIST_t* h) {
+    int8_t v[BLE_NAVSEL_MAX_SCANS];
+    int n = 0;
+    for(int i=0;i<s->nbScans;i++) {
+        if (h->rssi[i]==BLE_NAVSEL_NOT_SEEN) {
+            continue;
+        }
+        // insertion sort as we go : at most BLE_NAVSEL_MAX_SCANS values
+        int j = n++;
+        while(j>0 && v[j-1]>h->rssi[i]) {
+            v[j] = v[j-1];
+            j--;
+        }
+        v[j] = h->rssi[i];
+    }
+    if (n==0) {
+        return BLE_NAVSEL_NOT_SEEN;
+    }
+    if (s->agg==BLE_NAVSEL_AGG_MAX) {
+        return v[n-1];
+    }
+    // median (mean of the middle 2 for an even number, rounded down)
+    int m = ((int)v[(n-1)/2] + (int)v[n/2]);
+    return (m - (m<0 ? 1 : 0)) / 2;
+}
+
+static BLE_NAVSEL_HIST_t* findHist(BLE_NAVSEL_t* s, uint16_t major, uint16_t minor) {
+    for(int i=0;i<s->nbHist;i++) {
+        if (s->hist[i].major==major && s->hist[i].minor==minor) {
+            return &s->hist[i];
+        }
+    }
+    return NULL;
+}
+// Get a history entry for a new beacon (with rssi) : a free one, else the weakest aggregate if weaker
+static BLE_NAVSEL_HIST_t* newHist(BLE_NAVSEL_t* s, int8_t rssi) {
+    BLE_NAVSEL_HIST_t* h = NULL;
+    if (s->nbHist<s->histCap) {
+        h = &s->hist[s->nbHist++];
+    } else {
+        int8_t worst = rssi;
+        for(int i=0;i<s->nbHist;i++) {
+            int8_t a = aggregate(s, &s->hist[i]);
+            if (a<worst) {
+                worst = a;
+                h = &s->hist[i];
+            }
+        }
+        if (h==NULL) {
+            return NULL;
+        }
+    }
+    memset(h->rssi, BLE_NAVSEL_NOT_SEEN, sizeof(h->rssi));
+    return h;
+}
+
+void BLENavSel_init(BLE_NAVSEL_t* s, BLE_NAVSEL_ENTRY_t* heap, int k, BLE_NAVSEL_HIST_t* hist, int histCap) {
+    memset(s, 0, sizeof(BLE_NAVSEL_t));
+    s->heap = heap;
+    s->k = k;
+    s->hist = hist;
+    s->histCap = (hist!=NULL ? histCap : 0);
+    s->agg = BLE_NAVSEL_AGG_NONE;
+    s->nbScans = 1;
+}
+
+void BLENavSel_setAggregation(BLE_NAVSEL_t* s, BLE_NAVSEL_AGG_t agg, int nbScans) {
+    if (s->histCap==0) {
+        agg = BLE_NAVSEL_AGG_NONE;
+    }
+    if (nbScans<1) {
+        nbScans = 1;
+    } else if (nbScans>BLE_NAVSEL_MAX_SCANS) {
+        nbScans = BLE_NAVSEL_MAX_SCANS;
+    }
+    if (agg==s->agg && nbScans==s->nbScans) {
+        return;         // keep the history
+    }
+    s->agg = agg;
+    s->nbScans = nbScans;
+    s->cur = 0;
+    s->nbHist = 0;
+}
+
+bool BLENavSel_isAggregating(BLE_NAVSEL_t* s) {
+    return (s->agg!=BLE_NAVSEL_AGG_NONE);
+}
+
+void BLENavSel_offer(BLE_NAVSEL_t* s, uint16_t major, uint16_t minor, int8_t rssi, uint8_t extra) {
+    if (s->ended) {
+        s->nb = 0;
+        s->ended = false;
+    }
+    if (rssi==BLE_NAVSEL_NOT_SEEN) {
+        rssi++;
+    }
+    if (s->agg==BLE_NAVSEL_AGG_NONE) {
+        BLE_NAVSEL_ENTRY_t e = { .major=major, .minor=minor, .rssi=rssi, .extra=extra };
+        keep(s, &e);
+        return;
+    }
+    BLE_NAVSEL_HIST_t* h = findHist(s, major, minor);
+    if (h==NULL) {
+        h = newHist(s, rssi);
+        if (h==NULL) {
+            return;     // weaker than all those we have
+        }
+        h->major = major;
+        h->minor = minor;
+    }
+    h->extra = extra;
+    if (rssi > h->rssi[s->cur]) {
+        h->rssi[s->cur] = rssi;
+    }
+}
+
+int BLENavSel_endScan(BLE_NAVSEL_t* s) {
+    if (s->ended) {
+        s->nb = 0;      // nothing offered since the last one
+    }
+    s->ended = true;
+    if (s->agg==BLE_NAVSEL_AGG_NONE) {
+        sortHeap(s->heap, s->nb);
+        return s->nb;
+    }
+    s->nb = 0;
+    for(int i=0;i<s->nbHist;i++) {
+        BLE_NAVSEL_ENTRY_t e = { .major=s->hist[i].major, .minor=s->hist[i].minor, .rssi=aggregate(s, &s->hist[i]), .extra=s->hist[i].extra };
+        if (e.rssi!=BLE_NAVSEL_NOT_SEEN) {
+            keep(s, &e);
+        }
+    }
+    sortHeap(s->heap, s->nb);
+    // Move the history on : the oldest scan drops out, and so do the beacons only seen in it
+    s->cur = (s->cur+1) % s->nbScans;
+    for(int i=0;i<s->nbHist;) {
+        s->hist[i].rssi[s->cur] = BLE_NAVSEL_NOT_SEEN;
+        if (aggregate(s, &s->hist[i])==BLE_NAVSEL_NOT_SEEN) {
+            s->hist[i] = s->hist[--s->nbHist];
+        } else {
+            i++;
+        }
+    }
+    return s->nb;
+}
+
+BLE_NAVSEL_ENTRY_t* BLENavSel_best(BLE_NAVSEL_t* s) {
+    return s->heap;
+}
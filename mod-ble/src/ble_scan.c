@@ -0,0 +1,476 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// Shared BLE scan engine : one scan session feeding the tables of all the BLE scanning modules
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/configmgr.h"
+#include "wyres-generic/timemgr.h"
+#include "wyres-generic/wblemgr.h"
+
+#include "app-core/app_core.h"
+#include "app-core/app_metrics.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_scan.h"
+
+#define MAX_SUBSCRIBERS (5)
+// A scan is only reused by the other subscribers within this time (as well as before the next UL)
+#define MAX_REUSE_SECS (60)
+#define NO_SCANNER (-1)
+// Don't end a scan early if the module slot ends within this time anyway (the app-core would time it out before our done is seen)
+#define EARLY_END_MARGIN_MS (250)
+// Adaptive scan time : discovery curve (distinct beacons seen vs time into the scan) of the last few scans, sampled at
+// CURVE_BASE_MS, x2, x4... (so up to 32s)
+#define CURVE_BASE_MS (250)
+#define CURVE_PTS (8)
+#define CURVE_HISTORY (4)
+// Every so often scan for the max time anyway, to see if the population has grown
+#define PROBE_EVERY (8)
+
+typedef struct {
+    uint16_t seen[CURVE_PTS];   // distinct beacons seen by CURVE_BASE_MS<<n into the scan (saturates at 0xFFFF)
+    uint8_t nbPts;              // how many points the scan got to
+    uint16_t total;             // seen by the end of the scan
+} SCAN_CURVE_t;
+
+static struct {
+    void* wbleCtx;
+    struct {
+        APP_MOD_ID_t mid;
+        uint16_t majorStart;
+        uint16_t majorEnd;
+        BLE_TABLE_t* tbl;
+        BLE_SCAN_RX_FN_t rxFn;  // or NULL to just add to tbl
+        bool keepPowered;
+        bool continuous;    // keep scanning into its table between its cycles
+        bool inScan;        // being fed by the current/last scan
+        bool fed;           // fed by a scan started by another subscriber, not yet used
+        uint16_t nbNoted;   // new beacons its advert handler counted outside the table this scan (BLEScan_noteNew()/noteCount())
+        uint32_t countAt;   // the total it last gave BLEScan_noteCount()
+        uint8_t errors;
+    } subs[MAX_SUBSCRIBERS];
+    uint8_t nbSubs;
+    int scanner;            // module id running the scan
+    bool scanning;          // scan request sent and not stopped (may carry on between cycles for a continuous subscriber)
+    uint16_t scanMajorStart;
+    uint16_t scanMajorEnd;
+    // A subscriber is working on its table : adverts wait in the staging list. The rx events come from the wblemgr whenever it
+    // has parsed an advert, not in step with the app-core calling getData(), so this is what keeps them out of the table until
+    // BLEScan_commit() (BLEScan_flush() alone only merges what came before)
+    bool snapshot;
+    uint32_t scanEndS;      // when the last scan ended
+    uint32_t scanULTime;    // AppCore_lastULTime() when it started, to know if still in the same cycle
+    uint32_t scanStartS;    // when the current/last scan started
+    uint32_t prevScanStartS;    // and the one before, to know which tracked beacons we expect to see again
+    // Early end : the scan stops once no new beacon has been added to a table for quietMS (and it has run for at least minMS)
+    struct os_callout quietTimer;
+    uint32_t scanStartMS;
+    uint32_t scanTimeMS;
+    uint32_t lastNewMS;     // when a beacon was last added to one of the tables being fed
+    uint32_t minMS;
+    uint32_t quietMS;       // 0 = never end early
+    bool endedEarly;
+    SCAN_CURVE_t curve;     // of the current scan
+    SCAN_CURVE_t curves[CURVE_HISTORY];
+    uint8_t curveIdx;
+    uint8_t nbCurves;
+    uint8_t nbScans;
+    ibeacon_data_t staging[BLE_TABLE_STAGING_SZ];
+    uint8_t uuid[UUID_SZ];
+    APP_CORE_METRIC_ID_t mCommFail;
+    APP_CORE_METRIC_ID_t mEarlyEnd;
+    APP_CORE_METRIC_ID_t mStagingFull;
+} _ctx = {
+    .scanner = NO_SCANNER,
+};
+
+static int findSub(APP_MOD_ID_t mid) {
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].mid==mid) {
+            return i;
+        }
+    }
+    return -1;
+}
+static void setErrors(uint8_t em) {
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].inScan) {
+            _ctx.subs[i].errors |= em;
+        }
+    }
+}
+// Total adds to the tables being fed (and new ones counted outside them) : if it changes, something new was seen
+static uint16_t nbAdded() {
+    uint16_t nb = 0;
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].inScan) {
+            nb += _ctx.subs[i].tbl->nbAdded + _ctx.subs[i].nbNoted;
+        }
+    }
+    return nb;
+}
+// Distinct beacons seen this scan, over the tables being fed
+static uint16_t nbSeen() {
+    uint32_t nb = 0;
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].inScan) {
+            nb += _ctx.subs[i].tbl->nbSeenSinceMark + _ctx.subs[i].nbNoted;
+        }
+    }
+    return (nb>0xFFFF) ? 0xFFFF : nb;
+}
+// Fill in the curve points up to this time into the scan with the number seen so far
+static void sampleCurve(uint32_t scanMS) {
+    uint16_t seen = nbSeen();
+    while(_ctx.curve.nbPts<CURVE_PTS && (CURVE_BASE_MS<<_ctx.curve.nbPts) <= scanMS) {
+        _ctx.curve.seen[_ctx.curve.nbPts++] = seen;
+    }
+    _ctx.curve.total = seen;
+}
+// Scan time to see targetPct of the beacons around, going by the recent discovery curves
+static uint32_t adaptScanTime(uint8_t targetPct, uint32_t minMS, uint32_t maxMS) {
+    uint32_t scanMS = maxMS;
+    if (_ctx.nbCurves>0 && (_ctx.nbScans % PROBE_EVERY)!=0) {
+        // Population is the most seen by any of them
+        uint16_t pop = 0;
+        uint8_t maxPts = 0;
+        for(int h=0;h<_ctx.nbCurves;h++) {
+            pop = (_ctx.curves[h].total > pop) ? _ctx.curves[h].total : pop;
+            maxPts = (_ctx.curves[h].nbPts > maxPts) ? _ctx.curves[h].nbPts : maxPts;
+        }
+        // If none got to the target, scan for longer than any of them did
+        scanMS = (pop==0) ? minMS : (CURVE_BASE_MS<<maxPts);
+        for(int n=0;n<maxPts && pop>0;n++) {
+            // average seen at this point, over the scans that got to it
+            uint32_t sum = 0;
+            uint32_t nb = 0;
+            for(int h=0;h<_ctx.nbCurves;h++) {
+                if (_ctx.curves[h].nbPts>n) {
+                    sum += _ctx.curves[h].seen[n];
+                    nb++;
+                }
+            }
+            if ((sum*100) >= ((uint32_t)targetPct*pop*nb)) {
+                scanMS = (CURVE_BASE_MS<<n);
+                break;
+            }
+        }
+        log_debug("MBS: %d beacons around, %d%% by %d ms", pop, targetPct, scanMS);
+    }
+    if (scanMS<minMS) {
+        scanMS = minMS;
+    }
+    return (scanMS>maxMS) ? maxMS : scanMS;
+}
+// Move what the wblemgr put in the staging list into the tables that want it
+static void mergeStaging() {
+    if (_ctx.snapshot) {
+        return;     // merged at BLEScan_commit()
+    }
+    uint32_t now = TMMgr_getRelTimeSecs();
+    uint16_t added = nbAdded();
+    if (_ctx.scanner!=NO_SCANNER) {
+        // what was seen before this rx, was seen by now
+        sampleCurve(TMMgr_getRelTimeMS() - _ctx.scanStartMS);
+    }
+    for(int s=0;s<BLE_TABLE_STAGING_SZ;s++) {
+        ibeacon_data_t* ib = &_ctx.staging[s];
+        if (ib->lastSeenAt==0) {
+            continue;
+        }
+        for(int i=0;i<_ctx.nbSubs;i++) {
+            if (_ctx.subs[i].inScan && ib->major>=_ctx.subs[i].majorStart && ib->major<=_ctx.subs[i].majorEnd) {
+                if (_ctx.subs[i].rxFn!=NULL) {
+                    _ctx.subs[i].errors |= (*_ctx.subs[i].rxFn)(ib, now);
+                } else if (BLETable_addOrUpdate(_ctx.subs[i].tbl, ib, now)==NULL) {
+                    _ctx.subs[i].errors |= EM_BLE_TABLE_FULL;
+                }
+            }
+        }
+        ib->lastSeenAt = 0;
+    }
+    if (nbAdded()!=added) {
+        _ctx.lastNewMS = TMMgr_getRelTimeMS();
+    }
+}
+
+// Check if the scan can end : checked once the min time is up, and then whenever the quiet time since the last new beacon would be
+static void armQuietCheck(uint32_t nowMS) {
+    uint32_t at = _ctx.lastNewMS + _ctx.quietMS;
+    if ((_ctx.scanStartMS + _ctx.minMS) > at) {
+        at = _ctx.scanStartMS + _ctx.minMS;
+    }
+    os_callout_reset(&_ctx.quietTimer, os_time_ms_to_ticks32((at > nowMS) ? (at - nowMS) : 1));
+}
+static void quietCheck(struct os_event* ev) {
+    if (_ctx.scanner==NO_SCANNER) {
+        return;
+    }
+    mergeStaging();
+    uint32_t nowMS = TMMgr_getRelTimeMS();
+    uint32_t scanMS = nowMS - _ctx.scanStartMS;
+    if (scanMS < _ctx.minMS || (nowMS - _ctx.lastNewMS) < _ctx.quietMS) {
+        // something new arrived since we were armed
+        armQuietCheck(nowMS);
+        return;
+    }
+    if ((scanMS + EARLY_END_MARGIN_MS) >= _ctx.scanTimeMS) {
+        return;     // not worth it, let the module time out
+    }
+    // Tracked beacons seen last scan but not yet this one : wait another quiet time for them rather than sending a false exit
+    // (the module's scan time still caps the scan)
+    uint32_t now = TMMgr_getRelTimeSecs();
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].inScan && _ctx.prevScanStartS!=0 &&
+                BLETable_nbExpected(_ctx.subs[i].tbl, _ctx.prevScanStartS, _ctx.scanStartS, now)>0) {
+            log_debug("MBS: quiet but mod %d expects more", _ctx.subs[i].mid);
+            _ctx.lastNewMS = nowMS;
+            armQuietCheck(nowMS);
+            return;
+        }
+    }
+    log_info("MBS: nothing new for %d ms, end scan after %d ms", nowMS - _ctx.lastNewMS, scanMS);
+    app_core_metrics_inc(_ctx.mEarlyEnd);
+    _ctx.endedEarly = true;
+    AppCore_module_done(_ctx.scanner);
+}
+
+/** callback fns from BLE generic package */
+static void ble_cb(WBLE_EVENT_t e, void* d) {
+    switch(e) {
+        case WBLE_COMM_FAIL: {
+            log_debug("MBS: comm nok");
+            setErrors(EM_BLE_COMM_FAIL);
+            app_core_metrics_inc(_ctx.mCommFail);
+            _ctx.scanning = false;
+            break;
+        }
+        case WBLE_COMM_OK: {
+            // Scan over the union of the ranges of the subscribers we're feeding
+            uint16_t majorStart = 0xFFFF;
+            uint16_t majorEnd = 0;
+            for(int i=0;i<_ctx.nbSubs;i++) {
+                if (_ctx.subs[i].inScan) {
+                    majorStart = (_ctx.subs[i].majorStart < majorStart) ? _ctx.subs[i].majorStart : majorStart;
+                    majorEnd = (_ctx.subs[i].majorEnd > majorEnd) ? _ctx.subs[i].majorEnd : majorEnd;
+                }
+            }
+            if (_ctx.scanning && majorStart==_ctx.scanMajorStart && majorEnd==_ctx.scanMajorEnd) {
+                log_debug("MBS: comm ok, still scanning %04x-%04x", majorStart, majorEnd);
+                break;      // carried on from the last cycle, no gap
+            }
+            log_debug("MBS: comm ok, scan %04x-%04x", majorStart, majorEnd);
+            wble_scan_start(_ctx.wbleCtx, _ctx.uuid, majorStart, majorEnd, BLE_TABLE_STAGING_SZ, &_ctx.staging[0]);
+            _ctx.scanning = true;
+            _ctx.scanMajorStart = majorStart;
+            _ctx.scanMajorEnd = majorEnd;
+            break;
+        }
+        case WBLE_SCAN_RX_IB: {
+            // wble mgr fills in the staging list we gave it, move them into the tables
+            mergeStaging();
+            break;
+        }
+        default: {
+            log_debug("MBS cb %d", e);
+            break;
+        }
+    }
+}
+
+void BLEScan_subscribe(APP_MOD_ID_t mid, uint16_t majorStart, uint16_t majorEnd, BLE_TABLE_t* tbl, bool keepPowered) {
+    assert(_ctx.nbSubs<MAX_SUBSCRIBERS);
+    if (_ctx.nbSubs==0) {
+        // first user : initialise access (this is resistant to multiple calls, eg by the modules that ibeacon)
+        _ctx.wbleCtx = wble_mgr_init(MYNEWT_VAL(MOD_BLE_UART), MYNEWT_VAL(MOD_BLE_UART_BAUDRATE), MYNEWT_VAL(MOD_BLE_PWRIO), MYNEWT_VAL(MOD_BLE_UARTIO), MYNEWT_VAL(MOD_BLE_UART_SELECT));
+        _ctx.mCommFail = app_core_metrics_register("ble_commfail", APP_CORE_METRIC_COUNTER);
+        _ctx.mEarlyEnd = app_core_metrics_register("ble_scanearly", APP_CORE_METRIC_COUNTER);
+        _ctx.mStagingFull = app_core_metrics_register("ble_stagefull", APP_CORE_METRIC_COUNTER);
+        os_callout_init(&_ctx.quietTimer, os_eventq_dflt_get(), quietCheck, NULL);
+    }
+    _ctx.subs[_ctx.nbSubs].mid = mid;
+    _ctx.subs[_ctx.nbSubs].majorStart = majorStart;
+    _ctx.subs[_ctx.nbSubs].majorEnd = majorEnd;
+    _ctx.subs[_ctx.nbSubs].tbl = tbl;
+    _ctx.subs[_ctx.nbSubs].keepPowered = keepPowered;
+    _ctx.nbSubs++;
+}
+
+void BLEScan_setRxHandler(APP_MOD_ID_t mid, BLE_SCAN_RX_FN_t fn) {
+    int me = findSub(mid);
+    assert(me>=0);
+    _ctx.subs[me].rxFn = fn;
+}
+
+void BLEScan_noteNew(APP_MOD_ID_t mid) {
+    int me = findSub(mid);
+    if (me>=0) {
+        _ctx.subs[me].nbNoted++;
+    }
+}
+void BLEScan_noteCount(APP_MOD_ID_t mid, uint32_t total) {
+    int me = findSub(mid);
+    if (me<0) {
+        return;
+    }
+    // only what it went up by is new (lower means it started counting again)
+    if (total > _ctx.subs[me].countAt) {
+        uint32_t nb = _ctx.subs[me].nbNoted + (total - _ctx.subs[me].countAt);
+        _ctx.subs[me].nbNoted = (nb>0xFFFF) ? 0xFFFF : nb;
+    }
+    _ctx.subs[me].countAt = total;
+}
+
+void BLEScan_setContinuous(APP_MOD_ID_t mid, bool continuous) {
+    int me = findSub(mid);
+    assert(me>=0);
+    _ctx.subs[me].continuous = continuous;
+    if (continuous) {
+        _ctx.subs[me].keepPowered = true;
+    }
+}
+
+uint32_t BLEScan_start(APP_MOD_ID_t mid, uint32_t scanTimeMS) {
+    int me = findSub(mid);
+    assert(me>=0);
+    if (_ctx.subs[me].fed) {
+        _ctx.subs[me].fed = false;
+        // Still this cycle?
+        if (_ctx.scanULTime==AppCore_lastULTime() && (TMMgr_getRelTimeSecs() - _ctx.scanEndS) <= MAX_REUSE_SECS) {
+            log_debug("MBS: mod %d already fed", mid);
+            return BLE_SCAN_FED_MS;
+        }
+    }
+    if (_ctx.scanning) {
+        // a continuous scan carried on since the last cycle : what it got so far goes to the tables it was feeding
+        mergeStaging();
+    } else {
+        memset(&_ctx.staging[0], 0, sizeof(_ctx.staging));
+    }
+    // We're the scanner, feed all the active subscribers
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        _ctx.subs[i].inScan = (i==me || AppCore_getModuleState(_ctx.subs[i].mid));
+        _ctx.subs[i].fed = (i!=me && _ctx.subs[i].inScan);
+    }
+    _ctx.scanner = mid;
+    _ctx.scanULTime = AppCore_lastULTime();
+    CFMgr_getOrAddElement(CFG_UTIL_KEY_BLE_IBEACON_UUID, &_ctx.uuid, UUID_SZ);
+    _ctx.prevScanStartS = _ctx.scanStartS;
+    _ctx.scanStartS = TMMgr_getRelTimeSecs();
+    _ctx.scanStartMS = TMMgr_getRelTimeMS();
+    _ctx.lastNewMS = _ctx.scanStartMS;
+    _ctx.endedEarly = false;
+    _ctx.minMS = MYNEWT_VAL(MOD_BLE_SCAN_MIN_TIME_MS);
+    _ctx.quietMS = MYNEWT_VAL(MOD_BLE_SCAN_QUIET_MS);
+    CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_MIN_TIME_MS, &_ctx.minMS, 0, 60000);
+    CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_QUIET_MS, &_ctx.quietMS, 0, 60000);
+    // Fixed scan time (the module's), or adapted to what we've been seeing
+    uint8_t targetPct = MYNEWT_VAL(MOD_BLE_SCAN_TARGET_PCT);
+    uint32_t maxMS = MYNEWT_VAL(MOD_BLE_SCAN_MAX_TIME_MS);
+    CFMgr_getOrAddElementCheckRangeUINT8(CFG_UTIL_KEY_BLE_SCAN_TARGET_PCT, &targetPct, 0, 100);
+    CFMgr_getOrAddElementCheckRangeUINT32(CFG_UTIL_KEY_BLE_SCAN_MAX_TIME_MS, &maxMS, 1000, 60000);
+    if (targetPct>0) {
+        scanTimeMS = adaptScanTime(targetPct, _ctx.minMS, maxMS);
+    }
+    _ctx.nbScans++;
+    _ctx.scanTimeMS = scanTimeMS;
+    memset(&_ctx.curve, 0, sizeof(_ctx.curve));
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        if (_ctx.subs[i].inScan) {
+            BLETable_mark(_ctx.subs[i].tbl, _ctx.scanStartS);
+        }
+        _ctx.subs[i].nbNoted = 0;
+    }
+    if (_ctx.quietMS>0) {
+        armQuietCheck(_ctx.scanStartMS);
+    }
+    // start ble to go (may already be running), with a callback to tell me when its comm is ok (may be immediate if already running)
+    // Request to scan is sent once comm is ok
+    wble_start(_ctx.wbleCtx, ble_cb);
+    return scanTimeMS;
+}
+
+void BLEScan_stop(APP_MOD_ID_t mid) {
+    if (_ctx.scanner!=mid) {
+        return;     // not ours
+    }
+    os_callout_stop(&_ctx.quietTimer);
+    mergeStaging();
+    // Keep its discovery curve : if it ended early, nothing more was coming so it counts as scanning for the full time
+    sampleCurve(_ctx.endedEarly ? _ctx.scanTimeMS : (TMMgr_getRelTimeMS() - _ctx.scanStartMS));
+    _ctx.curves[_ctx.curveIdx] = _ctx.curve;
+    _ctx.curveIdx = (_ctx.curveIdx + 1) % CURVE_HISTORY;
+    _ctx.nbCurves = (_ctx.nbCurves < CURVE_HISTORY) ? (_ctx.nbCurves + 1) : CURVE_HISTORY;
+    _ctx.scanner = NO_SCANNER;
+    _ctx.scanEndS = TMMgr_getRelTimeSecs();
+    // Continuous subscribers we were feeding keep getting the adverts until their next cycle, the others are done
+    bool continuous = false;
+    bool keepPowered = false;
+    for(int i=0;i<_ctx.nbSubs;i++) {
+        _ctx.subs[i].inScan &= _ctx.subs[i].continuous;
+        continuous |= _ctx.subs[i].inScan;
+        keepPowered |= _ctx.subs[i].keepPowered;
+    }
+    if (continuous) {
+        return;
+    }
+    // Done BLE, go idle
+    wble_scan_stop(_ctx.wbleCtx);
+    _ctx.scanning = false;
+    if (!keepPowered) {
+        // and power down
+        wble_stop(_ctx.wbleCtx);
+    }
+}
+
+void BLEScan_flush() {
+    mergeStaging();
+}
+
+void BLEScan_snapshot(APP_MOD_ID_t mid) {
+    mergeStaging();
+    _ctx.snapshot = true;
+}
+void BLEScan_commit(APP_MOD_ID_t mid) {
+    // If the staging list filled up while it was held, the wblemgr had nowhere to put any more new beacons
+    int nbHeld = 0;
+    for(int s=0;s<BLE_TABLE_STAGING_SZ;s++) {
+        if (_ctx.staging[s].lastSeenAt!=0) {
+            nbHeld++;
+        }
+    }
+    if (nbHeld==BLE_TABLE_STAGING_SZ) {
+        // not the tables being full : just counted, the modules' error bits are for what they send
+        log_warn("MBS: staging full during snapshot, adverts may be lost");
+        app_core_metrics_inc(_ctx.mStagingFull);
+    }
+    _ctx.snapshot = false;
+    mergeStaging();
+}
+
+uint8_t BLEScan_getErrors(APP_MOD_ID_t mid) {
+    int me = findSub(mid);
+    if (me<0) {
+        return 0;
+    }
+    uint8_t em = _ctx.subs[me].errors;
+    _ctx.subs[me].errors = 0;
+    return em;
+}
+
+bool BLEScan_isFeeding(APP_MOD_ID_t mid) {
+    int me = findSub(mid);
+    return (me>=0 && _ctx.scanning && _ctx.subs[me].inScan);
+}
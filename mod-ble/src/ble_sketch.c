@@ -0,0 +1,109 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// HyperLogLog distinct counting of the countable beacon types
+#include "os/os.h"
+
+#include "mod-ble/ble_sketch.h"
+
+// alpha(64) x 64 x 64 : the HLL bias correction for 64 registers, times m squared
+#define ALPHA_MM (2904)
+// 64 x ln(64/V) for V=1..64 empty registers : the linear counting estimate used while many registers are still empty
+static const uint16_t LINEAR_COUNT[BLE_SKETCH_REGS] = {
+    266, 222, 196, 177, 163, 151, 142, 133, 126, 119, 113, 107, 102, 97, 93, 89,
+    85, 81, 78, 74, 71, 68, 65, 63, 60, 58, 55, 53, 51, 48, 46, 44,
+    42, 40, 39, 37, 35, 33, 32, 30, 28, 27, 25, 24, 23, 21, 20, 18,
+    17, 16, 15, 13, 12, 11, 10, 9, 7, 6, 5, 4, 3, 2, 1, 0,
+};
+
+// murmur3 finaliser : the major/minors are very regular so they need mixing well
+static uint32_t hash(uint16_t major, uint16_t minor) {
+    uint32_t h = (((uint32_t)major)<<16) | minor;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+void BLESketch_clear(BLE_SKETCH_t* sk, int nb) {
+    memset(sk, 0, nb*sizeof(BLE_SKETCH_t));
+}
+
+bool BLESketch_add(BLE_SKETCH_t* sk, int nb, uint16_t major, uint16_t minor, bool* isNew) {
+    uint8_t type = (major >> 8);
+    BLE_SKETCH_t* s = NULL;
+    for(int i=0;i<nb && s==NULL;i++) {
+        if (sk[i].type==type) {
+            s = &sk[i];
+        }
+    }
+    for(int i=0;i<nb && s==NULL;i++) {
+        if (sk[i].type==0) {
+            s = &sk[i];
+            s->type = type;
+        }
+    }
+    if (s==NULL) {
+        return false;
+    }
+    bool raised = BLESketch_addTo(s, major, minor);
+    if (isNew!=NULL) {
+        *isNew = raised;
+    }
+    return true;
+}
+
+bool BLESketch_addTo(BLE_SKETCH_t* s, uint16_t major, uint16_t minor) {
+    uint32_t h = hash(major, minor);
+    // low 6 bits pick the register, the rank is the position of the first 1 in the rest
+    uint8_t reg = h & (BLE_SKETCH_REGS-1);
+    uint32_t w = h >> 6;
+    uint8_t rank = 1;
+    while ((w & 1)==0 && rank<=26) {
+        w >>= 1;
+        rank++;
+    }
+    if (rank > s->regs[reg]) {
+        s->regs[reg] = rank;
+        return true;
+    }
+    return false;
+}
+
+void BLESketch_merge(BLE_SKETCH_t* into, BLE_SKETCH_t* from) {
+    for(int i=0;i<BLE_SKETCH_REGS;i++) {
+        if (from->regs[i] > into->regs[i]) {
+            into->regs[i] = from->regs[i];
+        }
+    }
+}
+
+uint32_t BLESketch_estimate(BLE_SKETCH_t* s) {
+    // harmonic mean of 2^rank, in 32 bit fixed point
+    uint64_t sum = 0;
+    int nbEmpty = 0;
+    for(int i=0;i<BLE_SKETCH_REGS;i++) {
+        sum += (1ull<<32) >> s->regs[i];
+        if (s->regs[i]==0) {
+            nbEmpty++;
+        }
+    }
+    uint32_t est = (uint32_t)((((uint64_t)ALPHA_MM)<<32) / sum);
+    if (est <= (5*BLE_SKETCH_REGS)/2 && nbEmpty>0) {
+        // small range : linear counting is better
+        est = LINEAR_COUNT[nbEmpty-1];
+    }
+    return est;
+}
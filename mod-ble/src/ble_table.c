@@ -0,0 +1,428 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// Hash indexed beacon tracking table for the BLE scanning modules
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/wblemgr.h"
+
+#include "app-core/app_metrics.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+
+// Keep this much history when moving the base time on (so ages up to here are exact)
+#define MIN_HISTORY_S (0x8000)
+// new smoothed rssi = old + (advert - old)/2^n
+#define RSSI_SMOOTH_SHIFT (MYNEWT_VAL(MOD_BLE_RSSI_SMOOTH))
+
+// Eviction classes : lowest evicted first
+#define EVICT_CLASS_COUNT (0)
+#define EVICT_CLASS_PRESENCE (1)
+#define EVICT_CLASS_NEVER (2)
+
+// id as sent in the ULs : major LSB and minor
+#define ULID(e) ((((uint32_t)((e)->major & 0xff))<<16) | (e)->minor)
+
+// eviction counters per class, shared by all the tables
+static APP_CORE_METRIC_ID_t _mEvict[EVICT_CLASS_NEVER];
+
+static uint16_t homeSlot(BLE_TABLE_t* t, uint16_t major, uint16_t minor) {
+    // multiplicative hash, folded so the high bits (which mix best) count too
+    uint32_t k = (((uint32_t)major)<<16) | minor;
+    k *= 2654435761u;
+    return (k ^ (k >> 16)) & (t->nbSlots-1);
+}
+// distance along the probe sequence from slot a to slot b
+static uint16_t probeDist(BLE_TABLE_t* t, uint16_t a, uint16_t b) {
+    return (b + t->nbSlots - a) & (t->nbSlots-1);
+}
+// Find the slot for this major/minor, or the empty one that ends its probe chain
+static uint16_t findSlot(BLE_TABLE_t* t, uint16_t major, uint16_t minor) {
+    uint16_t i = homeSlot(t, major, minor);
+    while (t->slots[i].used) {
+        if (t->slots[i].major==major && t->slots[i].minor==minor) {
+            break;
+        }
+        i = (i+1) & (t->nbSlots-1);
+    }
+    return i;       // always terminates as there is always at least 1 empty slot
+}
+// Remove and shift back the following entries in the chain that are allowed to be where the hole is. Returns the slot left empty
+static uint16_t removeAt(BLE_TABLE_t* t, uint16_t hole) {
+    t->fingerprint -= BLETable_idHash(t->slots[hole].major, t->slots[hole].minor);
+    uint16_t j = hole;
+    while(true) {
+        j = (j+1) & (t->nbSlots-1);
+        if (!t->slots[j].used) {
+            break;      // end of chain
+        }
+        uint16_t h = homeSlot(t, t->slots[j].major, t->slots[j].minor);
+        // can move back if the hole is between its home and where it is now
+        if (probeDist(t, h, j) >= probeDist(t, hole, j)) {
+            t->slots[hole] = t->slots[j];
+            hole = j;
+        }
+    }
+    memset(&t->slots[hole], 0, sizeof(BLE_TABLE_ENTRY_t));
+    t->nbActive--;
+    return hole;
+}
+// Move the base time on if needed so that now fits in the 16 bit relative times. Entries older than the new base saturate at it.
+static void rebase(BLE_TABLE_t* t, uint32_t now) {
+    if (now<t->baseS || (now - t->baseS) <= 0xFFFF) {
+        return;
+    }
+    uint32_t shift = (now - t->baseS) - MIN_HISTORY_S;
+    for(int i=0;i<t->nbSlots;i++) {
+        if (t->slots[i].used) {
+            t->slots[i].lastSeen = (t->slots[i].lastSeen > shift) ? (t->slots[i].lastSeen - shift) : 0;
+            t->slots[i].firstSeen = (t->slots[i].firstSeen > shift) ? (t->slots[i].firstSeen - shift) : 0;
+        }
+    }
+    t->baseS += shift;
+}
+// Relative time for an entry. Call rebase() for the latest time first
+static uint16_t relTime(BLE_TABLE_t* t, uint32_t ts) {
+    if (ts<=t->baseS) {
+        return 0;
+    }
+    return ((ts - t->baseS) > 0xFFFF) ? 0xFFFF : (ts - t->baseS);
+}
+static uint32_t age(BLE_TABLE_t* t, uint16_t rel, uint32_t now) {
+    return ((t->baseS + rel) < now) ? (now - (t->baseS + rel)) : 0;
+}
+// Fold an advert's rssi into the entry's smoothed one (in 1/16dB so that small steps aren't lost)
+static void smoothRSSI(BLE_TABLE_ENTRY_t* e, int8_t rssi) {
+    int16_t v = (e->rssi * 16) + e->rssiFrac;
+    v += ((rssi * 16) - v) / (1 << RSSI_SMOOTH_SHIFT);
+    e->rssiFrac = (v & 0x0F);       // rounds down, for negative values too
+    e->rssi = (v - e->rssiFrac) / 16;
+}
+static int evictClass(uint16_t major) {
+    uint8_t bletype = (major >> 8) & 0xff;
+    if (bletype==BLE_TYPE_ENTEREXIT || bletype==BLE_TYPE_PROXIMITY) {
+        return EVICT_CLASS_NEVER;
+    }
+    return (bletype==BLE_TYPE_PRESENCE) ? EVICT_CLASS_PRESENCE : EVICT_CLASS_COUNT;
+}
+// Is a a better candidate for eviction than b (in the same class)?
+static bool evictBefore(BLE_TABLE_t* t, uint16_t aLastSeen, int8_t aRSSI, uint16_t bLastSeen, int8_t bRSSI) {
+    if (t->evictPolicy==BLE_TABLE_EVICT_WEAKEST) {
+        return (aRSSI < bRSSI) || (aRSSI==bRSSI && aLastSeen < bLastSeen);
+    }
+    return (aLastSeen < bLastSeen) || (aLastSeen==bLastSeen && aRSSI < bRSSI);
+}
+// Table is full : make space for ib (seen at seenAt), whose free slot is at, if the policy finds an entry worth less.
+// Returns the slot ib now goes in, or -1 if it doesn't fit
+static int evict(BLE_TABLE_t* t, ibeacon_data_t* ib, uint32_t seenAt, uint16_t at) {
+    if (t->evictPolicy==BLE_TABLE_EVICT_NONE) {
+        return -1;
+    }
+    // look at the next BLE_TABLE_EVICT_SCAN slots, or on until one can be evicted (if the table is mostly enter/exits)
+    int victim = -1;
+    int victimClass = EVICT_CLASS_NEVER;
+    uint16_t i = t->evictFrom;
+    for(int n=0;n<t->nbSlots && (n<BLE_TABLE_EVICT_SCAN || victim<0);n++, i=(i+1) & (t->nbSlots-1)) {
+        if (t->slots[i].used) {
+            int c = evictClass(t->slots[i].major);
+            if (c < victimClass || (c==victimClass && c!=EVICT_CLASS_NEVER &&
+                    evictBefore(t, t->slots[i].lastSeen, t->slots[i].rssi, t->slots[victim].lastSeen, t->slots[victim].rssi))) {
+                victim = i;
+                victimClass = c;
+            }
+        }
+    }
+    t->evictFrom = i;
+    if (victim<0) {
+        return -1;          // all enter/exits
+    }
+    // only if the new one is worth more : higher class, or same class but would not itself be evicted first
+    int newClass = evictClass(ib->major);
+    if (newClass < victimClass ||
+            (newClass==victimClass && !evictBefore(t, t->slots[victim].lastSeen, t->slots[victim].rssi, relTime(t, seenAt), ib->rssi))) {
+        return -1;
+    }
+    log_debug("MB:evict %04x:%04x for %04x:%04x", t->slots[victim].major, t->slots[victim].minor, ib->major, ib->minor);
+    app_core_metrics_inc(_mEvict[victimClass]);
+    // the removal leaves one slot empty : if it is on ib's probe chain before its free slot, ib goes there, else its slot is unchanged
+    uint16_t home = homeSlot(t, ib->major, ib->minor);
+    uint16_t hole = removeAt(t, victim);
+    return (probeDist(t, home, hole) < probeDist(t, home, at)) ? hole : at;
+}
+
+void BLETable_init(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* slots, int capacity) {
+    assert(capacity>0 && BLE_TABLE_SLOTS(capacity)>capacity);
+    t->slots = slots;
+    t->capacity = capacity;
+    t->nbSlots = BLE_TABLE_SLOTS(capacity);
+    t->evictPolicy = MYNEWT_VAL(MOD_BLE_TABLE_EVICT);
+    BLETable_clear(t);
+    // shared by all tables, registering again just gets the same ones
+    _mEvict[EVICT_CLASS_COUNT] = app_core_metrics_register("ble_evict_count", APP_CORE_METRIC_COUNTER);
+    _mEvict[EVICT_CLASS_PRESENCE] = app_core_metrics_register("ble_evict_pres", APP_CORE_METRIC_COUNTER);
+}
+void BLETable_setEvictPolicy(BLE_TABLE_t* t, BLE_TABLE_EVICT_t policy) {
+    t->evictPolicy = policy;
+}
+void BLETable_clear(BLE_TABLE_t* t) {
+    memset(t->slots, 0, t->nbSlots*sizeof(BLE_TABLE_ENTRY_t));
+    t->nbActive = 0;
+    t->evictFrom = 0;
+    t->baseS = 0;
+    t->nbSeenSinceMark = 0;
+    t->markS = 0;
+    t->fingerprint = 0;
+}
+int BLETable_capacity(BLE_TABLE_t* t) {
+    return t->capacity;
+}
+int BLETable_nbActive(BLE_TABLE_t* t) {
+    return t->nbActive;
+}
+bool BLETable_isFull(BLE_TABLE_t* t) {
+    return (t->nbActive >= BLETable_capacity(t));
+}
+
+BLE_TABLE_ENTRY_t* BLETable_find(BLE_TABLE_t* t, uint16_t major, uint16_t minor) {
+    uint16_t i = findSlot(t, major, minor);
+    return (t->slots[i].used) ? &t->slots[i] : NULL;
+}
+
+BLE_TABLE_ENTRY_t* BLETable_addOrUpdate(BLE_TABLE_t* t, ibeacon_data_t* ib, uint32_t now) {
+    // Use the scanner's timestamp if it gave one
+    uint32_t seenAt = (ib->lastSeenAt!=0) ? ib->lastSeenAt : now;
+    uint16_t i = findSlot(t, ib->major, ib->minor);
+    BLE_TABLE_ENTRY_t* e = &t->slots[i];
+    rebase(t, seenAt);
+    if (!e->used) {
+        if (BLETable_isFull(t)) {
+            int at = evict(t, ib, seenAt, i);
+            if (at<0) {
+                return NULL;
+            }
+            e = &t->slots[at];
+        }
+        // insert
+        e->used = 1;
+        e->major = ib->major;
+        e->minor = ib->minor;
+        e->firstSeen = relTime(t, seenAt);
+        e->new = 1;        // for UL
+        e->inULCnt = 0;
+        e->rssi = ib->rssi;
+        e->rssiFrac = 0;
+        e->missed = 0;
+        t->nbActive++;
+        t->nbAdded++;
+        t->fingerprint += BLETable_idHash(e->major, e->minor);
+        t->nbSeenSinceMark++;
+    } else {
+        if ((t->baseS + e->lastSeen) < t->markS) {
+            t->nbSeenSinceMark++;
+        }
+        smoothRSSI(e, ib->rssi);
+    }
+    e->lastSeen = relTime(t, seenAt);
+    e->extra = ib->extra;
+#if MYNEWT_VAL(MOD_BLE_TABLE_DEVADDR)
+    memcpy(e->devaddr, ib->devaddr, DEVADDR_SZ);
+#endif
+    return e;
+}
+
+void BLETable_remove(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e) {
+    if (e!=NULL && e->used) {
+        removeAt(t, (e - t->slots));
+    }
+}
+
+uint64_t BLETable_fingerprint(BLE_TABLE_t* t) {
+    return t->fingerprint;
+}
+// 64 bit hash of an id for the set fingerprint (splitmix64 finaliser : every input bit affects every output bit)
+uint64_t BLETable_idHash(uint16_t major, uint16_t minor) {
+    uint64_t k = (((uint64_t)major)<<16) | minor;
+    k += 0x9e3779b97f4a7c15ull;
+    k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ull;
+    k = (k ^ (k >> 27)) * 0x94d049bb133111ebull;
+    return k ^ (k >> 31);
+}
+uint32_t BLETable_lastSeenAgeS(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now) {
+    return age(t, e->lastSeen, now);
+}
+uint32_t BLETable_firstSeenAgeS(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now) {
+    return age(t, e->firstSeen, now);
+}
+void BLETable_setSeenAt(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t firstSeenAt, uint32_t lastSeenAt) {
+    rebase(t, lastSeenAt);
+    e->firstSeen = relTime(t, firstSeenAt);
+    e->lastSeen = relTime(t, lastSeenAt);
+}
+
+void BLETable_iterStart(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it) {
+    // start on an empty slot (there is always one)
+    it->cur = 0;
+    while (t->slots[it->cur].used) {
+        it->cur++;
+    }
+    it->nbDone = 0;
+    it->stay = false;
+}
+BLE_TABLE_ENTRY_t* BLETable_iterNext(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it) {
+    while(true) {
+        if (it->stay) {
+            it->stay = false;
+        } else {
+            if (it->nbDone >= t->nbSlots) {
+                return NULL;
+            }
+            it->cur = (it->cur+1) & (t->nbSlots-1);
+            it->nbDone++;
+        }
+        if (t->slots[it->cur].used) {
+            return &t->slots[it->cur];
+        }
+    }
+}
+void BLETable_iterRemove(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it) {
+    if (t->slots[it->cur].used) {
+        removeAt(t, it->cur);
+        it->stay = true;
+    }
+}
+void BLETable_iterRef(BLE_TABLE_t* t, BLE_TABLE_ITER_t* it, uint32_t now, BLE_TABLE_REF_t* ref) {
+    BLETable_entryRef(t, &t->slots[it->cur], now, ref);
+}
+void BLETable_entryRef(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now, BLE_TABLE_REF_t* ref) {
+    uint32_t seenMins = BLETable_firstSeenAgeS(t, e, now) / 60;
+    ref->slot = (e - t->slots);
+    ref->seenMins = (seenMins<255 ? seenMins : 255);
+}
+BLE_TABLE_ENTRY_t* BLETable_refEntry(BLE_TABLE_t* t, BLE_TABLE_REF_t* ref) {
+    return &t->slots[ref->slot];
+}
+void BLETable_sortRefs(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, bool byLastSeen, bool oldestFirst) {
+    // insertion sort : n is at most the table size, and the refs are often already mostly in order
+    for(int i=1;i<n;i++) {
+        BLE_TABLE_REF_t r = refs[i];
+        BLE_TABLE_ENTRY_t* e = &t->slots[r.slot];
+        // seen times are all relative to the same base so compare directly
+        uint16_t ts = (byLastSeen ? e->lastSeen : e->firstSeen);
+        int j = i;
+        while(j>0) {
+            BLE_TABLE_ENTRY_t* p = &t->slots[refs[j-1].slot];
+            uint16_t pts = (byLastSeen ? p->lastSeen : p->firstSeen);
+            if (oldestFirst ? (pts <= ts) : (pts >= ts)) {
+                break;
+            }
+            refs[j] = refs[j-1];
+            j--;
+        }
+        refs[j] = r;
+    }
+}
+void BLETable_sortRefsById(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n) {
+    for(int i=1;i<n;i++) {
+        BLE_TABLE_REF_t r = refs[i];
+        uint32_t id = ULID(&t->slots[r.slot]);
+        int j = i;
+        while(j>0 && ULID(&t->slots[refs[j-1].slot]) > id) {
+            refs[j] = refs[j-1];
+            j--;
+        }
+        refs[j] = r;
+    }
+}
+void BLETable_removeRefs(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n) {
+    // Removal only shifts back entries later in the iteration order (which starts on the first empty slot), so sort by position
+    // in that order, last first
+    BLE_TABLE_ITER_t it;
+    BLETable_iterStart(t, &it);
+    for(int i=1;i<n;i++) {
+        BLE_TABLE_REF_t r = refs[i];
+        uint16_t pos = probeDist(t, it.cur, r.slot);
+        int j = i;
+        while(j>0 && probeDist(t, it.cur, refs[j-1].slot) < pos) {
+            refs[j] = refs[j-1];
+            j--;
+        }
+        refs[j] = r;
+    }
+    for(int i=0;i<n;i++) {
+        if (t->slots[refs[i].slot].used) {
+            removeAt(t, refs[i].slot);
+        }
+    }
+}
+void BLETable_removeOlder(BLE_TABLE_t* t, uint32_t maxAgeS, uint32_t now) {
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(t, &it);
+    while((e=BLETable_iterNext(t, &it))!=NULL) {
+        if (BLETable_lastSeenAgeS(t, e, now) > maxAgeS) {
+            BLETable_iterRemove(t, &it);
+        }
+    }
+}
+void BLETable_mark(BLE_TABLE_t* t, uint32_t now) {
+    if (t->markS!=0) {
+        BLE_TABLE_ITER_t it;
+        BLE_TABLE_ENTRY_t* e;
+        BLETable_iterStart(t, &it);
+        while((e=BLETable_iterNext(t, &it))!=NULL) {
+            e->missed = BLETable_missedScans(t, e);
+        }
+    }
+    t->markS = now;
+    t->nbSeenSinceMark = 0;
+}
+void BLETable_setMarkAt(BLE_TABLE_t* t, uint32_t markS) {
+    t->markS = markS;
+    t->nbSeenSinceMark = 0;
+}
+uint8_t BLETable_missedScans(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e) {
+    if ((t->baseS + e->lastSeen) >= t->markS) {
+        return 0;
+    }
+    return (e->missed<15) ? (e->missed + 1) : 15;
+}
+bool BLETable_isGone(BLE_TABLE_t* t, BLE_TABLE_ENTRY_t* e, uint32_t now, uint32_t timeoutS, uint8_t missedScans) {
+    bool timedOut = (BLETable_lastSeenAgeS(t, e, now) > timeoutS);
+    if (missedScans==0) {
+        return timedOut;
+    }
+#if MYNEWT_VAL(MOD_BLE_EXIT_MISSED_WITH_TIME)
+    return (BLETable_missedScans(t, e)>=missedScans && timedOut);
+#else
+    return (BLETable_missedScans(t, e)>=missedScans);
+#endif
+}
+int BLETable_nbExpected(BLE_TABLE_t* t, uint32_t seenSince, uint32_t notSince, uint32_t now) {
+    if (now < notSince || notSince < seenSince) {
+        return 0;
+    }
+    int nb = 0;
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(t, &it);
+    while((e=BLETable_iterNext(t, &it))!=NULL) {
+        if (evictClass(e->major)==EVICT_CLASS_NEVER) {
+            uint32_t ageS = BLETable_lastSeenAgeS(t, e, now);
+            if (ageS > (now - notSince) && ageS <= (now - seenSince)) {
+                nb++;
+            }
+        }
+    }
+    return nb;
+}
@@ -0,0 +1,138 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// BLE scan trace recorder : dump scan table snapshots to the log in a compact hex form for offline replay
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/timemgr.h"
+#include "wyres-generic/wblemgr.h"
+
+#include "app-core/app_core.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+#include "mod-ble/ble_trace.h"
+
+#if MYNEWT_VAL(MOD_BLE_TRACE)
+// Keep log lines short enough for the log buffer
+#define TRACE_RECS_PER_LINE (4)
+
+static struct {
+    uint16_t seq;
+    char line[(BLE_TRACE_REC_SZ*TRACE_RECS_PER_LINE*2)+1];
+    char* p;
+    int nInLine;
+} _ctx;
+
+static const char* HEX = "0123456789ABCDEF";
+
+static char* addHexByte(char* p, uint8_t b) {
+    *p++ = HEX[(b>>4) & 0x0F];
+    *p++ = HEX[b & 0x0F];
+    return p;
+}
+static char* addHexU16(char* p, uint16_t v) {
+    p = addHexByte(p, (v & 0xff));
+    return addHexByte(p, ((v >> 8) & 0xff));
+}
+static uint16_t sat16(uint32_t v) {
+    return (v > 0xFFFF) ? 0xFFFF : v;
+}
+static void start(APP_MOD_ID_t mid, uint32_t now, int nValid, int32_t markAge) {
+    _ctx.seq++;
+    // header : module, snapshot sequence number, time now, number of records to follow, secs since the scan mark
+    log_info("BT:S %s %d %d %d %d", AppCore_getModuleName(mid), _ctx.seq, now, nValid, markAge);
+    _ctx.p = &_ctx.line[0];
+    _ctx.nInLine = 0;
+}
+static void addRecord(uint16_t major, uint16_t minor, int8_t rssi, uint8_t extra, uint16_t lastAge, uint16_t firstAge, bool isNew,
+        uint8_t missed, uint8_t inULCnt) {
+    char* p = _ctx.p;
+    p = addHexU16(p, major);
+    p = addHexU16(p, minor);
+    p = addHexByte(p, (uint8_t)rssi);
+    p = addHexByte(p, extra);
+    p = addHexU16(p, lastAge);
+    p = addHexU16(p, firstAge);
+    p = addHexByte(p, (isNew ? 0x01 : 0x00) | (missed << 4));
+    p = addHexByte(p, inULCnt);
+    _ctx.nInLine++;
+    if (_ctx.nInLine>=TRACE_RECS_PER_LINE) {
+        *p = '\0';
+        log_info("BT:R %d %s", _ctx.seq, _ctx.line);
+        p = &_ctx.line[0];
+        _ctx.nInLine = 0;
+    }
+    _ctx.p = p;
+}
+static void end() {
+    if (_ctx.nInLine>0) {
+        *_ctx.p = '\0';
+        log_info("BT:R %d %s", _ctx.seq, _ctx.line);
+    }
+    log_info("BT:E %d", _ctx.seq);
+}
+#endif
+
+void BLETrace_snapshotTable(APP_MOD_ID_t mid, BLE_TABLE_t* t) {
+#if MYNEWT_VAL(MOD_BLE_TRACE)
+    uint32_t now = TMMgr_getRelTimeSecs();
+    // (the missed scans are counted up to the mark, so replaying needs it to tell which were seen since)
+    start(mid, now, BLETable_nbActive(t), (t->markS!=0 ? (int32_t)(now - t->markS) : -1));
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(t, &it);
+    while((e=BLETable_iterNext(t, &it))!=NULL) {
+        addRecord(e->major, e->minor, e->rssi, e->extra, sat16(BLETable_lastSeenAgeS(t, e, now)), sat16(BLETable_firstSeenAgeS(t, e, now)),
+            e->new, e->missed, e->inULCnt);
+    }
+    end();
+#endif
+}
+
+void BLETrace_loadMark(BLE_TABLE_t* t, int32_t markAgeS, uint32_t now) {
+    if (markAgeS<0) {
+        BLETable_setMarkAt(t, 0);
+    } else {
+        // 0 means 'no mark', so one older than the uptime is at the start of time
+        BLETable_setMarkAt(t, ((uint32_t)markAgeS<now) ? (now - markAgeS) : 1);
+    }
+}
+
+int BLETrace_loadRecords(BLE_TABLE_t* t, const uint8_t* recs, int sz, uint32_t now) {
+    if (sz<0 || (sz % BLE_TRACE_REC_SZ)!=0) {
+        return -1;
+    }
+    int nb = 0;
+    for(const uint8_t* r=recs;r<(recs+sz);r+=BLE_TRACE_REC_SZ) {
+        ibeacon_data_t ib;
+        memset(&ib, 0, sizeof(ib));
+        ib.major = r[0] + (r[1]<<8);
+        ib.minor = r[2] + (r[3]<<8);
+        ib.rssi = (int8_t)r[4];
+        ib.extra = r[5];
+        uint32_t lastAge = r[6] + (r[7]<<8);
+        uint32_t firstAge = r[8] + (r[9]<<8);
+        // 0 means 'empty entry', so the ones older than the uptime were seen at the start of time
+        ib.lastSeenAt = (lastAge<now) ? (now - lastAge) : 1;
+        BLE_TABLE_ENTRY_t* e = BLETable_addOrUpdate(t, &ib, now);
+        if (e!=NULL) {
+            e->new = ((r[10] & 0x01)!=0);
+            e->missed = (r[10] >> 4);
+            e->inULCnt = r[11];
+            BLETable_setSeenAt(t, e, (firstAge<now) ? (now - firstAge) : 1, ib.lastSeenAt);
+            nb++;
+        }
+    }
+    return nb;
+}
@@ -0,0 +1,287 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// BLE UL space allocation between event classes
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+
+#include "app-core/app_core.h"
+#include "app-core/app_msg.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_ul.h"
+
+// TLV header in the UL : tag and length
+#define TL_HDR_UL_SZ (2)
+
+// unsigned LEB128 ie 7 bits per byte with b7 set if more to come
+static uint8_t writeVarint(uint8_t* b, uint32_t v) {
+    uint8_t n = 0;
+    while (v>=0x80) {
+        b[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    return n;
+}
+static uint8_t varintSz(uint32_t v) {
+    uint8_t n = 1;
+    while (v>=0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+static uint32_t packedId(BLE_TABLE_ENTRY_t* e, uint8_t flags) {
+    if (flags & BLE_UL_PACKED_MAJOR) {
+        return e->minor;
+    }
+    return (((uint32_t)(e->major & 0xff))<<16) | e->minor;
+}
+static uint8_t quantRSSI(int8_t rssi) {
+    int q = (rssi - BLE_UL_RSSI_Q_MIN) / BLE_UL_RSSI_Q_STEP;
+    return (q<0 ? 0 : (q>15 ? 15 : q));
+}
+
+int BLEUL_allocate(BLE_UL_CLASS_t* classes, int nbClasses, int bytesAvailable) {
+    int remaining = (bytesAvailable>0) ? bytesAvailable : 0;
+    for(int i=0;i<nbClasses;i++) {
+        classes[i].nbToAdd = 0;
+    }
+    // Each round either fully serves at least one class (whose unused share goes round again), or gives each of those
+    // left what fits in its share and ends. So at most nbClasses rounds.
+    bool served = true;
+    while(served) {
+        int totalWeight = 0;
+        for(int i=0;i<nbClasses;i++) {
+            if (classes[i].weight>0 && classes[i].nbToAdd<classes[i].nbWaiting) {
+                totalWeight += classes[i].weight;
+            }
+        }
+        if (totalWeight==0) {
+            break;
+        }
+        served = false;
+        int used = 0;
+        for(int i=0;i<nbClasses;i++) {
+            BLE_UL_CLASS_t* c = &classes[i];
+            if (c->weight>0 && c->nbToAdd<c->nbWaiting) {
+                int need = (c->nbWaiting - c->nbToAdd) * c->itemSz;
+                if (need <= (remaining * c->weight) / totalWeight) {
+                    c->nbToAdd = c->nbWaiting;
+                    used += need;
+                    served = true;
+                }
+            }
+        }
+        if (!served) {
+            // nobody fits in their share : each gets what does
+            for(int i=0;i<nbClasses;i++) {
+                BLE_UL_CLASS_t* c = &classes[i];
+                if (c->weight>0 && c->nbToAdd<c->nbWaiting) {
+                    int n = ((remaining * c->weight) / totalWeight) / c->itemSz;
+                    c->nbToAdd += n;
+                    used += n * c->itemSz;
+                }
+            }
+        }
+        remaining -= used;
+    }
+    // What is left goes to whoever is still waiting, in order
+    int backlog = 0;
+    for(int i=0;i<nbClasses;i++) {
+        BLE_UL_CLASS_t* c = &classes[i];
+        int n = remaining / c->itemSz;
+        if (n > (c->nbWaiting - c->nbToAdd)) {
+            n = (c->nbWaiting - c->nbToAdd);
+        }
+        c->nbToAdd += n;
+        remaining -= n * c->itemSz;
+        backlog += (c->nbWaiting - c->nbToAdd);
+    }
+    return backlog;
+}
+
+uint8_t BLEUL_packedFlags(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t fields) {
+    uint8_t flags = fields & ~(BLE_UL_PACKED_MAJOR | BLE_UL_PACKED_EXTRA);
+    bool sameMajor = (n>0);
+    bool anyExtra = false;
+    for(int i=0;i<n;i++) {
+        BLE_TABLE_ENTRY_t* e = BLETable_refEntry(t, &refs[i]);
+        if ((e->major & 0xff) != (BLETable_refEntry(t, &refs[0])->major & 0xff)) {
+            sameMajor = false;
+        }
+        if (e->extra!=0) {
+            anyExtra = true;
+        }
+    }
+    if (sameMajor) {
+        flags |= BLE_UL_PACKED_MAJOR;
+    }
+    if ((fields & BLE_UL_PACKED_EXTRA) && anyExtra) {
+        flags |= BLE_UL_PACKED_EXTRA;
+    }
+    return flags;
+}
+
+int BLEUL_pack(BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t flags, uint8_t* buf, int maxSz, uint8_t* sz) {
+    int hdrSz = 2 + ((flags & BLE_UL_PACKED_MAJOR) ? 1 : 0);
+    int recSz = ((flags & BLE_UL_PACKED_EXTRA) ? 1 : 0) + ((flags & BLE_UL_PACKED_SEEN) ? 1 : 0);
+    if (n>255) {
+        n = 255;
+    }
+    // how many fit?
+    int nb = 0;
+    int idsSz = 0;
+    uint32_t prev = 0;
+    while(nb<n) {
+        uint32_t id = packedId(BLETable_refEntry(t, &refs[nb]), flags);
+        int idSz = varintSz(id - prev);      // the first is from 0
+        int total = hdrSz + idsSz + idSz + (nb+1)*recSz + ((flags & BLE_UL_PACKED_RSSI) ? (nb+2)/2 : 0);
+        if (total>maxSz) {
+            break;
+        }
+        idsSz += idSz;
+        prev = id;
+        nb++;
+    }
+    *sz = 0;
+    if (nb==0) {
+        return 0;
+    }
+    int off = 0;
+    buf[off++] = flags;
+    buf[off++] = nb;
+    if (flags & BLE_UL_PACKED_MAJOR) {
+        buf[off++] = (BLETable_refEntry(t, &refs[0])->major & 0xff);
+    }
+    prev = 0;
+    for(int i=0;i<nb;i++) {
+        uint32_t id = packedId(BLETable_refEntry(t, &refs[i]), flags);
+        off += writeVarint(&buf[off], id - prev);
+        prev = id;
+    }
+    if (flags & BLE_UL_PACKED_RSSI) {
+        for(int i=0;i<nb;i++) {
+            uint8_t q = quantRSSI(BLETable_refEntry(t, &refs[i])->rssi);
+            if ((i%2)==0) {
+                buf[off] = q;
+            } else {
+                buf[off++] |= (q<<4);
+            }
+        }
+        if ((nb%2)!=0) {
+            off++;
+        }
+    }
+    if (flags & BLE_UL_PACKED_EXTRA) {
+        for(int i=0;i<nb;i++) {
+            buf[off++] = BLETable_refEntry(t, &refs[i])->extra;
+        }
+    }
+    if (flags & BLE_UL_PACKED_SEEN) {
+        for(int i=0;i<nb;i++) {
+            buf[off++] = refs[i].seenMins;
+        }
+    }
+    *sz = off;
+    return nb;
+}
+
+uint8_t BLEUL_packPresence(const uint8_t* bits, int maxId, uint8_t* buf) {
+    // size of each format
+    int bitmapSz = (maxId/8)+1;
+    int nbPresent = 0;
+    int nbRuns = 0;
+    for(int i=0;i<=maxId;i++) {
+        if (bits[i/8] & (1<<(i%8))) {
+            nbPresent++;
+            if (i==0 || (bits[(i-1)/8] & (1<<((i-1)%8)))==0) {
+                nbRuns++;
+            }
+        }
+    }
+    int off = 0;
+    if (bitmapSz<=nbPresent && bitmapSz<=(nbRuns*2)) {
+        buf[off++] = BLE_UL_PRESENCE_BITMAP;
+        memcpy(&buf[off], bits, bitmapSz);
+        off += bitmapSz;
+    } else if (nbPresent<=(nbRuns*2)) {
+        buf[off++] = BLE_UL_PRESENCE_LIST;
+        for(int i=0;i<=maxId;i++) {
+            if (bits[i/8] & (1<<(i%8))) {
+                buf[off++] = i;
+            }
+        }
+    } else {
+        buf[off++] = BLE_UL_PRESENCE_RUNS;
+        for(int i=0;i<=maxId;i++) {
+            if (bits[i/8] & (1<<(i%8))) {
+                if (i==0 || (bits[(i-1)/8] & (1<<((i-1)%8)))==0) {
+                    // start of a run
+                    buf[off++] = i;
+                    off++;
+                }
+                buf[off-1] = i;     // last of the run so far
+            }
+        }
+    }
+    return off;
+}
+
+bool BLEUL_addTLV(APP_CORE_UL_t* ul, uint8_t tag, uint8_t sz, uint8_t* v, uint8_t* errorMask) {
+    if (app_core_msg_ul_remainingSz(ul) < (TL_HDR_UL_SZ + sz)) {
+        if (app_core_msg_ul_requestNextUL(ul) <= 0) {
+            log_debug("MB: no next UL for tag %d", tag);
+            *errorMask |= EM_UL_NONEXTUL;
+            return false;
+        }
+    }
+    if (!app_core_msg_ul_addTLV(ul, tag, sz, v)) {
+        log_debug("MB: no space in UL for tag %d", tag);
+        *errorMask |= EM_UL_NOSPACE;
+        return false;
+    }
+    return true;
+}
+
+int BLEUL_addPacked(APP_CORE_UL_t* ul, uint8_t tag, BLE_TABLE_t* t, BLE_TABLE_REF_t* refs, int n, uint8_t fields, uint8_t* errorMask) {
+    BLETable_sortRefsById(t, refs, n);
+    uint8_t flags = BLEUL_packedFlags(t, refs, n, fields);
+    int nbAdded = 0;
+    bool newUL = false;
+    while(nbAdded<n) {
+        uint8_t v[APP_CORE_UL_MAX_SZ];
+        uint8_t sz = 0;
+        int nb = BLEUL_pack(t, &refs[nbAdded], n-nbAdded, flags, v, app_core_msg_ul_remainingSz(ul)-TL_HDR_UL_SZ, &sz);
+        if (nb==0) {
+            // move to next message (0=no next!), unless this one was already empty
+            if (newUL || app_core_msg_ul_requestNextUL(ul) <= 0) {
+                log_debug("MB: no next UL still got %d", (n-nbAdded));
+                *errorMask |= EM_UL_NONEXTUL;
+                break;
+            }
+            newUL = true;
+            continue;
+        }
+        if (!app_core_msg_ul_addTLV(ul, tag, sz, v)) {
+            // this should not happen as we packed to the space left
+            log_debug("MB: no space in UL for %d", nb);
+            *errorMask |= EM_UL_NOSPACE;
+            break;
+        }
+        nbAdded += nb;
+        newUL = false;
+    }
+    return nbAdded;
+}
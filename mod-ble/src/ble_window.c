@@ -0,0 +1,127 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// Sliding window distinct counts of the countable beacon types
+#include "os/os.h"
+
+#include "mod-ble/ble_window.h"
+
+#if BLE_WINDOW_BUCKETS<1
+#error "MOD_BLE_COUNT_WINDOW_BUCKETS must be >= 1"
+#endif
+
+void BLEWindow_init(BLE_WINDOW_t* w, BLE_WINDOW_TYPE_t* types, int nbTypes, uint32_t windowS, uint32_t now) {
+    uint32_t bucketS = windowS / BLE_WINDOW_BUCKETS;
+    if (bucketS==0) {
+        bucketS = 1;
+    }
+    if (w->types==types && w->bucketS==bucketS) {
+        return;         // same window, keep counting
+    }
+    memset(types, 0, nbTypes*sizeof(BLE_WINDOW_TYPE_t));
+    w->types = types;
+    w->nbTypes = nbTypes;
+    w->bucketS = bucketS;
+    w->bucketStart = now;
+    w->cur = 0;
+    w->nbSamples = 0;
+}
+
+void BLEWindow_advance(BLE_WINDOW_t* w, uint32_t now) {
+    int nbSteps = 0;
+    while ((now - w->bucketStart) >= w->bucketS) {
+        if (nbSteps>=BLE_WINDOW_BUCKETS) {
+            // the whole window has gone so the counts stay 0 : the rest of a long gap is just empty samples
+            uint32_t nbEmpty = (now - w->bucketStart) / w->bucketS;
+            w->bucketStart += nbEmpty * w->bucketS;
+            w->nbSamples = ((w->nbSamples + nbEmpty) > 0xFFFF ? 0xFFFF : (w->nbSamples + nbEmpty));
+            break;
+        }
+        // sample the count as at the end of this bucket, then open the next one
+        w->cur = (w->cur+1) % BLE_WINDOW_BUCKETS;
+        for(int i=0;i<w->nbTypes;i++) {
+            if (w->types[i].type!=0) {
+                uint16_t c = BLEWindow_count(w, i);
+                if (c > w->types[i].peak) {
+                    w->types[i].peak = c;
+                }
+                w->types[i].total += c;
+                // (the count was of the buckets before this one, so before emptying it)
+                memset(w->types[i].buckets[w->cur].regs, 0, BLE_SKETCH_REGS);
+            }
+        }
+        nbSteps++;
+        w->bucketStart += w->bucketS;
+        if (w->nbSamples<0xFFFF) {
+            w->nbSamples++;
+        }
+    }
+}
+
+bool BLEWindow_seen(BLE_WINDOW_t* w, uint16_t major, uint16_t minor, uint32_t now, bool* isNew) {
+    uint8_t type = (major >> 8);
+    BLEWindow_advance(w, now);
+    BLE_WINDOW_TYPE_t* wt = NULL;
+    for(int i=0;i<w->nbTypes && wt==NULL;i++) {
+        if (w->types[i].type==type) {
+            wt = &w->types[i];
+        }
+    }
+    for(int i=0;i<w->nbTypes && wt==NULL;i++) {
+        if (w->types[i].type==0) {
+            wt = &w->types[i];
+            memset(wt, 0, sizeof(BLE_WINDOW_TYPE_t));
+            wt->type = type;
+        }
+    }
+    if (wt==NULL) {
+        return false;
+    }
+    bool raised = BLESketch_addTo(&wt->buckets[w->cur], major, minor);
+    if (isNew!=NULL) {
+        *isNew = raised;
+    }
+    return true;
+}
+
+uint16_t BLEWindow_count(BLE_WINDOW_t* w, int slot) {
+    BLE_SKETCH_t all;
+    memset(&all, 0, sizeof(all));
+    for(int i=0;i<BLE_WINDOW_BUCKETS;i++) {
+        BLESketch_merge(&all, &w->types[slot].buckets[i]);
+    }
+    uint32_t c = BLESketch_estimate(&all);
+    return (c>0xFFFF ? 0xFFFF : c);
+}
+uint16_t BLEWindow_peak(BLE_WINDOW_t* w, int slot) {
+    uint16_t c = BLEWindow_count(w, slot);
+    return (c > w->types[slot].peak ? c : w->types[slot].peak);
+}
+uint16_t BLEWindow_mean(BLE_WINDOW_t* w, int slot) {
+    if (w->nbSamples==0) {
+        // no bucket ended since the reset
+        return BLEWindow_count(w, slot);
+    }
+    return (w->types[slot].total / w->nbSamples);
+}
+
+void BLEWindow_resetStats(BLE_WINDOW_t* w) {
+    for(int i=0;i<w->nbTypes;i++) {
+        w->types[i].peak = 0;
+        w->types[i].total = 0;
+        if (w->types[i].type!=0 && BLEWindow_count(w, i)==0) {
+            w->types[i].type = 0;
+        }
+    }
+    w->nbSamples = 0;
+}
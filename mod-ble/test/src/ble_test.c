@@ -0,0 +1,76 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+// mod-ble unit tests : run on the native target with 'newt test mod-ble/test'
+#include "os/os.h"
+#include "sysinit/sysinit.h"
+
+#include "ble_test.h"
+
+BLE_TABLE_ENTRY_t* ble_test_add(BLE_TABLE_t* t, uint16_t major, uint16_t minor, int8_t rssi, uint8_t extra, uint32_t now) {
+    ibeacon_data_t ib;
+    memset(&ib, 0, sizeof(ib));
+    ib.major = major;
+    ib.minor = minor;
+    ib.rssi = rssi;
+    ib.extra = extra;
+    return BLETable_addOrUpdate(t, &ib, now);
+}
+
+TEST_SUITE(ble_table_suite) {
+    ble_table_test_insert();
+    ble_table_test_remove();
+    ble_table_test_iter_remove();
+    ble_table_test_rebase();
+    ble_table_test_evict();
+}
+
+TEST_SUITE(ble_ul_suite) {
+    ble_ul_test_allocate();
+    ble_ul_test_pack();
+    ble_ul_test_pack_presence();
+}
+
+TEST_SUITE(ble_classify_suite) {
+    ble_classify_test_table();
+    ble_classify_test_settle();
+}
+
+TEST_SUITE(ble_count_suite) {
+    ble_sketch_test_small();
+    ble_sketch_test_large();
+    ble_navsel_test_topk();
+}
+
+TEST_SUITE(ble_replay_suite) {
+    ble_replay_test_scan_tag();
+}
+
+TEST_SUITE(ble_bench_suite) {
+    ble_bench_test_scan_tag();
+}
+
+#if MYNEWT_VAL(SELFTEST)
+int main(int argc, char** argv) {
+    sysinit();
+
+    ble_table_suite();
+    ble_ul_suite();
+    ble_classify_suite();
+    ble_count_suite();
+    ble_replay_suite();
+    ble_bench_suite();
+
+    return tu_any_failed;
+}
+#endif
@@ -0,0 +1,52 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_BLE_TEST_H
+#define H_BLE_TEST_H
+
+#include "os/os.h"
+#include "testutil/testutil.h"
+#include "wyres-generic/wblemgr.h"
+#include "mod-ble/mod_ble.h"
+#include "mod-ble/ble_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Small table for the tests, so the probe chains get long and wrap round the end
+#define BLE_TEST_CAPACITY (16)
+
+// Add (or update) a beacon seen at now
+BLE_TABLE_ENTRY_t* ble_test_add(BLE_TABLE_t* t, uint16_t major, uint16_t minor, int8_t rssi, uint8_t extra, uint32_t now);
+
+TEST_CASE_DECL(ble_table_test_insert);
+TEST_CASE_DECL(ble_table_test_remove);
+TEST_CASE_DECL(ble_table_test_iter_remove);
+TEST_CASE_DECL(ble_table_test_rebase);
+TEST_CASE_DECL(ble_table_test_evict);
+TEST_CASE_DECL(ble_ul_test_allocate);
+TEST_CASE_DECL(ble_ul_test_pack);
+TEST_CASE_DECL(ble_ul_test_pack_presence);
+TEST_CASE_DECL(ble_classify_test_table);
+TEST_CASE_DECL(ble_classify_test_settle);
+TEST_CASE_DECL(ble_sketch_test_small);
+TEST_CASE_DECL(ble_sketch_test_large);
+TEST_CASE_DECL(ble_navsel_test_topk);
+TEST_CASE_DECL(ble_replay_test_scan_tag);
+TEST_CASE_DECL(ble_bench_test_scan_tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLE_TEST_H */
@@ -0,0 +1,37 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#include <stdio.h>
+#include "ble_test.h"
+#include "app-core/app_core.h"
+#include "mod-ble/ble_bench.h"
+
+// Table sizes benched on the host : the test syscfg sizes the scan-tag and scratch tables (and the arena) for the largest
+static const int BENCH_TEST_SIZES[] = { 250, 500, 1000 };
+
+TEST_CASE(ble_bench_test_scan_tag) {
+    for(int mix=0;BLEBench_mixName(mix)!=NULL;mix++) {
+        for(int s=0;s<sizeof(BENCH_TEST_SIZES)/sizeof(BENCH_TEST_SIZES[0]);s++) {
+            BLE_BENCH_RESULT_t res;
+            TEST_ASSERT_FATAL(BLEBench_run(APP_MOD_BLE_SCAN_TAGS, BENCH_TEST_SIZES[s], mix, &res));
+            // the tables must hold them all (but presence beacons, only 256 distinct), and every mix has something to send
+            TEST_ASSERT(res.nb<=BENCH_TEST_SIZES[s] && res.nb>=(BENCH_TEST_SIZES[s]*9)/10);
+            TEST_ASSERT(res.ul->msgs[0].sz>0);
+            TEST_ASSERT(res.ul->msgNbFilling<APP_CORE_UL_MAX_NB);
+            printf("scan-tag %s n=%d : %d us, UL %d msgs\n", BLEBench_mixName(mix), res.nb, (int)res.elapsedUS, res.ul->msgNbFilling+1);
+        }
+    }
+    // an unregistered module can't be benched
+    BLE_BENCH_RESULT_t res;
+    TEST_ASSERT(!BLEBench_run(APP_MOD_BLE_SCAN_NAV, 250, 0, &res));
+}
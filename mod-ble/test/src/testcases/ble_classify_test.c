@@ -0,0 +1,105 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+
+#include "ble_test.h"
+#include "mod-ble/ble_classify.h"
+
+static BLE_TABLE_ENTRY_t _slots[BLE_TABLE_SLOTS(BLE_TEST_CAPACITY)];
+static BLE_TABLE_t _tbl;
+static BLE_TABLE_REF_t _refs[BLE_TEST_CAPACITY];
+static BLE_CLASSIFY_t _cls;
+
+#define PRESENCE_MSB (0x12)
+
+// Seen long enough ago to be gone (the exit timeout is 1 min)
+static BLE_TABLE_ENTRY_t* addAt(uint16_t major, uint16_t minor, int8_t rssi, bool entered, uint32_t seenAt) {
+    BLE_TABLE_ENTRY_t* e = ble_test_add(&_tbl, major, minor, rssi, 0, seenAt);
+    TEST_ASSERT_FATAL(e!=NULL);
+    e->new = !entered;
+    return e;
+}
+
+TEST_CASE(ble_classify_test_table) {
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    memset(&_cls, 0, sizeof(_cls));
+    _cls.tbl = &_tbl;
+    _cls.refs = &_refs[0];
+    _cls.nbRefs = BLE_TEST_CAPACITY;
+    _cls.exitTimeoutMins = 1;
+    _cls.presenceMinorMSB = PRESENCE_MSB;
+    _cls.enterRSSI = -80;
+    _cls.exitRSSI = -90;
+    uint32_t now = 1000;
+    addAt((BLE_TYPE_ENTEREXIT<<8), 1, -60, false, now);           // enters
+    addAt((BLE_TYPE_ENTEREXIT<<8), 2, -85, false, now);           // too weak to enter yet, but waits
+    addAt((BLE_TYPE_ENTEREXIT<<8), 3, -85, false, now-100);       // never strong enough and gone : dropped
+    addAt((BLE_TYPE_ENTEREXIT<<8), 4, -60, true, now-100);        // exits
+    addAt((BLE_TYPE_ENTEREXIT<<8), 5, -95, true, now);            // exits as too weak
+    addAt((BLE_TYPE_ENTEREXIT<<8), 6, -60, true, now);            // stays
+    addAt((BLE_TYPE_PRESENCE<<8), (PRESENCE_MSB<<8) | 9, -60, false, now);
+    addAt((BLE_TYPE_PRESENCE<<8), (PRESENCE_MSB<<8) | 3, -60, false, now-100);   // gone
+    addAt((BLE_TYPE_PRESENCE<<8), 0x0005, -60, false, now);       // not our minor
+    addAt((BLE_TYPE_COUNTABLE_START<<8), 1, -60, false, now);
+    addAt((BLE_TYPE_COUNTABLE_START<<8), 2, -60, false, now);
+    addAt(((BLE_TYPE_COUNTABLE_START+1)<<8), 3, -60, false, now-100);    // gone
+    addAt((BLE_TYPE_PROXIMITY<<8), 1, -60, false, now);           // not sent, no error
+    TEST_ASSERT(BLEClassify_table(&_cls, now)==0);
+    TEST_ASSERT(_cls.nbEnter==2);
+    TEST_ASSERT(_cls.nbExit==2);
+    TEST_ASSERT(_cls.nbCount==2 && _cls.tcount[0]==2 && _cls.tcount[1]==0);
+    TEST_ASSERT(_cls.maxMinorIdPresence==9 && _cls.presenceBits[1]==0x02 && _cls.presenceBits[0]==0);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==8);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 3)==NULL);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_PROXIMITY<<8), 1)==NULL);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_PRESENCE<<8), 0x0005)==NULL);
+    // only the strong enough new one goes in the UL
+    TEST_ASSERT(BLEClassify_entersToSend(&_cls)==1);
+    TEST_ASSERT(BLETable_refEntry(&_tbl, &BLE_CLASSIFY_ENTER_REF(&_cls, 0))->minor==1);
+    // nav types were not asked for
+    addAt((BLE_TYPE_NAV<<8), 1, -60, false, now);
+    TEST_ASSERT(BLEClassify_table(&_cls, now)==EM_BLE_RX_BADMAJ);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_NAV<<8), 1)==NULL);
+}
+
+TEST_CASE(ble_classify_test_settle) {
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    _cls.tbl = &_tbl;
+    uint32_t now = 1000;
+    addAt((BLE_TYPE_ENTEREXIT<<8), 1, -60, true, now);
+    addAt((BLE_TYPE_COUNTABLE_START<<8), 1, -60, false, now);
+    TEST_ASSERT(BLEClassify_table(&_cls, now)==0);
+    TEST_ASSERT(_cls.nbExit==0 && _cls.nbCount==1);
+    // adverts during the scan : a new enter/exit is referenced straight away, unwanted ones are dropped
+    ibeacon_data_t ib;
+    memset(&ib, 0, sizeof(ib));
+    ib.major = (BLE_TYPE_PROXIMITY<<8);
+    TEST_ASSERT(BLEClassify_advert(&_cls, &ib)==BLE_CLASSIFY_DROP);
+    ib.major = (BLE_TYPE_PRESENCE<<8);
+    ib.minor = 0x0001;
+    TEST_ASSERT(BLEClassify_advert(&_cls, &ib)==BLE_CLASSIFY_DROP);
+    ib.major = (BLE_TYPE_NAV<<8);
+    TEST_ASSERT(BLEClassify_advert(&_cls, &ib)==BLE_CLASSIFY_UNEXPECTED);
+    ib.major = (BLE_TYPE_ENTEREXIT<<8);
+    ib.minor = 2;
+    ib.rssi = -60;
+    TEST_ASSERT(BLEClassify_advert(&_cls, &ib)==BLE_CLASSIFY_TRACK);
+    BLEClassify_added(&_cls, BLETable_addOrUpdate(&_tbl, &ib, now+10), now+10);
+    TEST_ASSERT(_cls.nbEnter==1);
+    // the scan is over 2 mins later and only saw the new one : the entered one exits, the countable is no longer counted
+    ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 2, -60, 0, now+120);
+    BLEClassify_settle(&_cls, now+120);
+    TEST_ASSERT(_cls.nbEnter==1 && _cls.nbExit==1 && _cls.nbCount==0);
+    TEST_ASSERT(BLETable_refEntry(&_tbl, &BLE_CLASSIFY_EXIT_REF(&_cls, 0))->minor==1);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==3);
+}
@@ -0,0 +1,86 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#include "ble_test.h"
+#include "mod-ble/ble_sketch.h"
+#include "mod-ble/ble_navsel.h"
+
+TEST_CASE(ble_sketch_test_small) {
+    BLE_SKETCH_t sk[2];
+    BLESketch_clear(&sk[0], 2);
+    TEST_ASSERT(BLESketch_estimate(&sk[0])==0);
+    // a few distinct ones, each added several times : counted (nearly) exactly
+    for(int rep=0;rep<3;rep++) {
+        for(int i=0;i<20;i++) {
+            TEST_ASSERT(BLESketch_add(&sk[0], 2, (0x10<<8), 500+i, NULL));
+        }
+    }
+    uint32_t est = BLESketch_estimate(&sk[0]);
+    TEST_ASSERT(est>=17 && est<=23);
+    // another type takes the other sketch, a third has none
+    TEST_ASSERT(BLESketch_add(&sk[0], 2, (0x11<<8), 1, NULL));
+    TEST_ASSERT(!BLESketch_add(&sk[0], 2, (0x12<<8), 1, NULL));
+    TEST_ASSERT(BLESketch_estimate(&sk[0])==est);
+    // the same one again is never new
+    bool isNew = true;
+    TEST_ASSERT(BLESketch_add(&sk[0], 2, (0x11<<8), 1, &isNew));
+    TEST_ASSERT(!isNew);
+}
+
+TEST_CASE(ble_sketch_test_large) {
+    BLE_SKETCH_t sk;
+    // Large populations (spread over the major LSBs of one type, as on a dense site) : within 3 standard errors (13% each)
+    static const int NBS[] = { 300, 1000, 5000, 20000 };
+    for(int n=0;n<(int)(sizeof(NBS)/sizeof(NBS[0]));n++) {
+        BLESketch_clear(&sk, 1);
+        for(int i=0;i<NBS[n];i++) {
+            TEST_ASSERT_FATAL(BLESketch_add(&sk, 1, (0x10<<8) + (i%7), i/7, NULL));
+        }
+        uint32_t est = BLESketch_estimate(&sk);
+        TEST_ASSERT(est>=(uint32_t)(NBS[n]*6)/10 && est<=(uint32_t)(NBS[n]*14)/10);
+        // adding them all again changes nothing
+        for(int i=0;i<NBS[n];i++) {
+            BLESketch_add(&sk, 1, (0x10<<8) + (i%7), i/7, NULL);
+        }
+        TEST_ASSERT(BLESketch_estimate(&sk)==est);
+    }
+}
+
+TEST_CASE(ble_navsel_test_topk) {
+    BLE_NAVSEL_ENTRY_t heap[5];
+    BLE_NAVSEL_t sel;
+    BLENavSel_init(&sel, &heap[0], 5, NULL, 0);
+    TEST_ASSERT(BLENavSel_endScan(&sel)==0);
+    // offered in a scrambled order, some twice with a weaker rssi
+    for(int i=0;i<50;i++) {
+        int id = (i*17) % 50;
+        BLENavSel_offer(&sel, 0x0001, id, -100 + id, id);
+        if ((id%4)==0) {
+            BLENavSel_offer(&sel, 0x0001, id, -110, id);
+        }
+    }
+    TEST_ASSERT_FATAL(BLENavSel_endScan(&sel)==5);
+    BLE_NAVSEL_ENTRY_t* best = BLENavSel_best(&sel);
+    for(int i=0;i<5;i++) {
+        TEST_ASSERT(best[i].minor==(49-i) && best[i].rssi==(-100 + 49 - i) && best[i].extra==(49-i));
+    }
+    // next scan starts again : equal rssis are kept in id order
+    for(int i=10;i>0;i--) {
+        BLENavSel_offer(&sel, 0x0001, i, -70, 0);
+    }
+    TEST_ASSERT_FATAL(BLENavSel_endScan(&sel)==5);
+    best = BLENavSel_best(&sel);
+    for(int i=0;i<5;i++) {
+        TEST_ASSERT(best[i].minor==(i+1) && best[i].rssi==-70);
+    }
+}
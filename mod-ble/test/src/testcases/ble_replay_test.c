@@ -0,0 +1,78 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#include <stdio.h>
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/timemgr.h"
+#include "app-core/app_core.h"
+#include "ble_test.h"
+#include "mod-ble/ble_trace.h"
+#include "mod-ble/ble_bench.h"
+
+// A scan-tag snapshot in the scan trace format (BT:S ... 2, then the BT:R lines), with 2 scans to exit (see the test syscfg) :
+// 8001 new (enter), 8002 and 8004 present (8004 missed just the scan since the mark), 8003 missed 2 scans (exit),
+// presence bits 5 and 9, 2 of type 01 and 1 of type 02. Ages are at most a few secs, so it replays the same at any uptime past them.
+#define SNAP_MARK_AGE (2)
+#define SNAP_MAX_AGE (5)
+static char* SNAP_RECS[] = {
+    "01800100C40000000500010002800200BF0000000500000103800300BA0004000500100104800400B500030005000001",
+    "00810500C20000000500000000810900BC0001000500000001010A00B00000000400000001010B00AF00010003000000",
+    "02020C00AE00000002000000",
+};
+// and the UL scan-tag built from it : exit TLV 20, enter TLV 19, counts TLV 21, presence TLV 25
+static char* SNAP_UL = "00001404030300001305010100C400150401020201190400002002";
+
+// Compare the UL bytes built with the expected ones, printing where they differ
+static bool sameUL(APP_CORE_UL_t* ul, char* expHex) {
+    uint8_t exp[64];
+    int expSz = Util_scanhex(expHex, sizeof(exp), exp);
+    int off = 0;
+    bool same = true;
+    for(int i=0;i<=ul->msgNbFilling && i<APP_CORE_UL_MAX_NB;i++) {
+        for(int j=0;j<ul->msgs[i].sz;j++,off++) {
+            if (off>=expSz) {
+                printf("UL %d byte %d : %02x, expected nothing more\n", i, j, ul->msgs[i].payload[j]);
+                same = false;
+            } else if (ul->msgs[i].payload[j]!=exp[off]) {
+                printf("UL %d byte %d : %02x, expected %02x\n", i, j, ul->msgs[i].payload[j], exp[off]);
+                same = false;
+            }
+        }
+    }
+    if (off<expSz) {
+        printf("UL is %d bytes, expected %d\n", off, expSz);
+        same = false;
+    }
+    return same;
+}
+
+TEST_CASE(ble_replay_test_scan_tag) {
+    // the records' ages are clipped to the uptime, so wait until it is past them
+    while (TMMgr_getRelTimeSecs()<=SNAP_MAX_AGE) {
+        os_time_delay(OS_TICKS_PER_SEC/10);
+    }
+    TEST_ASSERT_FATAL(BLEBench_replayStart(APP_MOD_BLE_SCAN_TAGS, SNAP_MARK_AGE));
+    int nb = 0;
+    for(int i=0;i<sizeof(SNAP_RECS)/sizeof(SNAP_RECS[0]);i++) {
+        uint8_t recs[BLE_TRACE_REC_SZ*4];
+        int sz = Util_scanhex(SNAP_RECS[i], sizeof(recs), recs);
+        TEST_ASSERT_FATAL(sz>0 && (sz % BLE_TRACE_REC_SZ)==0);
+        nb += BLEBench_replayRecords(recs, sz);
+    }
+    TEST_ASSERT(nb==9);
+    APP_CORE_UL_t* ul = BLEBench_replayEnd();
+    TEST_ASSERT_FATAL(ul!=NULL);
+    TEST_ASSERT(sameUL(ul, SNAP_UL));
+    // and a snapshot must be started again to be replayed
+    TEST_ASSERT(BLEBench_replayEnd()==NULL);
+}
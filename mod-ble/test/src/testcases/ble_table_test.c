@@ -0,0 +1,169 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#include "ble_test.h"
+
+static BLE_TABLE_ENTRY_t _slots[BLE_TABLE_SLOTS(BLE_TEST_CAPACITY)];
+static BLE_TABLE_t _tbl;
+
+// Minors spread so that several share a home slot
+#define TEST_MINOR(i) ((i)*BLE_TABLE_SLOTS(BLE_TEST_CAPACITY))
+
+static void fill(int nb, uint32_t now) {
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    BLETable_setEvictPolicy(&_tbl, BLE_TABLE_EVICT_NONE);
+    for(int i=0;i<nb;i++) {
+        TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i), -60, i, now)!=NULL);
+    }
+}
+
+TEST_CASE(ble_table_test_insert) {
+    fill(BLE_TEST_CAPACITY, 100);
+    TEST_ASSERT(BLETable_capacity(&_tbl)==BLE_TEST_CAPACITY);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==BLE_TEST_CAPACITY);
+    TEST_ASSERT(BLETable_isFull(&_tbl));
+    for(int i=0;i<BLE_TEST_CAPACITY;i++) {
+        BLE_TABLE_ENTRY_t* e = BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i));
+        TEST_ASSERT_FATAL(e!=NULL);
+        TEST_ASSERT(e->extra==i);
+        TEST_ASSERT(e->new);
+    }
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(BLE_TEST_CAPACITY))==NULL);
+    // updating one already in is ok when full, a new one is not
+    BLE_TABLE_ENTRY_t* e = ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(3), -60, 0xAA, 110);
+    TEST_ASSERT(e!=NULL && e->extra==0xAA);
+    TEST_ASSERT(BLETable_lastSeenAgeS(&_tbl, e, 120)==10);
+    TEST_ASSERT(BLETable_firstSeenAgeS(&_tbl, e, 120)==20);
+    TEST_ASSERT(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(BLE_TEST_CAPACITY), -60, 0, 110)==NULL);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==BLE_TEST_CAPACITY);
+    // same minor, different major is another beacon
+    BLETable_remove(&_tbl, BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(0)));
+    TEST_ASSERT(ble_test_add(&_tbl, (BLE_TYPE_PRESENCE<<8), TEST_MINOR(0), -60, 0, 110)!=NULL);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(0))==NULL);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_PRESENCE<<8), TEST_MINOR(0))!=NULL);
+}
+
+TEST_CASE(ble_table_test_remove) {
+    fill(BLE_TEST_CAPACITY, 100);
+    // remove every third : the ones after them in the probe chains must still be found
+    uint64_t fp = 0;
+    for(int i=0;i<BLE_TEST_CAPACITY;i++) {
+        if ((i%3)==0) {
+            BLETable_remove(&_tbl, BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i)));
+        } else {
+            fp += BLETable_idHash((BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i));
+        }
+    }
+    int nbLeft = 0;
+    for(int i=0;i<BLE_TEST_CAPACITY;i++) {
+        BLE_TABLE_ENTRY_t* e = BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i));
+        if ((i%3)==0) {
+            TEST_ASSERT(e==NULL);
+        } else {
+            TEST_ASSERT(e!=NULL && e->extra==i);
+            nbLeft++;
+        }
+    }
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==nbLeft);
+    TEST_ASSERT(BLETable_fingerprint(&_tbl)==fp);
+    // removing one not in the table does nothing
+    BLETable_remove(&_tbl, NULL);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==nbLeft);
+    // and the space can be used again
+    TEST_ASSERT(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(0), -60, 0, 110)!=NULL);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==nbLeft+1);
+}
+
+TEST_CASE(ble_table_test_iter_remove) {
+    fill(BLE_TEST_CAPACITY, 100);
+    // removing while iterating moves entries about : each must still be seen exactly once
+    uint8_t seen[BLE_TEST_CAPACITY];
+    memset(seen, 0, sizeof(seen));
+    int nbSeen = 0;
+    BLE_TABLE_ITER_t it;
+    BLE_TABLE_ENTRY_t* e;
+    BLETable_iterStart(&_tbl, &it);
+    while((e=BLETable_iterNext(&_tbl, &it))!=NULL) {
+        TEST_ASSERT_FATAL(e->extra<BLE_TEST_CAPACITY);
+        seen[e->extra]++;
+        nbSeen++;
+        if ((e->extra%2)==0) {
+            BLETable_iterRemove(&_tbl, &it);
+        }
+    }
+    TEST_ASSERT(nbSeen==BLE_TEST_CAPACITY);
+    for(int i=0;i<BLE_TEST_CAPACITY;i++) {
+        TEST_ASSERT(seen[i]==1);
+        TEST_ASSERT((BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i))!=NULL)==((i%2)!=0));
+    }
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==BLE_TEST_CAPACITY/2);
+    // all of them
+    BLETable_iterStart(&_tbl, &it);
+    while((e=BLETable_iterNext(&_tbl, &it))!=NULL) {
+        BLETable_iterRemove(&_tbl, &it);
+    }
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==0);
+    TEST_ASSERT(BLETable_fingerprint(&_tbl)==0);
+}
+
+TEST_CASE(ble_table_test_rebase) {
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    BLE_TABLE_ENTRY_t* e = ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 1, -60, 0, 10);
+    TEST_ASSERT_FATAL(e!=NULL);
+    e = ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 2, -60, 0, 0xFFF0);
+    TEST_ASSERT_FATAL(e!=NULL);
+    // beyond the 16 bit relative times : the base moves on, and recent ages stay exact
+    uint32_t now = 0x10010;
+    TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 3, -60, 0, now)!=NULL);
+    e = BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 2);
+    TEST_ASSERT(BLETable_lastSeenAgeS(&_tbl, e, now)==(now - 0xFFF0));
+    TEST_ASSERT(BLETable_firstSeenAgeS(&_tbl, e, now)==(now - 0xFFF0));
+    e = BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 3);
+    TEST_ASSERT(BLETable_lastSeenAgeS(&_tbl, e, now)==0);
+    // older than the history kept saturates, but is still old enough to time out
+    e = BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 1);
+    TEST_ASSERT(BLETable_lastSeenAgeS(&_tbl, e, now)>=0x8000);
+    TEST_ASSERT(BLETable_lastSeenAgeS(&_tbl, e, now)<=(now - 10));
+    BLETable_removeOlder(&_tbl, 0x7000, now);
+    TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 1)==NULL);
+    TEST_ASSERT(BLETable_nbActive(&_tbl)==2);
+}
+
+TEST_CASE(ble_table_test_evict) {
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    BLETable_setEvictPolicy(&_tbl, BLE_TABLE_EVICT_OLDEST);
+    // an enter/exit seen first (never evicted), then countables each seen a sec later than the last
+    TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(0), -60, 0, 100)!=NULL);
+    for(int i=1;i<BLE_TEST_CAPACITY;i++) {
+        TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_COUNTABLE_START<<8), TEST_MINOR(i), -60, i, 100+i)!=NULL);
+    }
+    TEST_ASSERT_FATAL(BLETable_isFull(&_tbl));
+    // one seen before all of them is not worth evicting for
+    TEST_ASSERT(ble_test_add(&_tbl, (BLE_TYPE_COUNTABLE_START<<8), TEST_MINOR(BLE_TEST_CAPACITY), -60, 0, 50)==NULL);
+    // newer ones each take the place of the oldest countable, and (wherever the removal left the hole) all the rest are still found
+    for(int i=BLE_TEST_CAPACITY;i<3*BLE_TEST_CAPACITY;i++) {
+        TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_COUNTABLE_START<<8), TEST_MINOR(i), -60, i, 100+i)!=NULL);
+        TEST_ASSERT(BLETable_nbActive(&_tbl)==BLE_TEST_CAPACITY);
+        TEST_ASSERT(BLETable_find(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(0))!=NULL);
+        for(int j=1;j<=i;j++) {
+            bool kept = (j > (i - BLE_TEST_CAPACITY + 1));
+            TEST_ASSERT((BLETable_find(&_tbl, (BLE_TYPE_COUNTABLE_START<<8), TEST_MINOR(j))!=NULL)==kept);
+        }
+    }
+    // nothing can go for a new enter/exit if only enter/exits are left
+    BLETable_clear(&_tbl);
+    for(int i=0;i<BLE_TEST_CAPACITY;i++) {
+        TEST_ASSERT_FATAL(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(i), -60, i, 100)!=NULL);
+    }
+    TEST_ASSERT(ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), TEST_MINOR(BLE_TEST_CAPACITY), -60, 0, 200)==NULL);
+}
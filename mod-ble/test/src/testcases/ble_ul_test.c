@@ -0,0 +1,220 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+*/
+
+#include "ble_test.h"
+#include "mod-ble/ble_ul.h"
+
+static BLE_TABLE_ENTRY_t _slots[BLE_TABLE_SLOTS(BLE_TEST_CAPACITY)];
+static BLE_TABLE_t _tbl;
+static BLE_TABLE_REF_t _refs[BLE_TEST_CAPACITY];
+
+static int allocate(BLE_UL_CLASS_t* c, int bytes, int nbA, int szA, int wA, int nbB, int szB, int wB) {
+    memset(c, 0, 2*sizeof(BLE_UL_CLASS_t));
+    c[0].nbWaiting = nbA;
+    c[0].itemSz = szA;
+    c[0].weight = wA;
+    c[1].nbWaiting = nbB;
+    c[1].itemSz = szB;
+    c[1].weight = wB;
+    return BLEUL_allocate(c, 2, bytes);
+}
+
+TEST_CASE(ble_ul_test_allocate) {
+    BLE_UL_CLASS_t c[2];
+    // all fits
+    TEST_ASSERT(allocate(c, 100, 5, 4, 1, 10, 2, 1)==0);
+    TEST_ASSERT(c[0].nbToAdd==5 && c[1].nbToAdd==10);
+    // no space (or less than nothing)
+    TEST_ASSERT(allocate(c, 0, 5, 4, 1, 10, 2, 1)==15);
+    TEST_ASSERT(c[0].nbToAdd==0 && c[1].nbToAdd==0);
+    TEST_ASSERT(allocate(c, -20, 5, 4, 1, 10, 2, 1)==15);
+    TEST_ASSERT(c[0].nbToAdd==0 && c[1].nbToAdd==0);
+    // nothing waiting
+    TEST_ASSERT(allocate(c, 100, 0, 4, 1, 0, 2, 1)==0);
+    TEST_ASSERT(c[0].nbToAdd==0 && c[1].nbToAdd==0);
+    // short : shared by weight
+    TEST_ASSERT(allocate(c, 80, 100, 4, 1, 100, 4, 1)==180);
+    TEST_ASSERT(c[0].nbToAdd==10 && c[1].nbToAdd==10);
+    TEST_ASSERT(allocate(c, 80, 100, 4, 3, 100, 4, 1)==180);
+    TEST_ASSERT(c[0].nbToAdd==15 && c[1].nbToAdd==5);
+    // one needs less than its share : the rest goes to the other
+    TEST_ASSERT(allocate(c, 80, 2, 4, 3, 100, 4, 1)==82);
+    TEST_ASSERT(c[0].nbToAdd==2 && c[1].nbToAdd==18);
+    // weight 0 only gets what is left over
+    TEST_ASSERT(allocate(c, 30, 5, 4, 1, 10, 2, 0)==5);
+    TEST_ASSERT(c[0].nbToAdd==5 && c[1].nbToAdd==5);
+    TEST_ASSERT(allocate(c, 30, 0, 4, 1, 10, 2, 0)==0);
+    TEST_ASSERT(c[1].nbToAdd==10);
+    // rounding leftovers go in class order
+    TEST_ASSERT(allocate(c, 10, 10, 3, 1, 10, 3, 1)==17);
+    TEST_ASSERT(c[0].nbToAdd==2 && c[1].nbToAdd==1);
+    // items bigger than the space
+    TEST_ASSERT(allocate(c, 3, 1, 4, 1, 1, 5, 0)==2);
+    TEST_ASSERT(c[0].nbToAdd==0 && c[1].nbToAdd==0);
+}
+
+static int readVarint(uint8_t* b, uint32_t* v) {
+    int n = 0;
+    int shift = 0;
+    *v = 0;
+    do {
+        *v |= ((uint32_t)(b[n] & 0x7f))<<shift;
+        shift += 7;
+    } while(b[n++] & 0x80);
+    return n;
+}
+// Unpack a packed list and check it against the first nb refs
+static void checkPacked(uint8_t* buf, uint8_t sz, int nb) {
+    int off = 0;
+    uint8_t flags = buf[off++];
+    TEST_ASSERT_FATAL(buf[off++]==nb);
+    uint8_t majorLSB = 0;
+    if (flags & BLE_UL_PACKED_MAJOR) {
+        majorLSB = buf[off++];
+    }
+    uint32_t id = 0;
+    for(int i=0;i<nb;i++) {
+        uint32_t d;
+        off += readVarint(&buf[off], &d);
+        id += d;
+        BLE_TABLE_ENTRY_t* e = BLETable_refEntry(&_tbl, &_refs[i]);
+        if (flags & BLE_UL_PACKED_MAJOR) {
+            TEST_ASSERT(majorLSB==(e->major & 0xff) && id==e->minor);
+        } else {
+            TEST_ASSERT(id==((((uint32_t)(e->major & 0xff))<<16) | e->minor));
+        }
+    }
+    if (flags & BLE_UL_PACKED_RSSI) {
+        for(int i=0;i<nb;i++) {
+            uint8_t q = (buf[off + i/2] >> ((i%2)*4)) & 0x0F;
+            int rssi = BLE_UL_RSSI_Q_MIN + q*BLE_UL_RSSI_Q_STEP;
+            int8_t was = BLETable_refEntry(&_tbl, &_refs[i])->rssi;
+            // quantised down, and clamped to the range
+            TEST_ASSERT((was>=rssi && was<(rssi + BLE_UL_RSSI_Q_STEP)) || (q==0 && was<rssi) || (q==15 && was>=rssi));
+        }
+        off += (nb+1)/2;
+    }
+    if (flags & BLE_UL_PACKED_EXTRA) {
+        for(int i=0;i<nb;i++) {
+            TEST_ASSERT(buf[off++]==BLETable_refEntry(&_tbl, &_refs[i])->extra);
+        }
+    }
+    if (flags & BLE_UL_PACKED_SEEN) {
+        for(int i=0;i<nb;i++) {
+            TEST_ASSERT(buf[off++]==_refs[i].seenMins);
+        }
+    }
+    TEST_ASSERT(off==sz);
+}
+static int refAll(uint32_t now) {
+    int n = 0;
+    BLE_TABLE_ITER_t it;
+    BLETable_iterStart(&_tbl, &it);
+    while(BLETable_iterNext(&_tbl, &it)!=NULL) {
+        BLETable_iterRef(&_tbl, &it, now, &_refs[n++]);
+    }
+    BLETable_sortRefsById(&_tbl, &_refs[0], n);
+    return n;
+}
+
+TEST_CASE(ble_ul_test_pack) {
+    uint8_t buf[128];
+    uint8_t sz;
+    BLETable_init(&_tbl, &_slots[0], BLE_TEST_CAPACITY);
+    // one major : ids are just the minors, and no extras
+    for(int i=0;i<10;i++) {
+        ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8) + 1, 1000 + i*3, -100 + i*7, 0, 60 + i*60);
+    }
+    int n = refAll(3600);
+    TEST_ASSERT_FATAL(n==10);
+    uint8_t flags = BLEUL_packedFlags(&_tbl, &_refs[0], n, BLE_UL_PACKED_RSSI | BLE_UL_PACKED_EXTRA | BLE_UL_PACKED_SEEN);
+    TEST_ASSERT(flags==(BLE_UL_PACKED_MAJOR | BLE_UL_PACKED_RSSI | BLE_UL_PACKED_SEEN));
+    TEST_ASSERT(BLEUL_pack(&_tbl, &_refs[0], n, flags, buf, sizeof(buf), &sz)==n);
+    checkPacked(buf, sz, n);
+    // first id 2 bytes, then 1 each, 5 bytes of rssi, 10 of seen
+    TEST_ASSERT(sz==(BLE_UL_PACKED_HDR_SZ + 2 + 9 + 5 + 10));
+
+    // several majors, with extras
+    ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8) + 2, 5, -50, 0x12, 3600);
+    ble_test_add(&_tbl, (BLE_TYPE_ENTEREXIT<<8), 0xFFFF, -30, 0x34, 3600);
+    n = refAll(3600);
+    TEST_ASSERT_FATAL(n==12);
+    flags = BLEUL_packedFlags(&_tbl, &_refs[0], n, BLE_UL_PACKED_RSSI | BLE_UL_PACKED_EXTRA);
+    TEST_ASSERT(flags==(BLE_UL_PACKED_RSSI | BLE_UL_PACKED_EXTRA));
+    TEST_ASSERT(BLEUL_pack(&_tbl, &_refs[0], n, flags, buf, sizeof(buf), &sz)==n);
+    checkPacked(buf, sz, n);
+
+    // not enough space : packs as many as fit, from the start
+    for(int maxSz=0;maxSz<40;maxSz++) {
+        int nb = BLEUL_pack(&_tbl, &_refs[0], n, flags, buf, maxSz, &sz);
+        TEST_ASSERT(nb>=0 && nb<=n && sz<=maxSz);
+        if (nb>0) {
+            checkPacked(buf, sz, nb);
+        } else {
+            TEST_ASSERT(sz==0);
+        }
+    }
+    // nothing to pack
+    TEST_ASSERT(BLEUL_pack(&_tbl, &_refs[0], 0, flags, buf, sizeof(buf), &sz)==0 && sz==0);
+}
+
+// Unpack a presence value and check it gives the same bits
+static void checkPresence(const uint8_t* bits, int maxId, int expectedFormat) {
+    uint8_t buf[BLE_UL_PRESENCE_MAX_SZ];
+    uint8_t got[32];
+    memset(got, 0, sizeof(got));
+    uint8_t sz = BLEUL_packPresence(bits, maxId, buf);
+    TEST_ASSERT_FATAL(sz>=1 && sz<=BLE_UL_PRESENCE_MAX_SZ);
+    TEST_ASSERT(buf[0]==expectedFormat);
+    if (buf[0]==BLE_UL_PRESENCE_BITMAP) {
+        memcpy(got, &buf[1], sz-1);
+    } else if (buf[0]==BLE_UL_PRESENCE_LIST) {
+        for(int i=1;i<sz;i++) {
+            got[buf[i]/8] |= (1<<(buf[i]%8));
+        }
+    } else {
+        TEST_ASSERT_FATAL(((sz-1)%2)==0);
+        for(int i=1;i<sz;i+=2) {
+            TEST_ASSERT(buf[i]<=buf[i+1]);
+            for(int id=buf[i];id<=buf[i+1];id++) {
+                got[id/8] |= (1<<(id%8));
+            }
+        }
+    }
+    TEST_ASSERT(memcmp(got, bits, (maxId/8)+1)==0);
+}
+
+TEST_CASE(ble_ul_test_pack_presence) {
+    uint8_t bits[32];
+    // just the first
+    memset(bits, 0, sizeof(bits));
+    bits[0] = 0x01;
+    checkPresence(bits, 0, BLE_UL_PRESENCE_BITMAP);
+    // a few spread out : list
+    memset(bits, 0, sizeof(bits));
+    bits[1] = 0x02;
+    bits[12] = 0x10;
+    bits[31] = 0x80;
+    checkPresence(bits, 255, BLE_UL_PRESENCE_LIST);
+    // long runs : runs
+    memset(bits, 0, sizeof(bits));
+    memset(&bits[2], 0xFF, 10);
+    memset(&bits[20], 0xFF, 12);
+    checkPresence(bits, 255, BLE_UL_PRESENCE_RUNS);
+    // every other one : bitmap
+    memset(bits, 0x55, sizeof(bits));
+    checkPresence(bits, 254, BLE_UL_PRESENCE_BITMAP);
+    // all of them : one run
+    memset(bits, 0xFF, sizeof(bits));
+    checkPresence(bits, 255, BLE_UL_PRESENCE_RUNS);
+}
@@ -26,6 +26,7 @@
 
 #include "app-core/app_core.h"
 #include "app-core/app_msg.h"
+#include "app-core/app_metrics.h"
 #include "mod-gps/mod_gps.h"
 
 #define MIN_GOOD_FIXES (5)          // Must get 5 good fixes with acceptable precision to exit
@@ -41,6 +42,9 @@ static struct appctx {
     uint32_t triedAtS;      // TS of last try
     gps_data_t goodFix;     // good (merged) fix
     gps_data_t currFix;     // current fix got from mgr
+    APP_CORE_METRIC_ID_t mTries;
+    APP_CORE_METRIC_ID_t mNoFix;
+    APP_CORE_METRIC_ID_t mCommFail;
 } _ctx;     // all initialised to 0 as bss
 
 static void logGPSPosition(gps_data_t* pos);
@@ -239,6 +243,7 @@ static bool getData(APP_CORE_UL_t* ul) {
 
     // If we tried to get a fix, or if we are in 'on stop' mode, then inform backend of the fix or lack thereof
     if (_ctx.doFix || _ctx.fixMode==FIX_ON_STOP) {
+        app_core_metrics_inc(_ctx.mTries);
         // Did we get a fix this time? (or do we have one from before)
         if (_ctx.goodFix.rxAt!=0) {
             // UL structure, explicitly written to avoid compilier decisions on padding etc
@@ -267,9 +272,11 @@ static bool getData(APP_CORE_UL_t* ul) {
             uint8_t status = GPS_COMM_OK;
             if (_ctx.commFail) {
                 log_info("MG: bad comm for UL");
+                app_core_metrics_inc(_ctx.mCommFail);
                 status = GPS_COMM_FAIL;
             } else {
                 log_info("MG: no fix for UL");
+                app_core_metrics_inc(_ctx.mNoFix);
                 status = GPS_NO_FIX;
             }
             // Send TLV with 1 byte to indicate problem
@@ -305,6 +312,9 @@ void mod_gps_init(void) {
     AppCore_registerModule("GPS", APP_MOD_GPS, &_api, EXEC_SERIAL);
     // Register for the gps action(s)
     AppCore_registerAction(APP_CORE_DL_FIX_GPS, &A_fixgps);
+    _ctx.mTries = app_core_metrics_register("gps_tries", APP_CORE_METRIC_COUNTER);
+    _ctx.mNoFix = app_core_metrics_register("gps_nofix", APP_CORE_METRIC_COUNTER);
+    _ctx.mCommFail = app_core_metrics_register("gps_commfail", APP_CORE_METRIC_COUNTER);
 //    log_debug("mod-gps inited");
 }
 